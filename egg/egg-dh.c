@@ -34,6 +34,7 @@ EGG_SECURE_DECLARE (dh);
 typedef struct _DHGroup {
 	const gchar *name;
 	guint bits;
+	guint exponent_bits;
 	const guchar *prime;
 	gsize n_prime;
 	const guchar base[1];
@@ -171,39 +172,44 @@ static const guchar dh_group_8192_prime[] = {
 	0x60, 0xC9, 0x80, 0xDD, 0x98, 0xED, 0xD3, 0xDF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
 };
 
+/*
+ * The exponent_bits are the size of the short private exponents used with
+ * each group. They're twice the estimated symmetric security strength of
+ * the group, and never less than 256 bits.
+ */
 static const DHGroup dh_groups[] = {
 	{
-		"ietf-ike-grp-modp-768", 768,
+		"ietf-ike-grp-modp-768", 768, 256,
 		dh_group_768_prime, G_N_ELEMENTS (dh_group_768_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-1024", 1024,
+		"ietf-ike-grp-modp-1024", 1024, 256,
 		dh_group_1024_prime, G_N_ELEMENTS (dh_group_1024_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-1536", 1536,
+		"ietf-ike-grp-modp-1536", 1536, 256,
 		dh_group_1536_prime, G_N_ELEMENTS (dh_group_1536_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-2048", 2048,
+		"ietf-ike-grp-modp-2048", 2048, 256,
 		dh_group_2048_prime, G_N_ELEMENTS (dh_group_2048_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-3072", 3072,
+		"ietf-ike-grp-modp-3072", 3072, 256,
 		dh_group_3072_prime, G_N_ELEMENTS (dh_group_3072_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-4096", 4096,
+		"ietf-ike-grp-modp-4096", 4096, 304,
 		dh_group_4096_prime, G_N_ELEMENTS (dh_group_4096_prime),
 		{ 0x02 }, 1
 	},
 	{
-		"ietf-ike-grp-modp-8192", 8192,
+		"ietf-ike-grp-modp-8192", 8192, 400,
 		dh_group_8192_prime, G_N_ELEMENTS (dh_group_8192_prime),
 		{ 0x02 }, 1
 	},
@@ -237,25 +243,70 @@ egg_dh_default_params_raw (const gchar *name, gconstpointer *prime,
 	return FALSE;
 }
 
+guint
+egg_dh_default_exponent_bits (const gchar *name)
+{
+	const DHGroup *group;
+
+	g_return_val_if_fail (name, 0);
+
+	for (group = dh_groups; group->name; ++group) {
+		if (g_str_equal (group->name, name))
+			return group->exponent_bits;
+	}
+
+	return 0;
+}
+
+/*
+ * The groups are parsed into MPIs once per process, and kept around.
+ * The private exponent is always raised with gcry_mpi_powm(), which
+ * libgcrypt hardens against timing and cache side channels.
+ */
+
+typedef struct {
+	gsize initialized;
+	gcry_mpi_t prime;
+	gcry_mpi_t base;
+} DHCache;
+
+static DHCache dh_cache[G_N_ELEMENTS (dh_groups)] = { { 0, } };
+
+static DHCache *
+dh_group_cache (const DHGroup *group)
+{
+	DHCache *cache;
+	gcry_error_t gcry;
+
+	cache = dh_cache + (group - dh_groups);
+
+	if (g_once_init_enter (&cache->initialized)) {
+		gcry = gcry_mpi_scan (&cache->prime, GCRYMPI_FMT_USG, group->prime, group->n_prime, NULL);
+		g_assert (gcry == 0);
+		g_assert (gcry_mpi_get_nbits (cache->prime) == group->bits);
+		gcry = gcry_mpi_scan (&cache->base, GCRYMPI_FMT_USG, group->base, group->n_base, NULL);
+		g_assert (gcry == 0);
+		g_once_init_leave (&cache->initialized, 1);
+	}
+
+	return cache;
+}
+
 gboolean
 egg_dh_default_params (const gchar *name, gcry_mpi_t *prime, gcry_mpi_t *base)
 {
 	const DHGroup *group;
-	gcry_error_t gcry;
+	DHCache *cache;
 
 	g_return_val_if_fail (name, FALSE);
 
 	for (group = dh_groups; group->name; ++group) {
 		if (g_str_equal (group->name, name)) {
-			if (prime) {
-				gcry = gcry_mpi_scan (prime, GCRYMPI_FMT_USG, group->prime, group->n_prime, NULL);
-				g_return_val_if_fail (gcry == 0, FALSE);
-				g_return_val_if_fail (gcry_mpi_get_nbits (*prime) == group->bits, FALSE);
-			}
-			if (base) {
-				gcry = gcry_mpi_scan (base, GCRYMPI_FMT_USG, group->base, group->n_base, NULL);
-				g_return_val_if_fail (gcry == 0, FALSE);
-			}
+			cache = dh_group_cache (group);
+			if (prime)
+				*prime = gcry_mpi_copy (cache->prime);
+			if (base)
+				*base = gcry_mpi_copy (cache->base);
 			return TRUE;
 		}
 	}
@@ -353,3 +404,63 @@ egg_dh_gen_secret (gcry_mpi_t peer, gcry_mpi_t priv,
 
 	return value;
 }
+
+#ifdef EGG_DH_WITH_X25519
+
+gboolean
+egg_dh_x25519_gen_pair (guchar *pub,
+                        guchar *priv)
+{
+	gcry_error_t gcry;
+
+	g_return_val_if_fail (pub, FALSE);
+	g_return_val_if_fail (priv, FALSE);
+
+	/* Clamp the private scalar as described in RFC 7748 */
+	gcry_randomize (priv, EGG_DH_X25519_SIZE, GCRY_STRONG_RANDOM);
+	priv[0] &= 248;
+	priv[31] &= 127;
+	priv[31] |= 64;
+
+	/* A NULL point means the curve's base point */
+	gcry = gcry_ecc_mul_point (GCRY_ECC_CURVE25519, pub, priv, NULL);
+	g_return_val_if_fail (gcry == 0, FALSE);
+
+	return TRUE;
+}
+
+gpointer
+egg_dh_x25519_gen_secret (gconstpointer peer,
+                          gsize n_peer,
+                          gconstpointer priv,
+                          gsize *bytes)
+{
+	gcry_error_t gcry;
+	guchar *value;
+	guchar check;
+	gsize i;
+
+	g_return_val_if_fail (peer, NULL);
+	g_return_val_if_fail (priv, NULL);
+	g_return_val_if_fail (bytes, NULL);
+
+	if (n_peer != EGG_DH_X25519_SIZE)
+		return NULL;
+
+	value = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	gcry = gcry_ecc_mul_point (GCRY_ECC_CURVE25519, value, priv, peer);
+
+	/* An all zero secret means the peer sent a point of small order */
+	for (i = 0, check = 0; i < EGG_DH_X25519_SIZE; i++)
+		check |= value[i];
+
+	if (gcry != 0 || check == 0) {
+		egg_secure_free (value);
+		return NULL;
+	}
+
+	*bytes = EGG_DH_X25519_SIZE;
+	return value;
+}
+
+#endif /* EGG_DH_WITH_X25519 */
@@ -28,6 +28,13 @@
 
 #include <gcrypt.h>
 
+/* X25519 from RFC 7748 needs gcry_ecc_mul_point() in libgcrypt 1.9 */
+#if GCRYPT_VERSION_NUMBER >= 0x010900
+#define EGG_DH_WITH_X25519 1
+#endif
+
+#define EGG_DH_X25519_SIZE 32
+
 gboolean   egg_dh_default_params                              (const gchar *name,
                                                                gcry_mpi_t *prime,
                                                                gcry_mpi_t *base);
@@ -38,6 +45,8 @@ gboolean   egg_dh_default_params_raw                          (const gchar *name
                                                                gconstpointer *base,
                                                                gsize *n_base);
 
+guint      egg_dh_default_exponent_bits                       (const gchar *name);
+
 gboolean   egg_dh_gen_pair                                    (gcry_mpi_t prime,
                                                                gcry_mpi_t base,
                                                                guint bits,
@@ -49,4 +58,16 @@ gpointer   egg_dh_gen_secret                                  (gcry_mpi_t peer,
                                                                gcry_mpi_t prime,
                                                                gsize *bytes);
 
+#ifdef EGG_DH_WITH_X25519
+
+gboolean   egg_dh_x25519_gen_pair                             (guchar *pub,
+                                                               guchar *priv);
+
+gpointer   egg_dh_x25519_gen_secret                           (gconstpointer peer,
+                                                               gsize n_peer,
+                                                               gconstpointer priv,
+                                                               gsize *bytes);
+
+#endif /* EGG_DH_WITH_X25519 */
+
 #endif /* EGG_DH_H_ */
@@ -113,6 +113,9 @@ egg_libgcrypt_initialize (void)
 			                             (gcry_handler_realloc_t)egg_secure_realloc, 
 			                             egg_secure_free);
 			gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+		} else {
+			g_debug ("libgcrypt was already initialized, its secure memory "
+			         "is not allocated from our secure memory pool");
 		}
 		
 		gcry_create_nonce (&seed, sizeof (seed));
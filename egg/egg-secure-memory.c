@@ -33,6 +33,7 @@
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdio.h>
@@ -40,6 +41,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #ifdef WITH_VALGRIND
 #include <valgrind/valgrind.h>
@@ -56,6 +58,17 @@
 
 #define DEFAULT_BLOCK_SIZE 16384
 
+/*
+ * Threads can keep a few recently freed cells for themselves, which
+ * needs memory barriers, see the MAGAZINES section below.
+ */
+#if defined(__GNUC__) && !defined(EGG_SECURE_NO_MAGAZINES)
+#define WITH_MAGAZINES 1
+#define MEMORY_BARRIER() __sync_synchronize ()
+#else
+#define MEMORY_BARRIER()
+#endif
+
 /* Use our own assert to guarantee no glib allocations */
 #ifndef ASSERT
 #ifdef G_DISABLE_ASSERT
@@ -74,6 +87,20 @@
 static int show_warning = 1;
 int egg_secure_warnings = 1;
 
+/*
+ * The settings below change how secrets are kept, so a setuid or setgid
+ * program shouldn't take them from whoever ran it.
+ */
+static const char *
+secmem_getenv (const char *name)
+{
+#ifdef HAVE_SECURE_GETENV
+	return secure_getenv (name);
+#else
+	return getenv (name);
+#endif
+}
+
 /*
  * We allocate all memory in units of sizeof(void*). This
  * is our definition of 'word'.
@@ -83,6 +110,14 @@ typedef void* word_t;
 /* The amount of extra words we can allocate */
 #define WASTE   4
 
+/*
+ * Unused cells are kept in bins by size, so that an allocation doesn't
+ * have to walk all the unused memory. Bin n holds cells of at least
+ * 2^n words and less than 2^(n+1), except for the last bin which holds
+ * all the larger cells.
+ */
+#define BINS    10
+
 /*
  * Track allocated memory or a free block. This structure is not stored
  * in the secure memory area. It is allocated from a pool of other
@@ -93,8 +128,10 @@ typedef struct _Cell {
 	size_t n_words;         /* Amount of secure memory in words */
 	size_t requested;       /* Amount actually requested by app, in bytes, 0 if unused */
 	const char *tag;        /* Tag which describes the allocation */
+	struct _Block *block;   /* Block this memory is in */
 	struct _Cell *next;     /* Next in memory ring */
 	struct _Cell *prev;     /* Previous in memory ring */
+	int unused;             /* In an unused bin, only changed with the lock held */
 } Cell;
 
 /*
@@ -105,7 +142,8 @@ typedef struct _Block {
 	size_t n_words;             /* Number of words in block */
 	size_t n_used;              /* Number of used allocations */
 	struct _Cell* used_cells;   /* Ring of used allocations */
-	struct _Cell* unused_cells; /* Ring of unused allocations */
+	int reserved;               /* Reserved up front, never released */
+	int retained;               /* Kept around while nothing is used */
 	struct _Block *next;        /* Next block in list */
 } Block;
 
@@ -395,6 +433,96 @@ sec_remove_cell_ring (Cell **ring, Cell *cell)
 	ASSERT (*ring != cell);
 }
 
+static Cell *unused_bins[BINS] = { NULL, };
+static unsigned int unused_mask = 0;
+
+/* Words in allocated cells, for statistics */
+static size_t n_used_words = 0;
+static size_t used_high_water = 0;
+
+static inline void
+sec_count_used (size_t n_words)
+{
+	n_used_words += n_words;
+	if (n_used_words > used_high_water)
+		used_high_water = n_used_words;
+}
+
+static inline unsigned int
+sec_bin_for_words (size_t n_words)
+{
+	unsigned int bin = 0;
+
+	ASSERT (n_words > 0);
+
+	while (n_words > 1 && bin < BINS - 1) {
+		n_words >>= 1;
+		bin++;
+	}
+
+	return bin;
+}
+
+static void
+sec_insert_unused (Cell *cell)
+{
+	unsigned int bin;
+
+	ASSERT (cell->requested == 0);
+
+	bin = sec_bin_for_words (cell->n_words);
+	sec_insert_cell_ring (&unused_bins[bin], cell);
+	unused_mask |= (1U << bin);
+	cell->unused = 1;
+}
+
+static void
+sec_remove_unused (Cell *cell)
+{
+	unsigned int bin;
+
+	ASSERT (cell->requested == 0);
+
+	ASSERT (cell->unused);
+
+	bin = sec_bin_for_words (cell->n_words);
+	sec_remove_cell_ring (&unused_bins[bin], cell);
+	if (unused_bins[bin] == NULL)
+		unused_mask &= ~(1U << bin);
+	cell->unused = 0;
+}
+
+static Cell *
+sec_find_unused (size_t n_words)
+{
+	unsigned int bin, mask;
+	Cell *cell;
+
+	bin = sec_bin_for_words (n_words);
+
+	/* The most recently freed cell of about the right size */
+	cell = unused_bins[bin];
+	if (cell && cell->n_words >= n_words)
+		return cell;
+
+	/* Any cell in a larger bin is big enough */
+	mask = unused_mask & ~((2U << bin) - 1);
+	if (mask) {
+		for (bin = bin + 1; !(mask & (1U << bin)); bin++);
+		return unused_bins[bin];
+	}
+
+	/* Otherwise look through the rest of the cells of about the right size */
+	if (cell) {
+		for (cell = cell->next; cell != unused_bins[bin]; cell = cell->next) {
+			if (cell->n_words >= n_words)
+				return cell;
+		}
+	}
+
+	return NULL;
+}
+
 static inline void*
 sec_cell_to_memory (Cell *cell)
 {
@@ -488,22 +616,44 @@ sec_neighbor_after (Block *block, Cell *cell)
 	return cell;
 }
 
+static Cell*
+sec_first_cell (Block *block)
+{
+	word_t *word;
+	Cell *cell;
+
+	ASSERT (block);
+
+	word = block->words;
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_DEFINED (word, sizeof (word_t));
+#endif
+
+	cell = *word;
+	sec_check_guards (cell);
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_NOACCESS (word, sizeof (word_t));
+#endif
+
+	return cell;
+}
+
+static void sec_block_reuse (Block *block);
+
 static void*
-sec_alloc (Block *block,
-           const char *tag,
+sec_alloc (const char *tag,
            size_t length)
 {
+	Block *block;
 	Cell *cell, *other;
 	size_t n_words;
 	void *memory;
 
-	ASSERT (block);
 	ASSERT (length);
 	ASSERT (tag);
 
-	if (!block->unused_cells)
-		return NULL;
-
 	/*
 	 * Each memory allocation is aligned to a pointer size, and
 	 * then, sandwidched between two pointers to its meta data.
@@ -515,15 +665,7 @@ sec_alloc (Block *block,
 	n_words = sec_size_to_words (length) + 2;
 
 	/* Look for a cell of at least our required size */
-	cell = block->unused_cells;
-	while (cell->n_words < n_words) {
-		cell = cell->next;
-		if (cell == block->unused_cells) {
-			cell = NULL;
-			break;
-		}
-	}
-
+	cell = sec_find_unused (n_words);
 	if (!cell)
 		return NULL;
 
@@ -531,6 +673,7 @@ sec_alloc (Block *block,
 	ASSERT (cell->requested == 0);
 	ASSERT (cell->prev);
 	ASSERT (cell->words);
+	ASSERT (cell->block);
 	sec_check_guards (cell);
 
 	/* Steal from the cell if it's too long */
@@ -538,24 +681,33 @@ sec_alloc (Block *block,
 		other = pool_alloc ();
 		if (!other)
 			return NULL;
+
+		/* What's left over may belong in a different bin */
+		sec_remove_unused (cell);
 		other->n_words = n_words;
 		other->words = cell->words;
+		other->block = cell->block;
 		cell->n_words -= n_words;
 		cell->words += n_words;
 
 		sec_write_guards (other);
 		sec_write_guards (cell);
+		sec_insert_unused (cell);
 
 		cell = other;
-	}
 
-	if (cell->next)
-		sec_remove_cell_ring (&block->unused_cells, cell);
+	} else {
+		sec_remove_unused (cell);
+	}
 
+	block = cell->block;
+	if (block->retained)
+		sec_block_reuse (block);
 	++block->n_used;
 	cell->tag = tag;
 	cell->requested = length;
 	sec_insert_cell_ring (&block->used_cells, cell);
+	sec_count_used (cell->n_words);
 	memory = sec_cell_to_memory (cell);
 
 #ifdef WITH_VALGRIND
@@ -599,12 +751,21 @@ sec_free (Block *block, void *memory)
 
 	/* Remove from the used cell ring */
 	sec_remove_cell_ring (&block->used_cells, cell);
+	n_used_words -= cell->n_words;
 
-	/* Find previous unallocated neighbor, and merge if possible */
+	cell->tag = NULL;
+	cell->requested = 0;
+
+	/*
+	 * Find previous unallocated neighbor, and merge if possible. A cell
+	 * in a magazine has its tag and size changed without the lock, so
+	 * only look at those of an unused neighbor.
+	 */
 	other = sec_neighbor_before (block, cell);
-	if (other && other->requested == 0) {
+	if (other && other->unused) {
 		ASSERT (other->tag == NULL);
 		ASSERT (other->next && other->prev);
+		sec_remove_unused (other);
 		other->n_words += cell->n_words;
 		sec_write_guards (other);
 		pool_free (cell);
@@ -613,24 +774,20 @@ sec_free (Block *block, void *memory)
 
 	/* Find next unallocated neighbor, and merge if possible */
 	other = sec_neighbor_after (block, cell);
-	if (other && other->requested == 0) {
+	if (other && other->unused) {
 		ASSERT (other->tag == NULL);
 		ASSERT (other->next && other->prev);
+		sec_remove_unused (other);
 		other->n_words += cell->n_words;
 		other->words = cell->words;
-		if (cell->next)
-			sec_remove_cell_ring (&block->unused_cells, cell);
 		sec_write_guards (other);
 		pool_free (cell);
 		cell = other;
 	}
 
-	/* Add to the unused list if not already there */
-	if (!cell->next)
-		sec_insert_cell_ring (&block->unused_cells, cell);
+	/* Add to the bin for its now merged size */
+	sec_insert_unused (cell);
 
-	cell->tag = NULL;
-	cell->requested = 0;
 	--block->n_used;
 	return NULL;
 }
@@ -726,21 +883,25 @@ sec_realloc (Block *block,
 
 		/* See if we have a neighbor who can give us some memory */
 		other = sec_neighbor_after (block, cell);
-		if (!other || other->requested != 0)
+		if (!other || !other->unused)
 			break;
 
+		sec_remove_unused (other);
+
 		/* Eat the whole neighbor if not too big */
 		if (n_words - cell->n_words + WASTE >= other->n_words) {
+			sec_count_used (other->n_words);
 			cell->n_words += other->n_words;
 			sec_write_guards (cell);
-			sec_remove_cell_ring (&block->unused_cells, other);
 			pool_free (other);
 
 		/* Steal from the neighbor */
 		} else {
+			sec_count_used (n_words - cell->n_words);
 			other->words += n_words - cell->n_words;
 			other->n_words -= n_words - cell->n_words;
 			sec_write_guards (other);
+			sec_insert_unused (other);
 			cell->n_words = n_words;
 			sec_write_guards (cell);
 		}
@@ -755,7 +916,7 @@ sec_realloc (Block *block,
 	}
 
 	/* That didn't work, try alloc/free */
-	alloc = sec_alloc (block, tag, length);
+	alloc = sec_alloc (tag, length);
 	if (alloc) {
 		memcpy_with_vbits (alloc, memory, valid);
 		sec_free (block, memory);
@@ -820,6 +981,7 @@ sec_validate (Block *block)
 
 		/* Validate that it's actually for real */
 		sec_check_guards (cell);
+		ASSERT (cell->block == block);
 
 		/* Is it an allocated block? */
 		if (cell->requested > 0) {
@@ -847,10 +1009,99 @@ sec_validate (Block *block)
 
 /* -----------------------------------------------------------------------------
  * LOCKED MEMORY
+ *
+ * Where memory can't be locked, such as with a tiny RLIMIT_MEMLOCK, we
+ * don't want to map, fail to lock and unmap pages for every allocation
+ * that falls back to normal memory. What happens after a failure is
+ * chosen by setting SECMEM_LOCK_FAILURE to one of:
+ *
+ *  backoff: skip the next 1, 2, 4 ... attempts, the default
+ *  retry: try again every time
+ *  never: don't try to lock memory again
+ *
+ * When backing off, releasing locked memory or locking some successfully
+ * starts over.
  */
 
+enum {
+	LOCK_POLICY_UNKNOWN,
+	LOCK_POLICY_BACKOFF,
+	LOCK_POLICY_RETRY,
+	LOCK_POLICY_NEVER
+};
+
+/* Most attempts skipped after a failure, when backing off */
+#define MAX_LOCK_BACKOFF 1024
+
+static int lock_policy = LOCK_POLICY_UNKNOWN;
+static int lock_disabled = 0;
+static unsigned int lock_skip = 0;
+static unsigned int lock_backoff = 0;
+
+/* Allocations that fell back to normal memory */
+static unsigned long n_fallbacks = 0;
+
+/* Called with the lock held, before trying to lock more memory */
+static int
+sec_lock_should_try (void)
+{
+	const char *env;
+
+	if (lock_policy == LOCK_POLICY_UNKNOWN) {
+		env = secmem_getenv ("SECMEM_LOCK_FAILURE");
+		if (env == NULL || env[0] == '\0' || strcmp (env, "backoff") == 0) {
+			lock_policy = LOCK_POLICY_BACKOFF;
+		} else if (strcmp (env, "retry") == 0) {
+			lock_policy = LOCK_POLICY_RETRY;
+		} else if (strcmp (env, "never") == 0) {
+			lock_policy = LOCK_POLICY_NEVER;
+		} else {
+			if (egg_secure_warnings)
+				fprintf (stderr, "invalid SECMEM_LOCK_FAILURE policy: %s\n", env);
+			lock_policy = LOCK_POLICY_BACKOFF;
+		}
+	}
+
+	if (lock_disabled)
+		return 0;
+
+	if (lock_skip > 0) {
+		lock_skip--;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+sec_lock_failed (void)
+{
+	switch (lock_policy) {
+	case LOCK_POLICY_NEVER:
+		lock_disabled = 1;
+		break;
+	case LOCK_POLICY_RETRY:
+		break;
+	default:
+		if (lock_backoff == 0)
+			lock_backoff = 1;
+		else if (lock_backoff < MAX_LOCK_BACKOFF)
+			lock_backoff *= 2;
+		lock_skip = lock_backoff;
+		break;
+	}
+}
+
+static void
+sec_lock_available (void)
+{
+	lock_skip = 0;
+	lock_backoff = 0;
+}
+
 static void*
 sec_acquire_pages (size_t *sz,
+                   int flags,
                    const char *during_tag)
 {
 	void *pages;
@@ -871,9 +1122,16 @@ sec_acquire_pages (size_t *sz,
 			fprintf (stderr, "couldn't map %lu bytes of memory (%s): %s\n",
 			         (unsigned long)*sz, during_tag, strerror (errno));
 		show_warning = 0;
+		sec_lock_failed ();
 		return NULL;
 	}
 
+#ifdef MADV_HUGEPAGE
+	/* Before locking, which faults the pages in */
+	if (flags & EGG_SECURE_HUGE_PAGES)
+		madvise (pages, *sz, MADV_HUGEPAGE);
+#endif
+
 	if (mlock (pages, *sz) < 0) {
 		if (show_warning && egg_secure_warnings && errno != EPERM) {
 			fprintf (stderr, "couldn't lock %lu bytes of memory (%s): %s\n",
@@ -881,12 +1139,14 @@ sec_acquire_pages (size_t *sz,
 			show_warning = 0;
 		}
 		munmap (pages, *sz);
+		sec_lock_failed ();
 		return NULL;
 	}
 
 	DEBUG_ALLOC ("gkr-secure-memory: new block ", *sz);
 
 	show_warning = 1;
+	sec_lock_available ();
 	return pages;
 
 #else
@@ -913,6 +1173,9 @@ sec_release_pages (void *pages, size_t sz)
 
 	DEBUG_ALLOC ("gkr-secure-memory: freed block ", sz);
 
+	/* Something else might fit now */
+	sec_lock_available ();
+
 #else
 	ASSERT (FALSE);
 #endif
@@ -924,8 +1187,159 @@ sec_release_pages (void *pages, size_t sz)
 
 static Block *all_blocks = NULL;
 
+/* Words in all blocks, for statistics */
+static size_t n_locked_words = 0;
+static size_t locked_high_water = 0;
+
+/*
+ * An index of the blocks sorted by address, so that finding the block
+ * some memory belongs to is a binary search rather than a walk of the
+ * list. It's changed with the lock held.
+ *
+ * With magazines, threads also look in it without the lock. The
+ * generation is odd while it's being changed, and a reader that sees it
+ * change has to go take the lock. Blocks beyond MAX_RANGES are not in
+ * the index, and are found by walking the list.
+ */
+
+#define MAX_RANGES 1024
+
+typedef struct {
+	word_t *words;
+	word_t *end;
+	Block *block;
+} Range;
+
+static Range block_ranges[MAX_RANGES];
+static unsigned int n_ranges = 0;
+static unsigned int n_unindexed = 0;
+static volatile unsigned long range_generation = 0;
+
+/* Index of the first range that doesn't end before word */
+static unsigned int
+sec_range_search (Range *ranges,
+                  unsigned int count,
+                  word_t *word)
+{
+	unsigned int lo = 0;
+	unsigned int hi = count;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ranges[mid].end <= word)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+sec_range_add (Block *block)
+{
+	unsigned int i;
+
+	if (n_ranges == MAX_RANGES) {
+		n_unindexed++;
+		return;
+	}
+
+	i = sec_range_search (block_ranges, n_ranges, block->words);
+	ASSERT (i == n_ranges || block_ranges[i].words > block->words);
+
+	range_generation++;
+	MEMORY_BARRIER ();
+
+	memmove (block_ranges + i + 1, block_ranges + i, (n_ranges - i) * sizeof (Range));
+	block_ranges[i].words = block->words;
+	block_ranges[i].end = block->words + block->n_words;
+	block_ranges[i].block = block;
+	n_ranges++;
+
+	MEMORY_BARRIER ();
+	range_generation++;
+}
+
+static void
+sec_range_remove (Block *block)
+{
+	unsigned int i;
+
+	i = sec_range_search (block_ranges, n_ranges, block->words);
+	if (i == n_ranges || block_ranges[i].block != block) {
+		ASSERT (n_unindexed > 0);
+		n_unindexed--;
+		return;
+	}
+
+	range_generation++;
+	MEMORY_BARRIER ();
+
+	memmove (block_ranges + i, block_ranges + i + 1, (n_ranges - i - 1) * sizeof (Range));
+	n_ranges--;
+
+	MEMORY_BARRIER ();
+	range_generation++;
+}
+
+/* Called with the lock held */
+static Block *
+sec_block_for_word (word_t *word)
+{
+	Block *block;
+	unsigned int i;
+
+	i = sec_range_search (block_ranges, n_ranges, word);
+	if (i < n_ranges && word >= block_ranges[i].words)
+		return block_ranges[i].block;
+
+	/* Only if some blocks didn't fit in the index */
+	if (n_unindexed > 0) {
+		for (block = all_blocks; block; block = block->next) {
+			if (sec_is_valid_word (block, word))
+				return block;
+		}
+	}
+
+	return NULL;
+}
+
+#ifdef WITH_MAGAZINES
+
+/* Called without the lock. Returns zero if not sure */
+static int
+sec_range_contains (word_t *word)
+{
+	unsigned long generation;
+	unsigned int count, i;
+	int found;
+
+	generation = range_generation;
+	MEMORY_BARRIER ();
+	if (generation & 1)
+		return 0;
+
+	count = n_ranges;
+	if (count > MAX_RANGES)
+		return 0;
+
+	i = sec_range_search (block_ranges, count, word);
+	found = (i < count && word >= block_ranges[i].words);
+
+	MEMORY_BARRIER ();
+	if (generation != range_generation)
+		return 0;
+
+	return found;
+}
+
+#endif /* WITH_MAGAZINES */
+
 static Block*
 sec_block_create (size_t size,
+                  int flags,
                   const char *during_tag)
 {
 	Block *block;
@@ -934,7 +1348,10 @@ sec_block_create (size_t size,
 	ASSERT (during_tag);
 
 	/* We can force all all memory to be malloced */
-	if (getenv ("SECMEM_FORCE_FALLBACK"))
+	if (secmem_getenv ("SECMEM_FORCE_FALLBACK"))
+		return NULL;
+
+	if (!sec_lock_should_try ())
 		return NULL;
 
 	block = pool_alloc ();
@@ -951,7 +1368,7 @@ sec_block_create (size_t size,
 	if (size < DEFAULT_BLOCK_SIZE)
 		size = DEFAULT_BLOCK_SIZE;
 
-	block->words = sec_acquire_pages (&size, during_tag);
+	block->words = sec_acquire_pages (&size, flags, during_tag);
 	block->n_words = size / sizeof (word_t);
 	if (!block->words) {
 		pool_free (block);
@@ -967,11 +1384,17 @@ sec_block_create (size_t size,
 	cell->words = block->words;
 	cell->n_words = block->n_words;
 	cell->requested = 0;
+	cell->block = block;
 	sec_write_guards (cell);
-	sec_insert_cell_ring (&block->unused_cells, cell);
+	sec_insert_unused (cell);
 
 	block->next = all_blocks;
 	all_blocks = block;
+	sec_range_add (block);
+
+	n_locked_words += block->n_words;
+	if (n_locked_words > locked_high_water)
+		locked_high_water = n_locked_words;
 
 	return block;
 }
@@ -998,19 +1421,476 @@ sec_block_destroy (Block *block)
 	ASSERT (bl == block);
 	ASSERT (block->used_cells == NULL);
 
-	/* Release all the meta data cells */
-	while (block->unused_cells) {
-		cell = block->unused_cells;
-		sec_remove_cell_ring (&block->unused_cells, cell);
-		pool_free (cell);
-	}
+	sec_range_remove (block);
+
+	/* With nothing used, one unused cell covers the whole block */
+	cell = sec_first_cell (block);
+	ASSERT (cell->requested == 0);
+	ASSERT (cell->n_words == block->n_words);
+	sec_remove_unused (cell);
+	pool_free (cell);
 
 	/* Release all pages of secure memory */
+	n_locked_words -= block->n_words;
 	sec_release_pages (block->words, block->n_words * sizeof (word_t));
 
 	pool_free (block);
 }
 
+/*
+ * A few blocks are kept around when nothing is used in them, so that
+ * allocating and freeing at a block boundary doesn't map and unmap
+ * pages over and over. Their memory has already been cleared. The
+ * number is set with SECMEM_RETAIN_BLOCKS, and egg_secure_trim()
+ * releases them.
+ */
+
+#define DEFAULT_RETAIN_BLOCKS 1
+
+static int retain_blocks = -1;
+static unsigned int n_retained = 0;
+
+/* Called when a block might have nothing used in it any more */
+static void
+sec_block_release (Block *block)
+{
+	const char *env;
+	char *end;
+	long value;
+
+	if (block->n_used != 0 || block->reserved)
+		return;
+
+	if (retain_blocks < 0) {
+		retain_blocks = DEFAULT_RETAIN_BLOCKS;
+		env = secmem_getenv ("SECMEM_RETAIN_BLOCKS");
+		if (env != NULL && env[0] != '\0') {
+			value = strtol (env, &end, 10);
+			if (*end == '\0' && value >= 0 && value <= 0xFFFF)
+				retain_blocks = value;
+			else if (egg_secure_warnings)
+				fprintf (stderr, "invalid SECMEM_RETAIN_BLOCKS count: %s\n", env);
+		}
+	}
+
+	if (n_retained < (unsigned int)retain_blocks) {
+		ASSERT (!block->retained);
+		block->retained = 1;
+		n_retained++;
+		return;
+	}
+
+	sec_block_destroy (block);
+}
+
+/* Called when memory is allocated from a retained block */
+static void
+sec_block_reuse (Block *block)
+{
+	ASSERT (block->retained);
+	ASSERT (block->n_used == 0);
+	ASSERT (n_retained > 0);
+
+	block->retained = 0;
+	n_retained--;
+}
+
+/* Release all the retained blocks */
+static size_t
+sec_block_trim (void)
+{
+	Block *block, *next;
+	size_t released = 0;
+
+	for (block = all_blocks; block != NULL; block = next) {
+		next = block->next;
+		if (block->retained) {
+			sec_block_reuse (block);
+			released += block->n_words * sizeof (word_t);
+			sec_block_destroy (block);
+		}
+	}
+
+	ASSERT (n_retained == 0);
+	return released;
+}
+
+/* -----------------------------------------------------------------------------
+ * RESERVED ARENA
+ *
+ * A large block can be reserved up front, and is never released. After
+ * that allocations which fit in it don't map or lock any more memory.
+ *
+ * It can be reserved with egg_secure_reserve(), or by setting
+ * SECMEM_RESERVE to a size in bytes, with an optional K or M suffix.
+ * Setting SECMEM_HUGE_PAGES asks for it to be backed by huge pages.
+ */
+
+static Block *reserved_block = NULL;
+static int reserve_checked = 0;
+
+/* How much more we may lock, other memory in the process may be locked too */
+static size_t
+sec_lock_limit (void)
+{
+	struct rlimit rlim;
+	size_t locked = 0;
+	Block *block;
+
+	if (getrlimit (RLIMIT_MEMLOCK, &rlim) < 0 || rlim.rlim_cur == RLIM_INFINITY)
+		return (size_t)-1;
+
+	for (block = all_blocks; block; block = block->next)
+		locked += block->n_words * sizeof (word_t);
+
+	if (rlim.rlim_cur <= locked)
+		return 0;
+	return (rlim.rlim_cur - locked) & ~((size_t)getpagesize () - 1);
+}
+
+/* Called with the lock held */
+static size_t
+sec_reserve (size_t length,
+             int flags)
+{
+	size_t limit;
+	Block *block;
+
+	if (reserved_block != NULL)
+		return reserved_block->n_words * sizeof (word_t);
+
+	limit = sec_lock_limit ();
+	if (length > limit) {
+		if (egg_secure_warnings)
+			fprintf (stderr, "only reserving %lu of %lu bytes of secure memory, due to RLIMIT_MEMLOCK\n",
+			         (unsigned long)limit, (unsigned long)length);
+		length = limit;
+	}
+
+	if (length == 0)
+		return 0;
+
+	block = sec_block_create (length, flags, "reserve");
+	if (block == NULL)
+		return 0;
+
+	block->reserved = 1;
+	reserved_block = block;
+	return block->n_words * sizeof (word_t);
+}
+
+/* Called with the lock held */
+static void
+sec_reserve_from_env (void)
+{
+	const char *env;
+	unsigned long length;
+	char *end;
+	int flags = 0;
+
+	reserve_checked = 1;
+
+	env = secmem_getenv ("SECMEM_RESERVE");
+	if (env == NULL || env[0] == '\0')
+		return;
+
+	length = strtoul (env, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		length *= 1024;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		length *= 1024 * 1024;
+		end++;
+	}
+
+	if (*end != '\0' || length == 0) {
+		if (egg_secure_warnings)
+			fprintf (stderr, "invalid SECMEM_RESERVE size: %s\n", env);
+		return;
+	}
+
+	if (secmem_getenv ("SECMEM_HUGE_PAGES"))
+		flags |= EGG_SECURE_HUGE_PAGES;
+
+	sec_reserve (length, flags);
+}
+
+/* -----------------------------------------------------------------------------
+ * MAGAZINES
+ *
+ * Each thread keeps a magazine of a few small cells it recently freed, and
+ * reuses them without taking the global lock. While in a magazine a cell
+ * is still allocated as far as its block is concerned, but it's tagged as
+ * cached, and its memory has been cleared.
+ *
+ * Each magazine has its own lock, which only its thread takes unless
+ * someone looks at all of them with the global lock held. So the global
+ * lock is always taken before any magazine lock.
+ */
+
+#ifdef WITH_MAGAZINES
+
+/* Cells kept in each magazine, it's drained to half when full */
+#define MAGAZINE_CELLS  32
+
+/* Only cells for up to 512 bytes on 64-bit */
+#define MAGAZINE_WORDS  66
+
+typedef struct _Magazine {
+	pthread_mutex_t mutex;
+	Cell *cells[MAGAZINE_CELLS];
+	unsigned int n_cells;
+	struct _Magazine *next;     /* Next in list of all magazines */
+	struct _Magazine **at;      /* Where we're linked from */
+} Magazine;
+
+static const char *cached_tag = "(cached)";
+static Magazine *all_magazines = NULL;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static int magazine_key_ok = 0;
+
+/* Called with the global lock and the magazine lock held */
+static void
+magazine_drain_locked (Magazine *magazine,
+                       unsigned int keep)
+{
+	Block *block;
+	Cell *cell;
+
+	while (magazine->n_cells > keep) {
+		cell = magazine->cells[--magazine->n_cells];
+		block = cell->block;
+		sec_free (block, sec_cell_to_memory (cell));
+		sec_block_release (block);
+	}
+}
+
+static void
+magazine_destroy (void *data)
+{
+	Magazine *magazine = data;
+
+	DO_LOCK ();
+
+		pthread_mutex_lock (&magazine->mutex);
+		magazine_drain_locked (magazine, 0);
+		pthread_mutex_unlock (&magazine->mutex);
+
+		*(magazine->at) = magazine->next;
+		if (magazine->next)
+			magazine->next->at = magazine->at;
+
+	DO_UNLOCK ();
+
+	pthread_mutex_destroy (&magazine->mutex);
+	free (magazine);
+}
+
+static void
+magazine_key_create (void)
+{
+	magazine_key_ok = (pthread_key_create (&magazine_key, magazine_destroy) == 0);
+}
+
+static Magazine *
+magazine_get (int create)
+{
+	Magazine *magazine;
+
+	pthread_once (&magazine_once, magazine_key_create);
+	if (!magazine_key_ok)
+		return NULL;
+
+	magazine = pthread_getspecific (magazine_key);
+	if (magazine || !create)
+		return magazine;
+
+	magazine = calloc (1, sizeof (Magazine));
+	if (magazine == NULL)
+		return NULL;
+
+	pthread_mutex_init (&magazine->mutex, NULL);
+	if (pthread_setspecific (magazine_key, magazine) != 0) {
+		pthread_mutex_destroy (&magazine->mutex);
+		free (magazine);
+		return NULL;
+	}
+
+	DO_LOCK ();
+
+		magazine->next = all_magazines;
+		if (magazine->next)
+			magazine->next->at = &magazine->next;
+		magazine->at = &all_magazines;
+		all_magazines = magazine;
+
+	DO_UNLOCK ();
+
+	return magazine;
+}
+
+/* Called with the global lock held */
+static void
+magazines_drain (void)
+{
+	Magazine *magazine;
+
+	for (magazine = all_magazines; magazine; magazine = magazine->next) {
+		pthread_mutex_lock (&magazine->mutex);
+		magazine_drain_locked (magazine, 0);
+		pthread_mutex_unlock (&magazine->mutex);
+	}
+}
+
+static void
+magazines_lock (void)
+{
+	Magazine *magazine;
+	for (magazine = all_magazines; magazine; magazine = magazine->next)
+		pthread_mutex_lock (&magazine->mutex);
+}
+
+static void
+magazines_unlock (void)
+{
+	Magazine *magazine;
+	for (magazine = all_magazines; magazine; magazine = magazine->next)
+		pthread_mutex_unlock (&magazine->mutex);
+}
+
+static void *
+magazine_alloc (const char *tag,
+                size_t length)
+{
+	Magazine *magazine;
+	Cell *cell = NULL;
+	size_t n_words;
+	void *memory;
+	unsigned int i;
+
+	n_words = sec_size_to_words (length) + 2;
+	if (n_words > MAGAZINE_WORDS)
+		return NULL;
+
+	magazine = magazine_get (0);
+	if (magazine == NULL)
+		return NULL;
+
+	pthread_mutex_lock (&magazine->mutex);
+
+		/* Most recently freed first, a cell that wastes no more than sec_alloc would */
+		for (i = magazine->n_cells; i > 0; i--) {
+			cell = magazine->cells[i - 1];
+			if (cell->n_words >= n_words && cell->n_words <= n_words + WASTE)
+				break;
+		}
+
+		if (i > 0) {
+			magazine->cells[i - 1] = magazine->cells[--magazine->n_cells];
+			ASSERT (cell->tag == cached_tag);
+			cell->tag = tag;
+			cell->requested = length;
+		} else {
+			cell = NULL;
+		}
+
+	pthread_mutex_unlock (&magazine->mutex);
+
+	if (cell == NULL)
+		return NULL;
+
+	memory = sec_cell_to_memory (cell);
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_UNDEFINED (memory, length);
+	VALGRIND_MALLOCLIKE_BLOCK (memory, length, sizeof (void*), 1);
+#endif
+
+	return memset (memory, 0, length);
+}
+
+static int
+magazine_free (void *memory)
+{
+	Magazine *magazine;
+	word_t *word;
+	Cell *cell;
+
+	word = memory;
+	--word;
+
+	if (!sec_range_contains (word))
+		return 0;
+
+#ifdef WITH_VALGRIND
+	VALGRIND_MAKE_MEM_DEFINED (word, sizeof (word_t));
+#endif
+
+	/* Nobody else touches the meta data of memory that's still allocated */
+	cell = *word;
+	sec_check_guards (cell);
+	ASSERT (cell->requested > 0);
+	ASSERT (cell->tag != NULL && cell->tag != cached_tag);
+
+	if (cell->n_words > MAGAZINE_WORDS)
+		return 0;
+
+	magazine = magazine_get (1);
+	if (magazine == NULL)
+		return 0;
+
+#ifdef WITH_VALGRIND
+	VALGRIND_FREELIKE_BLOCK (memory, sizeof (word_t));
+	VALGRIND_MAKE_MEM_DEFINED (cell->words, cell->n_words * sizeof (word_t));
+#endif
+
+	/* Cleared now, the cell could stay in the magazine for a long time */
+	sec_check_guards (cell);
+	sec_clear_noaccess (memory, 0, cell->requested);
+
+	pthread_mutex_lock (&magazine->mutex);
+
+	if (magazine->n_cells == MAGAZINE_CELLS) {
+		pthread_mutex_unlock (&magazine->mutex);
+
+		DO_LOCK ();
+			pthread_mutex_lock (&magazine->mutex);
+			magazine_drain_locked (magazine, MAGAZINE_CELLS / 2);
+		DO_UNLOCK ();
+	}
+
+		cell->tag = cached_tag;
+		magazine->cells[magazine->n_cells++] = cell;
+
+	pthread_mutex_unlock (&magazine->mutex);
+
+	return 1;
+}
+
+/*
+ * When unloaded, such as with dlclose(), the key has to go, or its
+ * destructor would later be called in code that's no longer there. This
+ * also runs at exit, while other threads may still be about, so the
+ * magazines are only drained, and not freed from under them.
+ */
+static void __attribute__((destructor))
+magazines_unload (void)
+{
+	if (!magazine_key_ok)
+		return;
+
+	DO_LOCK ();
+
+		magazine_key_ok = 0;
+		pthread_key_delete (magazine_key);
+		magazines_drain ();
+
+	DO_UNLOCK ();
+}
+
+#endif /* WITH_MAGAZINES */
+
 /* ------------------------------------------------------------------------
  * PUBLIC FUNCTIONALITY
  */
@@ -1037,19 +1917,25 @@ egg_secure_alloc_full (const char *tag,
 	if (length == 0)
 		return NULL;
 
+#ifdef WITH_MAGAZINES
+	/* A cell this thread freed recently, without locking */
+	memory = magazine_alloc (tag, length);
+	if (memory != NULL)
+		return memory;
+#endif
+
 	DO_LOCK ();
 
-		for (block = all_blocks; block; block = block->next) {
-			memory = sec_alloc (block, tag, length);
-			if (memory)
-				break;
-		}
+		if (!reserve_checked)
+			sec_reserve_from_env ();
+
+		memory = sec_alloc (tag, length);
 
 		/* None of the current blocks have space, allocate new */
 		if (!memory) {
-			block = sec_block_create (length, tag);
+			block = sec_block_create (length, 0, tag);
 			if (block)
-				memory = sec_alloc (block, tag, length);
+				memory = sec_alloc (tag, length);
 		}
 
 #ifdef WITH_VALGRIND
@@ -1057,6 +1943,9 @@ egg_secure_alloc_full (const char *tag,
 			VALGRIND_MALLOCLIKE_BLOCK (memory, length, sizeof (void*), 1);
 #endif
 
+		if (!memory && (flags & EGG_SECURE_USE_FALLBACK) && EGG_SECURE_GLOBALS.fallback != NULL)
+			n_fallbacks++;
+
 	DO_UNLOCK ();
 
 	if (!memory && (flags & EGG_SECURE_USE_FALLBACK) && EGG_SECURE_GLOBALS.fallback != NULL) {
@@ -1102,33 +1991,31 @@ egg_secure_realloc_full (const char *tag,
 	DO_LOCK ();
 
 		/* Find out where it belongs to */
-		for (block = all_blocks; block; block = block->next) {
-			if (sec_is_valid_word (block, memory)) {
-				previous = sec_allocated (block, memory);
+		block = sec_block_for_word (memory);
+		if (block != NULL) {
+			previous = sec_allocated (block, memory);
 
 #ifdef WITH_VALGRIND
-				/* Let valgrind think we are unallocating so that it'll validate */
-				VALGRIND_FREELIKE_BLOCK (memory, sizeof (word_t));
+			/* Let valgrind think we are unallocating so that it'll validate */
+			VALGRIND_FREELIKE_BLOCK (memory, sizeof (word_t));
 #endif
 
-				alloc = sec_realloc (block, tag, memory, length);
+			alloc = sec_realloc (block, tag, memory, length);
 
 #ifdef WITH_VALGRIND
-				/* Now tell valgrind about either the new block or old one */
-				VALGRIND_MALLOCLIKE_BLOCK (alloc ? alloc : memory,
-				                           alloc ? length : previous,
-				                           sizeof (word_t), 1);
+			/* Now tell valgrind about either the new block or old one */
+			VALGRIND_MALLOCLIKE_BLOCK (alloc ? alloc : memory,
+			                           alloc ? length : previous,
+			                           sizeof (word_t), 1);
 #endif
-				break;
-			}
 		}
 
 		/* If it didn't work we may need to allocate a new block */
 		if (block && !alloc)
 			donew = 1;
 
-		if (block && block->n_used == 0)
-			sec_block_destroy (block);
+		if (block)
+			sec_block_release (block);
 
 	DO_UNLOCK ();
 
@@ -1176,13 +2063,16 @@ egg_secure_free_full (void *memory, int flags)
 	if (memory == NULL)
 		return;
 
+#ifdef WITH_MAGAZINES
+	/* Keep small cells in this thread's magazine, without locking */
+	if (magazine_free (memory))
+		return;
+#endif
+
 	DO_LOCK ();
 
 		/* Find out where it belongs to */
-		for (block = all_blocks; block; block = block->next) {
-			if (sec_is_valid_word (block, memory))
-				break;
-		}
+		block = sec_block_for_word (memory);
 
 #ifdef WITH_VALGRIND
 		/* We like valgrind's warnings, so give it a first whack at checking for errors */
@@ -1192,8 +2082,7 @@ egg_secure_free_full (void *memory, int flags)
 
 		if (block != NULL) {
 			sec_free (block, memory);
-			if (block->n_used == 0)
-				sec_block_destroy (block);
+			sec_block_release (block);
 		}
 
 	DO_UNLOCK ();
@@ -1218,16 +2107,47 @@ egg_secure_check (const void *memory)
 	DO_LOCK ();
 
 		/* Find out where it belongs to */
-		for (block = all_blocks; block; block = block->next) {
-			if (sec_is_valid_word (block, (word_t*)memory))
-				break;
-		}
+		block = sec_block_for_word ((word_t*)memory);
 
 	DO_UNLOCK ();
 
 	return block == NULL ? 0 : 1;
 }
 
+size_t
+egg_secure_trim (void)
+{
+	size_t released;
+
+	DO_LOCK ();
+
+#ifdef WITH_MAGAZINES
+		/* Cells cached by threads keep their blocks in use */
+		magazines_drain ();
+#endif
+
+		released = sec_block_trim ();
+
+	DO_UNLOCK ();
+
+	return released;
+}
+
+size_t
+egg_secure_reserve (size_t length,
+                    int flags)
+{
+	size_t reserved;
+
+	DO_LOCK ();
+
+		reserved = sec_reserve (length, flags);
+
+	DO_UNLOCK ();
+
+	return reserved;
+}
+
 void
 egg_secure_validate (void)
 {
@@ -1235,24 +2155,119 @@ egg_secure_validate (void)
 
 	DO_LOCK ();
 
+#ifdef WITH_MAGAZINES
+		magazines_lock ();
+#endif
+
 		for (block = all_blocks; block; block = block->next)
 			sec_validate (block);
 
+#ifdef WITH_MAGAZINES
+		magazines_unlock ();
+#endif
+
 	DO_UNLOCK ();
 }
 
 
+static void
+stats_for_unused (egg_secure_stats *stats)
+{
+	size_t n_unused = 0;
+	size_t largest = 0;
+	unsigned int i;
+	Cell *cell;
+
+	for (i = 0; i < BINS; i++) {
+		cell = unused_bins[i];
+		if (cell == NULL)
+			continue;
+		do {
+			n_unused += cell->n_words;
+			if (cell->n_words > largest)
+				largest = cell->n_words;
+			cell = cell->next;
+		} while (cell != unused_bins[i]);
+	}
+
+	if (n_unused > 0)
+		stats->fragmentation = 1.0 - (double)largest / (double)n_unused;
+}
+
+static void
+stats_for_block (Block *block,
+                 egg_secure_stats *stats)
+{
+	Cell *cell;
+
+	stats->n_blocks++;
+
+	cell = block->used_cells;
+	if (cell == NULL)
+		return;
+
+	do {
+#ifdef WITH_MAGAZINES
+		/* Cells cached in a magazine are unused as far as callers care */
+		if (cell->tag != cached_tag)
+#endif
+		{
+			stats->n_allocations++;
+			stats->requested_bytes += cell->requested;
+		}
+		cell = cell->next;
+	} while (cell != block->used_cells);
+}
+
+void
+egg_secure_get_stats (egg_secure_stats *stats,
+                      size_t length)
+{
+	egg_secure_stats result;
+	Block *block;
+
+	memset (&result, 0, sizeof (result));
+
+	DO_LOCK ();
+
+#ifdef WITH_MAGAZINES
+		magazines_lock ();
+#endif
+
+		result.locked_bytes = n_locked_words * sizeof (word_t);
+		result.locked_high_water = locked_high_water * sizeof (word_t);
+		result.used_bytes = n_used_words * sizeof (word_t);
+		result.used_high_water = used_high_water * sizeof (word_t);
+		result.n_fallbacks = n_fallbacks;
+
+		for (block = all_blocks; block != NULL; block = block->next)
+			stats_for_block (block, &result);
+		stats_for_unused (&result);
+
+#ifdef WITH_MAGAZINES
+		magazines_unlock ();
+#endif
+
+	DO_UNLOCK ();
+
+	/* Callers built against an older, shorter structure get what fits */
+	if (length > sizeof (result))
+		length = sizeof (result);
+	memcpy (stats, &result, length);
+}
+
 static egg_secure_rec *
-records_for_ring (Cell *cell_ring,
-                  egg_secure_rec *records,
-                  unsigned int *count,
-                  unsigned int *total)
+records_for_block (Block *block,
+                   egg_secure_rec *records,
+                   unsigned int *count,
+                   unsigned int *total)
 {
 	egg_secure_rec *new_rec;
 	unsigned int allocated = *count;
 	Cell *cell;
 
-	cell = cell_ring;
+	/* Unused cells are in bins shared by all blocks, so walk the memory */
+	cell = sec_first_cell (block);
 	do {
 		if (*count >= allocated) {
 			new_rec = realloc (records, sizeof (egg_secure_rec) * (allocated + 32));
@@ -1270,11 +2285,18 @@ records_for_ring (Cell *cell_ring,
 			records[*count].request_length = cell->requested;
 			records[*count].block_length = cell->n_words * sizeof (word_t);
 			records[*count].tag = cell->tag;
+#ifdef WITH_MAGAZINES
+			/* Cells cached in a magazine are unused as far as callers care */
+			if (cell->tag == cached_tag) {
+				records[*count].request_length = 0;
+				records[*count].tag = NULL;
+			}
+#endif
 			(*count)++;
 			(*total) += cell->n_words;
-			cell = cell->next;
+			cell = sec_neighbor_after (block, cell);
 		}
-	} while (cell != NULL && cell != cell_ring);
+	} while (cell != NULL);
 
 	return records;
 }
@@ -1290,13 +2312,14 @@ egg_secure_records (unsigned int *count)
 
 	DO_LOCK ();
 
+#ifdef WITH_MAGAZINES
+		magazines_lock ();
+#endif
+
 		for (block = all_blocks; block != NULL; block = block->next) {
 			total = 0;
 
-			records = records_for_ring (block->unused_cells, records, count, &total);
-			if (records == NULL)
-				break;
-			records = records_for_ring (block->used_cells, records, count, &total);
+			records = records_for_block (block, records, count, &total);
 			if (records == NULL)
 				break;
 
@@ -1304,6 +2327,10 @@ egg_secure_records (unsigned int *count)
 			ASSERT (total == block->n_words);
 		}
 
+#ifdef WITH_MAGAZINES
+		magazines_unlock ();
+#endif
+
 	DO_UNLOCK ();
 
 	return records;
@@ -49,8 +49,8 @@ typedef struct {
 	const char *  pool_version;
 } egg_secure_glob;
 
-#define EGG_SECURE_POOL_VER_STR             "1.0"
-#define EGG_SECURE_GLOBALS SECMEM_pool_data_v1_0
+#define EGG_SECURE_POOL_VER_STR             "1.1"
+#define EGG_SECURE_GLOBALS SECMEM_pool_data_v1_1
 
 #define EGG_SECURE_DEFINE_GLOBALS(lock, unlock, fallback) \
 	egg_secure_glob EGG_SECURE_GLOBALS = { \
@@ -100,6 +100,22 @@ void   egg_secure_clear        (void *p, size_t length);
 
 int    egg_secure_check        (const void* p);
 
+/*
+ * Reserve one block of at least length bytes of locked memory up front,
+ * which is never released. Returns the number of bytes reserved, or zero.
+ */
+
+#define EGG_SECURE_HUGE_PAGES       0x0002
+
+size_t egg_secure_reserve      (size_t length, int flags);
+
+/*
+ * Release locked memory that's being kept around for reuse, but isn't
+ * used. Returns the number of bytes released.
+ */
+
+size_t egg_secure_trim         (void);
+
 void   egg_secure_validate     (void);
 
 char*  egg_secure_strdup_full  (const char *tag, const char *str, int options);
@@ -118,4 +134,32 @@ typedef struct {
 
 egg_secure_rec *   egg_secure_records    (unsigned int *count);
 
+/*
+ * Statistics about secure memory, for sizing RLIMIT_MEMLOCK and spotting
+ * secrets that ended up in normal memory. Used memory includes the
+ * guards around each allocation, and small cells that threads keep
+ * cached for reuse. Fragmentation is how much of the unused
+ * memory is outside the largest unused cell, from 0.0 to 1.0.
+ *
+ * Modules like libsecret export this as SECMEM_get_stats, for looking up
+ * with dlsym(). Pass the size of the structure, so that it can grow.
+ */
+
+typedef struct {
+	size_t locked_bytes;
+	size_t locked_high_water;
+	size_t used_bytes;
+	size_t used_high_water;
+	size_t requested_bytes;
+	unsigned int n_blocks;
+	unsigned int n_allocations;
+	double fragmentation;
+	unsigned long n_fallbacks;
+} egg_secure_stats;
+
+#define egg_secure_get_stats SECMEM_get_stats
+
+void               egg_secure_get_stats  (egg_secure_stats *stats,
+                                          size_t length);
+
 #endif /* EGG_SECURE_MEMORY_H */
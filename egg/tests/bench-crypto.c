@@ -0,0 +1,211 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* bench-crypto.c: Benchmark egg-dh.c and egg-hkdf.c
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#include "egg/egg-dh.h"
+#include "egg/egg-hkdf.h"
+#include "egg/egg-libgcrypt.h"
+#include "egg/egg-secure-memory.h"
+#include "egg/tests/egg-bench.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gcrypt.h>
+
+EGG_SECURE_DEFINE_GLIB_GLOBALS ();
+
+EGG_SECURE_DECLARE (bench);
+
+typedef struct {
+	const gchar *name;
+	gcry_mpi_t prime;
+	gcry_mpi_t base;
+	gcry_mpi_t peer;
+	guint bits;
+} DHBench;
+
+static void
+bench_dh_gen_pair (gpointer data)
+{
+	DHBench *bench = data;
+	gcry_mpi_t pub, priv;
+
+	if (!egg_dh_gen_pair (bench->prime, bench->base, bench->bits, &pub, &priv))
+		g_assert_not_reached ();
+
+	gcry_mpi_release (pub);
+	gcry_mpi_release (priv);
+}
+
+static void
+bench_dh_gen_secret (gpointer data)
+{
+	DHBench *bench = data;
+	gcry_mpi_t pub, priv;
+	gpointer secret;
+	gsize n_secret;
+
+	if (!egg_dh_gen_pair (bench->prime, bench->base, bench->bits, &pub, &priv))
+		g_assert_not_reached ();
+
+	secret = egg_dh_gen_secret (bench->peer, priv, bench->prime, &n_secret);
+	g_assert (secret != NULL);
+
+	egg_secure_free (secret);
+	gcry_mpi_release (pub);
+	gcry_mpi_release (priv);
+}
+
+static void
+bench_dh (const gchar *name)
+{
+	DHBench bench = { name, };
+	gcry_mpi_t priv;
+	gchar *param;
+
+	if (!egg_dh_default_params (name, &bench.prime, &bench.base))
+		g_assert_not_reached ();
+	if (!egg_dh_gen_pair (bench.prime, bench.base, 0, &bench.peer, &priv))
+		g_assert_not_reached ();
+	gcry_mpi_release (priv);
+
+	bench.bits = 0;
+	param = g_strdup_printf ("%s/full", name);
+	egg_bench_run ("dh-gen-pair", param, bench_dh_gen_pair, &bench);
+	egg_bench_run ("dh-gen-secret", param, bench_dh_gen_secret, &bench);
+	g_free (param);
+
+	bench.bits = egg_dh_default_exponent_bits (name);
+	param = g_strdup_printf ("%s/%u", name, bench.bits);
+	egg_bench_run ("dh-gen-pair", param, bench_dh_gen_pair, &bench);
+	egg_bench_run ("dh-gen-secret", param, bench_dh_gen_secret, &bench);
+	g_free (param);
+
+	gcry_mpi_release (bench.prime);
+	gcry_mpi_release (bench.base);
+	gcry_mpi_release (bench.peer);
+}
+
+typedef struct {
+	gpointer input;
+	gsize n_input;
+} HkdfBench;
+
+static void
+bench_hkdf_perform (gpointer data)
+{
+	HkdfBench *bench = data;
+	guchar output[16];
+
+	if (!egg_hkdf_perform ("sha256", bench->input, bench->n_input,
+	                       NULL, 0, NULL, 0, output, sizeof (output)))
+		g_assert_not_reached ();
+}
+
+static void
+bench_hkdf (gsize n_input)
+{
+	HkdfBench bench;
+	gchar *param;
+
+	bench.n_input = n_input;
+	bench.input = egg_secure_alloc (n_input);
+	gcry_create_nonce (bench.input, n_input);
+
+	param = g_strdup_printf ("sha256/%" G_GSIZE_FORMAT, n_input);
+	egg_bench_run ("hkdf-perform", param, bench_hkdf_perform, &bench);
+	g_free (param);
+
+	egg_secure_free (bench.input);
+}
+
+#ifdef EGG_DH_WITH_X25519
+
+static void
+bench_x25519_gen_secret (gpointer data)
+{
+	guchar pub[EGG_DH_X25519_SIZE];
+	guchar *priv;
+	gpointer secret;
+	gsize n_secret;
+
+	priv = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	if (!egg_dh_x25519_gen_pair (pub, priv))
+		g_assert_not_reached ();
+
+	secret = egg_dh_x25519_gen_secret (data, EGG_DH_X25519_SIZE, priv, &n_secret);
+	g_assert (secret != NULL);
+
+	egg_secure_free (secret);
+	egg_secure_free (priv);
+}
+
+static void
+bench_x25519 (void)
+{
+	guchar peer[EGG_DH_X25519_SIZE];
+	guchar *priv;
+
+	priv = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	if (!egg_dh_x25519_gen_pair (peer, priv))
+		g_assert_not_reached ();
+	egg_secure_free (priv);
+
+	egg_bench_run ("x25519-gen-secret", "x25519", bench_x25519_gen_secret, peer);
+}
+
+#endif /* EGG_DH_WITH_X25519 */
+
+int
+main (int argc, char **argv)
+{
+	const gchar *groups[] = {
+		"ietf-ike-grp-modp-768",
+		"ietf-ike-grp-modp-1024",
+		"ietf-ike-grp-modp-1536",
+		"ietf-ike-grp-modp-2048",
+		"ietf-ike-grp-modp-3072",
+		"ietf-ike-grp-modp-4096",
+		"ietf-ike-grp-modp-8192",
+	};
+	gsize n_input;
+	guint i;
+
+	egg_libgcrypt_initialize ();
+
+	egg_bench_init ();
+
+	printf ("# name\tparameter\titerations\tops/sec\tlocks/op\n");
+
+	for (i = 0; i < G_N_ELEMENTS (groups); i++)
+		bench_dh (groups[i]);
+
+#ifdef EGG_DH_WITH_X25519
+	bench_x25519 ();
+#endif
+
+	for (n_input = 16; n_input <= 1024 * 1024; n_input *= 16)
+		bench_hkdf (n_input);
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* bench-secmem.c: Benchmark egg-secure-memory.c
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#include "egg/egg-secure-memory.h"
+#include "egg/tests/egg-bench.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+EGG_SECURE_DEFINE_GLIB_GLOBALS ();
+
+/*
+ * Besides the lines described in egg-bench.h, the threaded mixes print
+ * the 99th percentile latency of a single operation in nanoseconds, and
+ * the fragmentation of the pool at the end.
+ */
+
+/* Big enough that each one needs a block of its own */
+#define BLOCK_FILLER 12000
+
+/* Allocations kept alive while churning */
+#define CHURN_LIVE 64
+
+typedef struct {
+	gpointer live[CHURN_LIVE];
+	guint next;
+	gsize size;
+} ChurnBench;
+
+static void
+bench_churn (gpointer data)
+{
+	ChurnBench *bench = data;
+
+	/* Free the oldest, and allocate another in its place */
+	egg_secure_free (bench->live[bench->next]);
+	bench->live[bench->next] = egg_secure_alloc_full ("bench", bench->size,
+	                                                  EGG_SECURE_USE_FALLBACK);
+	bench->next = (bench->next + 1) % CHURN_LIVE;
+}
+
+static void
+bench_blocks (guint n_blocks)
+{
+	const gsize sizes[] = { 64, 1024 };
+	ChurnBench bench;
+	gpointer *fillers;
+	guint n_secure;
+	gchar *param;
+	guint i, j;
+
+	/* Hold the blocks open for the duration */
+	fillers = g_new0 (gpointer, n_blocks);
+	for (i = 0, n_secure = 0; i < n_blocks; i++) {
+		fillers[i] = egg_secure_alloc_full ("bench", BLOCK_FILLER, EGG_SECURE_USE_FALLBACK);
+		if (egg_secure_check (fillers[i]))
+			n_secure++;
+	}
+
+	if (n_secure < n_blocks)
+		fprintf (stderr, "# only %u of %u blocks could be locked, see RLIMIT_MEMLOCK\n",
+		         n_secure, n_blocks);
+
+	for (j = 0; j < G_N_ELEMENTS (sizes); j++) {
+		bench.size = sizes[j];
+		bench.next = 0;
+		for (i = 0; i < CHURN_LIVE; i++)
+			bench.live[i] = egg_secure_alloc_full ("bench", bench.size,
+			                                       EGG_SECURE_USE_FALLBACK);
+
+		param = g_strdup_printf ("blocks=%u/size=%" G_GSIZE_FORMAT, n_secure, bench.size);
+		egg_bench_run ("secmem-churn", param, bench_churn, &bench);
+		g_free (param);
+
+		for (i = 0; i < CHURN_LIVE; i++)
+			egg_secure_free (bench.live[i]);
+	}
+
+	for (i = 0; i < n_blocks; i++)
+		egg_secure_free (fillers[i]);
+	g_free (fillers);
+}
+
+/* Allocations each thread keeps alive, and operations it performs */
+#define MIX_LIVE 64
+#define MIX_OPERATIONS 100000
+
+typedef struct {
+	const gchar *name;
+	guint realloc_percent;   /* Of operations on a live allocation */
+	guint free_percent;      /* The rest leave the allocation alone */
+} Mix;
+
+static const Mix mixes[] = {
+	{ "alloc-free", 0, 100 },
+	{ "realloc", 30, 70 },
+	{ "long-lived", 10, 30 },
+};
+
+typedef struct {
+	const Mix *mix;
+	guint32 seed;
+	gpointer live[MIX_LIVE];
+	gint64 *latencies;
+	guint n_latencies;
+} MixThread;
+
+/* Mostly short passwords, some tokens, and the odd key */
+static gsize
+password_size (GRand *rand)
+{
+	gint32 pick = g_rand_int_range (rand, 0, 100);
+
+	if (pick < 70)
+		return g_rand_int_range (rand, 8, 25);
+	else if (pick < 90)
+		return g_rand_int_range (rand, 32, 129);
+	else if (pick < 98)
+		return g_rand_int_range (rand, 256, 1025);
+	else
+		return g_rand_int_range (rand, 2048, 4097);
+}
+
+static gint64
+monotonic_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static gpointer
+mix_thread (gpointer data)
+{
+	MixThread *thread = data;
+	GRand *rand;
+	gint64 before;
+	gint32 pick;
+	guint slot;
+	guint i;
+
+	rand = g_rand_new_with_seed (thread->seed);
+
+	for (i = 0; i < MIX_OPERATIONS; i++) {
+		slot = g_rand_int_range (rand, 0, MIX_LIVE);
+		pick = g_rand_int_range (rand, 0, 100);
+
+		before = monotonic_ns ();
+
+		if (thread->live[slot] == NULL) {
+			thread->live[slot] = egg_secure_alloc_full ("bench", password_size (rand),
+			                                            EGG_SECURE_USE_FALLBACK);
+		} else if (pick < thread->mix->realloc_percent) {
+			thread->live[slot] = egg_secure_realloc_full ("bench", thread->live[slot],
+			                                              password_size (rand),
+			                                              EGG_SECURE_USE_FALLBACK);
+		} else if (pick < thread->mix->realloc_percent + thread->mix->free_percent) {
+			egg_secure_free (thread->live[slot]);
+			thread->live[slot] = NULL;
+		} else {
+			continue;
+		}
+
+		thread->latencies[thread->n_latencies++] = monotonic_ns () - before;
+	}
+
+	g_rand_free (rand);
+	return NULL;
+}
+
+static gint
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+	gint64 la = *(const gint64 *)a;
+	gint64 lb = *(const gint64 *)b;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static void
+bench_mix (const Mix *mix,
+           guint n_threads)
+{
+	MixThread *threads;
+	GThread **handles;
+	egg_secure_stats stats;
+	gint64 *latencies;
+	guint n_latencies = 0;
+	gdouble elapsed;
+	GTimer *timer;
+	gchar *param;
+	gint calls;
+	guint i, j;
+
+	/* Start from an empty pool */
+	egg_secure_trim ();
+
+	threads = g_new0 (MixThread, n_threads);
+	handles = g_new0 (GThread *, n_threads);
+	for (i = 0; i < n_threads; i++) {
+		threads[i].mix = mix;
+		threads[i].seed = i + 1;
+		threads[i].latencies = g_new (gint64, MIX_OPERATIONS);
+	}
+
+	egg_bench_locks_reset ();
+	timer = g_timer_new ();
+
+	for (i = 0; i < n_threads; i++)
+		handles[i] = g_thread_new ("bench", mix_thread, threads + i);
+	for (i = 0; i < n_threads; i++)
+		g_thread_join (handles[i]);
+
+	elapsed = g_timer_elapsed (timer, NULL);
+	calls = egg_bench_locks ();
+
+	/* While everything is still allocated */
+	egg_secure_get_stats (&stats, sizeof (stats));
+
+	latencies = g_new (gint64, n_threads * MIX_OPERATIONS);
+	for (i = 0; i < n_threads; i++) {
+		memcpy (latencies + n_latencies, threads[i].latencies,
+		        threads[i].n_latencies * sizeof (gint64));
+		n_latencies += threads[i].n_latencies;
+
+		for (j = 0; j < MIX_LIVE; j++)
+			egg_secure_free (threads[i].live[j]);
+		g_free (threads[i].latencies);
+	}
+
+	qsort (latencies, n_latencies, sizeof (gint64), compare_latency);
+
+	param = g_strdup_printf ("%s/threads=%u", mix->name, n_threads);
+	printf ("%s\t%s\t%u\t%.2f\t%.2f\t%" G_GINT64_FORMAT "\t%.3f\n", "secmem-mix", param,
+	        n_latencies, n_latencies / elapsed, (gdouble)calls / MAX (n_latencies, 1),
+	        n_latencies ? latencies[(n_latencies * 99) / 100] : 0, stats.fragmentation);
+	fflush (stdout);
+	g_free (param);
+
+	g_timer_destroy (timer);
+	g_free (latencies);
+	g_free (handles);
+	g_free (threads);
+}
+
+static gint max_threads = 8;
+
+static GOptionEntry entries[] = {
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &max_threads, "Most threads to run the mixes on", "N" },
+	{ NULL }
+};
+
+int
+main (int argc, char **argv)
+{
+	const guint blocks[] = { 1, 16, 256 };
+	GOptionContext *context;
+	GError *error = NULL;
+	guint i, n_threads;
+
+	context = g_option_context_new ("- benchmark secure memory");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "bench-secmem: %s\n", error->message);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	egg_bench_init ();
+
+	printf ("# name\tparameter\titerations\tops/sec\tlocks/op\n");
+
+	for (i = 0; i < G_N_ELEMENTS (blocks); i++)
+		bench_blocks (blocks[i]);
+
+	printf ("# name\tparameter\toperations\tops/sec\tlocks/op\tp99-ns\tfragmentation\n");
+
+	for (i = 0; i < G_N_ELEMENTS (mixes); i++) {
+		for (n_threads = 1; n_threads <= (guint)MAX (max_threads, 1); n_threads *= 2)
+			bench_mix (mixes + i, n_threads);
+	}
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* egg-bench.c: Shared harness for the benchmarks
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#include "egg/egg-secure-memory.h"
+#include "egg/tests/egg-bench.h"
+
+#include <stdio.h>
+
+static void (*real_lock) (void) = NULL;
+static volatile gint lock_calls = 0;
+
+static void
+counting_lock (void)
+{
+	g_atomic_int_inc (&lock_calls);
+	(real_lock) ();
+}
+
+/* Wraps the secure memory lock, so that trips through the pool are counted */
+void
+egg_bench_init (void)
+{
+	g_return_if_fail (real_lock == NULL);
+
+	real_lock = EGG_SECURE_GLOBALS.lock;
+	EGG_SECURE_GLOBALS.lock = counting_lock;
+}
+
+void
+egg_bench_locks_reset (void)
+{
+	g_atomic_int_set (&lock_calls, 0);
+}
+
+gint
+egg_bench_locks (void)
+{
+	return g_atomic_int_get (&lock_calls);
+}
+
+void
+egg_bench_run (const gchar *name,
+               const gchar *param,
+               EggBenchFunc func,
+               gpointer data)
+{
+	GTimer *timer;
+	gdouble elapsed;
+	guint iterations = 0;
+	gint calls;
+
+	timer = g_timer_new ();
+	egg_bench_locks_reset ();
+
+	do {
+		(func) (data);
+		iterations++;
+		elapsed = g_timer_elapsed (timer, NULL);
+	} while (elapsed < EGG_BENCH_SECONDS);
+
+	calls = egg_bench_locks ();
+
+	printf ("%s\t%s\t%u\t%.2f\t%.2f\n", name, param, iterations,
+	        iterations / elapsed, (gdouble)calls / iterations);
+	fflush (stdout);
+
+	g_timer_destroy (timer);
+}
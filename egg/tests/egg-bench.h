@@ -0,0 +1,50 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*- */
+/* egg-bench.h: Shared harness for the benchmarks
+
+   The Gnome Keyring Library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   The Gnome Keyring Library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with the Gnome Library; see the file COPYING.LIB.  If not,
+   write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef EGG_BENCH_H_
+#define EGG_BENCH_H_
+
+#include <glib.h>
+
+/*
+ * Each benchmark prints one tab separated line:
+ *
+ *   name  parameter  iterations  ops/sec  locks/op
+ *
+ * The last column counts trips through the shared secure memory pool,
+ * which take its lock. Small cells reused from a thread's magazine don't,
+ * so this isn't the number of secure memory calls.
+ */
+
+#define EGG_BENCH_SECONDS 0.5
+
+typedef void (*EggBenchFunc) (gpointer data);
+
+void       egg_bench_init              (void);
+
+void       egg_bench_locks_reset       (void);
+
+gint       egg_bench_locks             (void);
+
+void       egg_bench_run               (const gchar *name,
+                                        const gchar *param,
+                                        EggBenchFunc func,
+                                        gpointer data);
+
+#endif /* EGG_BENCH_H_ */
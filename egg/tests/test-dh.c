@@ -24,6 +24,8 @@
 #include "config.h"
 
 #include "egg/egg-dh.h"
+#include "egg/egg-hex.h"
+#include "egg/egg-libgcrypt.h"
 #include "egg/egg-secure-memory.h"
 #include "egg/egg-testing.h"
 
@@ -99,6 +101,190 @@ test_short_pair (void)
 	gcry_mpi_release (X1);
 }
 
+static void
+test_short_exponent (void)
+{
+	gcry_mpi_t p, g;
+	gcry_mpi_t x1, X1;
+	gcry_mpi_t x2, X2;
+	gpointer k1, k2;
+	gboolean ret;
+	gsize n1, n2;
+	guint bits;
+
+	ret = egg_dh_default_params ("ietf-ike-grp-modp-2048", &p, &g);
+	g_assert (ret);
+
+	bits = egg_dh_default_exponent_bits ("ietf-ike-grp-modp-2048");
+	g_assert_cmpuint (bits, ==, 256);
+
+	/* Generate secrets with short exponents */
+	ret = egg_dh_gen_pair (p, g, bits, &X1, &x1);
+	g_assert (ret);
+	g_assert_cmpuint (gcry_mpi_get_nbits (x1), <=, bits);
+	ret = egg_dh_gen_pair (p, g, bits, &X2, &x2);
+	g_assert (ret);
+	g_assert_cmpuint (gcry_mpi_get_nbits (x2), <=, bits);
+
+	/* Calculate keys */
+	k1 = egg_dh_gen_secret (X2, x1, p, &n1);
+	g_assert (k1);
+	k2 = egg_dh_gen_secret (X1, x2, p, &n2);
+	g_assert (k2);
+
+	/* Keys must be the same */
+	egg_assert_cmpsize (n1, ==, n2);
+	g_assert (memcmp (k1, k2, n1) == 0);
+
+	gcry_mpi_release (p);
+	gcry_mpi_release (g);
+	gcry_mpi_release (x1);
+	gcry_mpi_release (X1);
+	egg_secure_free (k1);
+	gcry_mpi_release (x2);
+	gcry_mpi_release (X2);
+	egg_secure_free (k2);
+}
+
+static void
+test_short_exponent_vector (void)
+{
+	gcry_mpi_t p, g;
+	gcry_mpi_t priv, peer;
+	gcry_error_t gcry;
+	gpointer check;
+	gpointer secret;
+	gsize n_check;
+	gsize n_secret;
+	gboolean ret;
+
+	ret = egg_dh_default_params ("ietf-ike-grp-modp-768", &p, &g);
+	g_assert (ret);
+
+	/* 256 bit private exponent */
+	gcry = gcry_mpi_scan (&priv, GCRYMPI_FMT_HEX,
+	                      "8F3A6B1C2D4E5F60718293A4B5C6D7E8F90A1B2C3D4E5F60718293A4B5C6D7E8", 0, NULL);
+	g_assert (gcry == 0);
+
+	/* 2 ^ 0x2B7E151628AED2A6ABF7158809CF4F3C762E7160F38B4DA56A784D9045190CFE mod p */
+	gcry = gcry_mpi_scan (&peer, GCRYMPI_FMT_HEX,
+	                      "744421B447A43893D3FC2A25418C82D84E009F4752E92D97E0BD8F9C77864643"
+	                      "D09499E9B5D5A04F700D615F048CB3C09DD49D1BF9E155FE821723866571BA29"
+	                      "0344C77826BBEAEA74F81B6D5E3EDE4CB9550508E94C7C43586A7101ED4210E1", 0, NULL);
+	g_assert (gcry == 0);
+
+	check = egg_hex_decode ("1485B4AEF5BBA610ADDE36218ACC5CE014091F138D3CDFCD85D4D4EECCCB08C0"
+	                        "061A1E97581942A38F8075356BBA4F455FBB62D1FB9F062D1D92458009EE1996"
+	                        "C17EFFD9DD2993CE280B8387E95BFAAD5B123F94D997E0F93E0A507D41F348E9", -1, &n_check);
+	g_assert (check != NULL);
+
+	secret = egg_dh_gen_secret (peer, priv, p, &n_secret);
+	g_assert (secret != NULL);
+	egg_assert_cmpmem (secret, n_secret, ==, check, n_check);
+
+	gcry_mpi_release (p);
+	gcry_mpi_release (g);
+	gcry_mpi_release (priv);
+	gcry_mpi_release (peer);
+	egg_secure_free (secret);
+	g_free (check);
+}
+
+static void
+test_cached_group (void)
+{
+	gcry_mpi_t p, g;
+	gcry_mpi_t x, X;
+	gcry_mpi_t check;
+	gboolean ret;
+	guint bits;
+	gint i;
+
+	ret = egg_dh_default_params ("ietf-ike-grp-modp-1536", &p, &g);
+	g_assert (ret);
+
+	bits = egg_dh_default_exponent_bits ("ietf-ike-grp-modp-1536");
+	check = gcry_mpi_new (0);
+
+	/* Each pair comes from the same cached group */
+	for (i = 0; i < 4; i++) {
+		ret = egg_dh_gen_pair (p, g, bits, &X, &x);
+		g_assert (ret);
+
+		gcry_mpi_powm (check, g, x, p);
+		g_assert (gcry_mpi_cmp (check, X) == 0);
+
+		gcry_mpi_release (x);
+		gcry_mpi_release (X);
+	}
+
+	gcry_mpi_release (check);
+	gcry_mpi_release (p);
+	gcry_mpi_release (g);
+}
+
+static void
+check_dh_timing (const gchar *name)
+{
+	gcry_mpi_t p, g;
+	gcry_mpi_t x1, X1;
+	gcry_mpi_t x2, X2;
+	gdouble full, shrt;
+	gpointer k;
+	gboolean ret;
+	gsize n;
+	guint bits;
+
+	ret = egg_dh_default_params (name, &p, &g);
+	g_assert (ret);
+
+	/* A peer whose public value we use */
+	ret = egg_dh_gen_pair (p, g, 0, &X2, &x2);
+	g_assert (ret);
+
+	bits = egg_dh_default_exponent_bits (name);
+
+	g_test_timer_start ();
+	ret = egg_dh_gen_pair (p, g, 0, &X1, &x1);
+	g_assert (ret);
+	k = egg_dh_gen_secret (X2, x1, p, &n);
+	g_assert (k);
+	full = g_test_timer_elapsed ();
+	egg_secure_free (k);
+	gcry_mpi_release (x1);
+	gcry_mpi_release (X1);
+
+	g_test_timer_start ();
+	ret = egg_dh_gen_pair (p, g, bits, &X1, &x1);
+	g_assert (ret);
+	k = egg_dh_gen_secret (X2, x1, p, &n);
+	g_assert (k);
+	shrt = g_test_timer_elapsed ();
+	egg_secure_free (k);
+	gcry_mpi_release (x1);
+	gcry_mpi_release (X1);
+
+	g_test_minimized_result (shrt, "%s: %.4f sec with full exponent, %.4f sec with %u bit exponent",
+	                         name, full, shrt, bits);
+
+	gcry_mpi_release (x2);
+	gcry_mpi_release (X2);
+	gcry_mpi_release (p);
+	gcry_mpi_release (g);
+}
+
+static void
+test_timing (void)
+{
+	check_dh_timing ("ietf-ike-grp-modp-768");
+	check_dh_timing ("ietf-ike-grp-modp-1024");
+	check_dh_timing ("ietf-ike-grp-modp-1536");
+	check_dh_timing ("ietf-ike-grp-modp-2048");
+	check_dh_timing ("ietf-ike-grp-modp-3072");
+	check_dh_timing ("ietf-ike-grp-modp-4096");
+	check_dh_timing ("ietf-ike-grp-modp-8192");
+}
+
 static void
 check_dh_default (const gchar *name, guint bits)
 {
@@ -112,6 +298,8 @@ check_dh_default (const gchar *name, guint bits)
 	g_assert (ret);
 	g_assert_cmpint (gcry_mpi_get_nbits (p), ==, bits);
 	g_assert_cmpint (gcry_mpi_get_nbits (g), <, gcry_mpi_get_nbits (p));
+	g_assert_cmpuint (egg_dh_default_exponent_bits (name), >=, 256);
+	g_assert_cmpuint (egg_dh_default_exponent_bits (name), <, bits);
 
 	ret = egg_dh_default_params_raw (name, &prime, &n_prime, &base, &n_base);
 	g_assert (ret);
@@ -184,6 +372,142 @@ test_default_bad (void)
 
 	ret = egg_dh_default_params ("bad-name", &p, &g);
 	g_assert (!ret);
+
+	g_assert_cmpuint (egg_dh_default_exponent_bits ("bad-name"), ==, 0);
+}
+
+#ifdef EGG_DH_WITH_X25519
+
+static void
+test_x25519_perform (void)
+{
+	guchar *priv1, *priv2;
+	guchar pub1[EGG_DH_X25519_SIZE];
+	guchar pub2[EGG_DH_X25519_SIZE];
+	gpointer k1, k2;
+	gsize n1, n2;
+	gboolean ret;
+
+	priv1 = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	priv2 = egg_secure_alloc (EGG_DH_X25519_SIZE);
+
+	ret = egg_dh_x25519_gen_pair (pub1, priv1);
+	g_assert (ret);
+	ret = egg_dh_x25519_gen_pair (pub2, priv2);
+	g_assert (ret);
+
+	k1 = egg_dh_x25519_gen_secret (pub2, sizeof (pub2), priv1, &n1);
+	g_assert (k1);
+	k2 = egg_dh_x25519_gen_secret (pub1, sizeof (pub1), priv2, &n2);
+	g_assert (k2);
+
+	/* Keys must be the same */
+	egg_assert_cmpsize (n1, ==, EGG_DH_X25519_SIZE);
+	egg_assert_cmpsize (n1, ==, n2);
+	g_assert (memcmp (k1, k2, n1) == 0);
+
+	egg_secure_free (priv1);
+	egg_secure_free (priv2);
+	egg_secure_free (k1);
+	egg_secure_free (k2);
+}
+
+static void
+test_x25519_rfc7748 (void)
+{
+	guchar *priv, *peer, *check;
+	gpointer secret;
+	gsize n_priv, n_peer, n_check, n_secret;
+
+	/* Test vector from RFC 7748, section 6.1 */
+	priv = egg_hex_decode ("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", -1, &n_priv);
+	peer = egg_hex_decode ("de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f", -1, &n_peer);
+	check = egg_hex_decode ("4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742", -1, &n_check);
+
+	secret = egg_dh_x25519_gen_secret (peer, n_peer, priv, &n_secret);
+	g_assert (secret != NULL);
+	egg_assert_cmpmem (secret, n_secret, ==, check, n_check);
+
+	egg_secure_free (secret);
+	g_free (priv);
+	g_free (peer);
+	g_free (check);
+}
+
+static void
+test_x25519_bad_peer (void)
+{
+	guchar priv[EGG_DH_X25519_SIZE];
+	guchar pub[EGG_DH_X25519_SIZE];
+	guchar zero[EGG_DH_X25519_SIZE];
+	gsize n_secret;
+	gboolean ret;
+
+	ret = egg_dh_x25519_gen_pair (pub, priv);
+	g_assert (ret);
+
+	/* Wrong length */
+	g_assert (egg_dh_x25519_gen_secret (pub, 16, priv, &n_secret) == NULL);
+
+	/* A point of small order results in an all zero secret */
+	memset (zero, 0, sizeof (zero));
+	g_assert (egg_dh_x25519_gen_secret (zero, sizeof (zero), priv, &n_secret) == NULL);
+}
+
+#endif /* EGG_DH_WITH_X25519 */
+
+static guint
+count_libgcrypt_records (void)
+{
+	egg_secure_rec *records;
+	guint count, i, n_libgcrypt = 0;
+
+	records = egg_secure_records (&count);
+	for (i = 0; i < count; i++) {
+		if (g_strcmp0 (records[i].tag, "libgcrypt") == 0)
+			n_libgcrypt++;
+	}
+	free (records);
+
+	return n_libgcrypt;
+}
+
+static void
+test_secure_memory (void)
+{
+	gcry_mpi_t p, g;
+	gcry_mpi_t x, X;
+	gpointer memory;
+	gboolean locked;
+	guint before;
+	gboolean ret;
+
+	/* Secure memory from libgcrypt comes from our pool */
+	memory = gcry_malloc_secure (32);
+	g_assert (memory != NULL);
+	locked = egg_secure_check (memory);
+	g_assert_cmpint (gcry_is_secure (memory), ==, locked);
+	gcry_free (memory);
+
+	if (!locked) {
+		g_test_message ("couldn't allocate locked memory, skipping test");
+		return;
+	}
+
+	ret = egg_dh_default_params ("ietf-ike-grp-modp-1024", &p, &g);
+	g_assert (ret);
+
+	/* Including the private key */
+	before = count_libgcrypt_records ();
+	ret = egg_dh_gen_pair (p, g, 0, &X, &x);
+	g_assert (ret);
+	g_assert (gcry_mpi_get_flag (x, GCRYMPI_FLAG_SECURE));
+	g_assert_cmpuint (count_libgcrypt_records (), >, before);
+
+	gcry_mpi_release (p);
+	gcry_mpi_release (g);
+	gcry_mpi_release (x);
+	gcry_mpi_release (X);
 }
 
 int
@@ -191,11 +515,17 @@ main (int argc, char **argv)
 {
 	g_test_init (&argc, &argv, NULL);
 
+	egg_libgcrypt_initialize ();
+
 	if (!g_test_quick ()) {
 		g_test_add_func ("/dh/perform", test_perform);
 		g_test_add_func ("/dh/short_pair", test_short_pair);
+		g_test_add_func ("/dh/short_exponent", test_short_exponent);
 	}
 
+	g_test_add_func ("/dh/short_exponent_vector", test_short_exponent_vector);
+	g_test_add_func ("/dh/cached_group", test_cached_group);
+
 	g_test_add_func ("/dh/default_768", test_default_768);
 	g_test_add_func ("/dh/default_1024", test_default_1024);
 	g_test_add_func ("/dh/default_1536", test_default_1536);
@@ -204,6 +534,16 @@ main (int argc, char **argv)
 	g_test_add_func ("/dh/default_4096", test_default_4096);
 	g_test_add_func ("/dh/default_8192", test_default_8192);
 	g_test_add_func ("/dh/default_bad", test_default_bad);
+	g_test_add_func ("/dh/secure_memory", test_secure_memory);
+
+	if (g_test_perf ())
+		g_test_add_func ("/dh/timing", test_timing);
+
+#ifdef EGG_DH_WITH_X25519
+	g_test_add_func ("/dh/x25519_perform", test_x25519_perform);
+	g_test_add_func ("/dh/x25519_rfc7748", test_x25519_rfc7748);
+	g_test_add_func ("/dh/x25519_bad_peer", test_x25519_bad_peer);
+#endif
 
 	return g_test_run ();
 }
@@ -218,6 +218,343 @@ test_multialloc (void)
 	egg_secure_warnings = 1;
 }
 
+static void
+test_reuse_freed (void)
+{
+	/* Sizes which each fall into a different bin */
+	const gsize sizes[] = { 16, 64, 200, 400 };
+	gpointer memory[64];
+	gpointer freed[32];
+	gsize size;
+	int i, j;
+
+	for (i = 0; i < 64; i++)
+		memory[i] = egg_secure_alloc_full ("tests", sizes[(i / 2) % 4], 0);
+
+	/* Leave a hole after every other allocation */
+	for (i = 0; i < 64; i += 2) {
+		freed[i / 2] = memory[i];
+		egg_secure_free_full (memory[i], 0);
+	}
+
+	/* The same sizes again should be placed back into those holes */
+	for (i = 0; i < 64; i += 2) {
+		size = sizes[(i / 2) % 4];
+		memory[i] = egg_secure_alloc_full ("tests", size, 0);
+		g_assert (memory[i] != NULL);
+		g_assert_cmpint (G_MAXSIZE, ==, find_non_zero (memory[i], size));
+
+		for (j = 0; j < 32; j++) {
+			if (freed[j] == memory[i])
+				break;
+		}
+		g_assert_cmpint (j, <, 32);
+		freed[j] = NULL;
+	}
+
+	egg_secure_validate ();
+
+	for (i = 0; i < 64; i++)
+		egg_secure_free_full (memory[i], 0);
+}
+
+static void
+test_many_blocks (void)
+{
+	gpointer memory[32];
+	gboolean secure[32];
+	gpointer other;
+	int i, n_secure = 0;
+
+	/* Each of these needs a block of its own */
+	for (i = 0; i < 32; ++i) {
+		memory[i] = egg_secure_alloc_full ("tests", 12000, EGG_SECURE_USE_FALLBACK);
+		g_assert (memory[i] != NULL);
+		secure[i] = egg_secure_check (memory[i]);
+		if (secure[i])
+			n_secure++;
+	}
+
+	/* We need at least some locked memory for this test */
+	g_assert_cmpint (n_secure, >, 1);
+
+	other = g_malloc (64);
+	g_assert (!egg_secure_check (other));
+	g_free (other);
+
+	/* The right block is found for any address in it */
+	for (i = 0; i < 32; ++i) {
+		g_assert_cmpint (egg_secure_check (memory[i]), ==, secure[i]);
+		g_assert_cmpint (egg_secure_check ((gchar *)memory[i] + 11999), ==, secure[i]);
+	}
+
+	/* Free every other one first, so blocks leave the middle of the index */
+	for (i = 0; i < 32; i += 2)
+		egg_secure_free (memory[i]);
+
+	egg_secure_validate ();
+
+	for (i = 1; i < 32; i += 2) {
+		g_assert_cmpint (egg_secure_check (memory[i]), ==, secure[i]);
+		egg_secure_free (memory[i]);
+	}
+
+	egg_secure_validate ();
+}
+
+#define STRESS_THREADS  8
+#define STRESS_CELLS    64
+
+static gpointer
+stress_thread (gpointer data)
+{
+	GAsyncQueue *handover = data;
+	gpointer memory[STRESS_CELLS] = { NULL, };
+	gsize lengths[STRESS_CELLS];
+	gpointer other;
+	guchar *bytes;
+	GRand *rand;
+	gsize j;
+	int i, k;
+
+	rand = g_rand_new ();
+
+	for (k = 0; k < 20000; ++k) {
+		i = g_rand_int_range (rand, 0, STRESS_CELLS);
+
+		if (memory[i] == NULL) {
+			lengths[i] = g_rand_int_range (rand, 1, 600);
+			memory[i] = egg_secure_alloc_full ("tests", lengths[i], 0);
+			g_assert (memory[i] != NULL);
+
+			/* Never anything left over from whoever used it before */
+			g_assert_cmpint (G_MAXSIZE, ==, find_non_zero (memory[i], lengths[i]));
+			memset (memory[i], i + 1, lengths[i]);
+
+		} else {
+			bytes = memory[i];
+			for (j = 0; j < lengths[i]; ++j)
+				g_assert_cmpint (bytes[j], ==, i + 1);
+
+			/* Sometimes another thread gets to free it */
+			if (g_rand_int_range (rand, 0, 4) == 0)
+				g_async_queue_push (handover, memory[i]);
+			else
+				egg_secure_free_full (memory[i], 0);
+			memory[i] = NULL;
+		}
+
+		other = g_async_queue_try_pop (handover);
+		if (other != NULL)
+			egg_secure_free_full (other, 0);
+	}
+
+	for (i = 0; i < STRESS_CELLS; ++i)
+		egg_secure_free_full (memory[i], 0);
+
+	g_rand_free (rand);
+	return NULL;
+}
+
+static void
+test_threads (void)
+{
+	GThread *threads[STRESS_THREADS];
+	GAsyncQueue *handover;
+	egg_secure_rec *records;
+	unsigned int count, i;
+	gpointer other;
+
+	handover = g_async_queue_new ();
+
+	for (i = 0; i < STRESS_THREADS; ++i)
+		threads[i] = g_thread_new ("stress", stress_thread, handover);
+	for (i = 0; i < STRESS_THREADS; ++i)
+		g_thread_join (threads[i]);
+
+	while ((other = g_async_queue_try_pop (handover)) != NULL)
+		egg_secure_free_full (other, 0);
+	g_async_queue_unref (handover);
+
+	egg_secure_validate ();
+
+	/* Everything was freed, whichever thread did it */
+	records = egg_secure_records (&count);
+	for (i = 0; i < count; ++i)
+		g_assert_cmpstr (records[i].tag, !=, "tests");
+	free (records);
+}
+
+static void
+test_stats (void)
+{
+	egg_secure_stats before, during, after;
+	gpointer memory[8];
+	guint i;
+
+	egg_secure_get_stats (&before, sizeof (before));
+	g_assert_cmpuint (before.locked_high_water, >=, before.locked_bytes);
+	g_assert_cmpuint (before.used_high_water, >=, before.used_bytes);
+
+	/* Too big to be cached by a thread */
+	for (i = 0; i < G_N_ELEMENTS (memory); i++) {
+		memory[i] = egg_secure_alloc_full ("tests", 1000, 0);
+		if (memory[i] == NULL) {
+			g_test_message ("couldn't allocate locked memory, skipping test");
+			return;
+		}
+	}
+
+	egg_secure_get_stats (&during, sizeof (during));
+	g_assert_cmpuint (during.n_blocks, >=, 1);
+	g_assert_cmpuint (during.n_allocations, ==, before.n_allocations + G_N_ELEMENTS (memory));
+	g_assert_cmpuint (during.requested_bytes, ==, before.requested_bytes + 1000 * G_N_ELEMENTS (memory));
+	g_assert_cmpuint (during.used_bytes, >=, during.requested_bytes);
+	g_assert_cmpuint (during.locked_bytes, >=, during.used_bytes);
+	g_assert_cmpuint (during.used_high_water, >=, during.used_bytes);
+	g_assert_cmpuint (during.locked_high_water, >=, during.locked_bytes);
+	g_assert (during.fragmentation >= 0.0 && during.fragmentation <= 1.0);
+	g_assert_cmpuint (during.n_fallbacks, ==, before.n_fallbacks);
+
+	for (i = 0; i < G_N_ELEMENTS (memory); i++)
+		egg_secure_free_full (memory[i], 0);
+
+	egg_secure_get_stats (&after, sizeof (after));
+	g_assert_cmpuint (after.n_allocations, ==, before.n_allocations);
+	g_assert_cmpuint (after.requested_bytes, ==, before.requested_bytes);
+	g_assert_cmpuint (after.used_bytes, ==, before.used_bytes);
+	g_assert_cmpuint (after.used_high_water, >=, during.used_bytes);
+	g_assert_cmpuint (after.locked_high_water, >=, during.locked_bytes);
+}
+
+static void
+test_retain_trim (void)
+{
+	egg_secure_stats stats;
+	gpointer memory;
+	guint n_blocks;
+	gint i;
+
+	/* Start without any retained blocks */
+	egg_secure_trim ();
+	egg_secure_get_stats (&stats, sizeof (stats));
+	n_blocks = stats.n_blocks;
+
+	/* Needs a block of its own */
+	memory = egg_secure_alloc_full ("tests", 12000, 0);
+	if (memory == NULL) {
+		g_test_message ("couldn't allocate locked memory, skipping test");
+		return;
+	}
+
+	egg_secure_get_stats (&stats, sizeof (stats));
+	g_assert_cmpuint (stats.n_blocks, ==, n_blocks + 1);
+
+	/* The block is kept while allocating and freeing over and over */
+	for (i = 0; i < 8; i++) {
+		egg_secure_free_full (memory, 0);
+		egg_secure_get_stats (&stats, sizeof (stats));
+		g_assert_cmpuint (stats.n_blocks, ==, n_blocks + 1);
+
+		memory = egg_secure_alloc_full ("tests", 12000, 0);
+		g_assert (memory != NULL);
+		egg_secure_get_stats (&stats, sizeof (stats));
+		g_assert_cmpuint (stats.n_blocks, ==, n_blocks + 1);
+	}
+
+	egg_secure_free_full (memory, 0);
+	egg_secure_validate ();
+
+	g_assert_cmpuint (egg_secure_trim (), >=, 12000);
+	egg_secure_get_stats (&stats, sizeof (stats));
+	g_assert_cmpuint (stats.n_blocks, ==, n_blocks);
+
+	/* Nothing more to release */
+	g_assert_cmpuint (egg_secure_trim (), ==, 0);
+}
+
+static gulong
+count_fallbacks (void)
+{
+	egg_secure_stats stats;
+
+	egg_secure_get_stats (&stats, sizeof (stats));
+	return stats.n_fallbacks;
+}
+
+static void
+test_fallback_count (void)
+{
+	gpointer memory[4];
+	gulong before;
+	guint i;
+
+	before = count_fallbacks ();
+
+	g_setenv ("SECMEM_FORCE_FALLBACK", "1", TRUE);
+
+	/* Too big for any existing block */
+	for (i = 0; i < G_N_ELEMENTS (memory); i++) {
+		memory[i] = egg_secure_alloc_full ("tests", 64 * 1024, EGG_SECURE_USE_FALLBACK);
+		g_assert (memory[i] != NULL);
+		g_assert (!egg_secure_check (memory[i]));
+	}
+
+	/* Without the fallback, nothing is counted */
+	g_assert (egg_secure_alloc_full ("tests", 64 * 1024, 0) == NULL);
+
+	g_unsetenv ("SECMEM_FORCE_FALLBACK");
+
+	g_assert_cmpuint (count_fallbacks (), ==, before + G_N_ELEMENTS (memory));
+
+	for (i = 0; i < G_N_ELEMENTS (memory); i++)
+		egg_secure_free (memory[i]);
+}
+
+static void
+test_reserve (void)
+{
+	egg_secure_rec *records;
+	gpointer memory[16];
+	gsize reserved;
+	guint count, i;
+	gboolean found;
+
+	reserved = egg_secure_reserve (256 * 1024, 0);
+	if (reserved == 0) {
+		g_test_message ("couldn't reserve locked memory, skipping test");
+		return;
+	}
+
+	g_assert_cmpuint (reserved, >=, 256 * 1024);
+
+	/* Asking again gives back the same block */
+	g_assert_cmpuint (egg_secure_reserve (1024, 0), ==, reserved);
+
+	for (i = 0; i < G_N_ELEMENTS (memory); i++) {
+		memory[i] = egg_secure_alloc_full ("tests", 8000, 0);
+		g_assert (memory[i] != NULL);
+		g_assert (egg_secure_check (memory[i]));
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (memory); i++)
+		egg_secure_free_full (memory[i], 0);
+
+	egg_secure_validate ();
+
+	/* With nothing used, the reserved memory is kept */
+	found = FALSE;
+	records = egg_secure_records (&count);
+	for (i = 0; i < count; i++) {
+		g_assert_cmpstr (records[i].tag, !=, "tests");
+		if (records[i].block_length == reserved)
+			found = TRUE;
+	}
+	free (records);
+
+	g_assert (found);
+}
+
 static void
 test_clear (void)
 {
@@ -261,8 +598,15 @@ main (int argc, char **argv)
 	g_test_add_func ("/secmem/alloc_two", test_alloc_two);
 	g_test_add_func ("/secmem/realloc", test_realloc);
 	g_test_add_func ("/secmem/multialloc", test_multialloc);
+	g_test_add_func ("/secmem/reuse_freed", test_reuse_freed);
+	g_test_add_func ("/secmem/many_blocks", test_many_blocks);
+	g_test_add_func ("/secmem/threads", test_threads);
 	g_test_add_func ("/secmem/clear", test_clear);
 	g_test_add_func ("/secmem/strclear", test_strclear);
+	g_test_add_func ("/secmem/stats", test_stats);
+	g_test_add_func ("/secmem/retain_trim", test_retain_trim);
+	g_test_add_func ("/secmem/fallback_count", test_fallback_count);
+	g_test_add_func ("/secmem/reserve", test_reserve);
 
 	return g_test_run ();
 }
@@ -122,43 +122,33 @@ GHashTable *
 secret_attributes_buildv (const SecretSchema *schema,
                           va_list va)
 {
+	const SecretSchemaAttribute *attribute;
 	const gchar *attribute_name;
-	SecretSchemaAttributeType type;
 	GHashTable *attributes;
+	GHashTable *index;
 	const gchar *string;
-	gboolean type_found;
 	gchar *value = NULL;
 	gboolean boolean;
 	gint integer;
-	gint i;
 
 	g_return_val_if_fail (schema != NULL, NULL);
 
 	attributes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	index = _secret_schema_get_index (schema);
 
 	for (;;) {
 		attribute_name = va_arg (va, const gchar *);
 		if (attribute_name == NULL)
 			break;
 
-		type_found = FALSE;
-		for (i = 0; i < G_N_ELEMENTS (schema->attributes); ++i) {
-			if (!schema->attributes[i].name)
-				break;
-			if (g_str_equal (schema->attributes[i].name, attribute_name)) {
-				type_found = TRUE;
-				type = schema->attributes[i].type;
-				break;
-			}
-		}
-
-		if (!type_found) {
+		attribute = _secret_schema_find_attribute (schema, index, attribute_name);
+		if (attribute == NULL) {
 			g_critical ("The attribute '%s' was not found in the password schema.", attribute_name);
 			g_hash_table_unref (attributes);
 			return NULL;
 		}
 
-		switch (type) {
+		switch (attribute->type) {
 		case SECRET_SCHEMA_ATTRIBUTE_BOOLEAN:
 			boolean = va_arg (va, gboolean);
 			value = g_strdup (boolean ? "true" : "false");
@@ -200,14 +190,16 @@ _secret_attributes_validate (const SecretSchema *schema,
 {
 	const SecretSchemaAttribute *attribute;
 	GHashTableIter iter;
+	GHashTable *index;
 	gboolean any;
 	gchar *key;
 	gchar *value;
 	gchar *end;
-	gint i;
 
 	g_return_val_if_fail (schema != NULL, FALSE);
 
+	index = _secret_schema_get_index (schema);
+
 	g_hash_table_iter_init (&iter, attributes);
 	while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&value)) {
 		any = TRUE;
@@ -228,17 +220,7 @@ _secret_attributes_validate (const SecretSchema *schema,
 		if (g_str_has_prefix (key, "gkr:"))
 			continue;
 
-		/* Find the attribute */
-		attribute = NULL;
-		for (i = 0; i < G_N_ELEMENTS (schema->attributes); i++) {
-			if (schema->attributes[i].name == NULL)
-				break;
-			if (g_str_equal (schema->attributes[i].name, key)) {
-				attribute = &schema->attributes[i];
-				break;
-			}
-		}
-
+		attribute = _secret_schema_find_attribute (schema, index, key);
 		if (attribute == NULL) {
 			g_critical ("%s: invalid %s attribute for %s schema",
 			            pretty_function, key, schema->name);
@@ -1590,6 +1590,55 @@ on_item_set_secret (GObject *source,
 	g_object_unref (res);
 }
 
+static void
+set_secret_call (SecretItem *self,
+                 GSimpleAsyncResult *res,
+                 gboolean use_fd)
+{
+	SetClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	SecretSession *session;
+	GUnixFDList *fds;
+	GVariant *encoded;
+
+	session = _secret_service_get_session (self->pv->service);
+
+	/* Falls back to the secret in the message if the memfd doesn't work out */
+	if (use_fd) {
+		fds = g_unix_fd_list_new ();
+		encoded = _secret_session_encode_secret_fd (session, closure->value, fds);
+		if (encoded != NULL)
+			g_dbus_proxy_call_with_unix_fd_list (G_DBUS_PROXY (self),
+			                                     SECRET_FD_TRANSFER_INTERFACE ".SetSecret",
+			                                     g_variant_new ("(@(oayhs))", encoded),
+			                                     G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, fds,
+			                                     closure->cancellable, on_item_set_secret,
+			                                     g_object_ref (res));
+		g_object_unref (fds);
+		if (encoded != NULL)
+			return;
+	}
+
+	encoded = _secret_session_encode_secret (session, closure->value);
+	g_dbus_proxy_call (G_DBUS_PROXY (self), "SetSecret",
+	                   g_variant_new ("(@(oayays))", encoded),
+	                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, closure->cancellable,
+	                   on_item_set_secret, g_object_ref (res));
+}
+
+static void
+on_set_negotiate_fd (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
+
+	set_secret_call (self, res, _secret_session_negotiate_fd_finish (result));
+
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
 static void
 on_set_ensure_session (GObject *source,
                        GAsyncResult *result,
@@ -1598,22 +1647,23 @@ on_set_ensure_session (GObject *source,
 	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
 	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
 	SetClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
-	SecretSession *session;
-	GVariant *encoded;
 	GError *error = NULL;
+	gsize length;
+
+	secret_value_get (closure->value, &length);
 
 	secret_service_ensure_session_finish (self->pv->service, result, &error);
 	if (error != NULL) {
 		g_simple_async_result_take_error (res, error);
 		g_simple_async_result_complete (res);
 
+	/* Large secrets go in a memfd if the service can take them that way */
+	} else if (length >= SECRET_SESSION_FD_THRESHOLD) {
+		_secret_session_negotiate_fd (self->pv->service, closure->cancellable,
+		                              on_set_negotiate_fd, g_object_ref (res));
+
 	} else {
-		session = _secret_service_get_session (self->pv->service);
-		encoded = _secret_session_encode_secret (session, closure->value);
-		g_dbus_proxy_call (G_DBUS_PROXY (self), "SetSecret",
-		                   g_variant_new ("(@(oayays))", encoded),
-		                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, closure->cancellable,
-		                   on_item_set_secret, g_object_ref (res));
+		set_secret_call (self, res, FALSE);
 	}
 
 	g_object_unref (self);
@@ -1633,6 +1683,9 @@ on_set_ensure_session (GObject *source,
  * Each item has a single secret which might be a password or some
  * other secret binary value.
  *
+ * Large secrets are passed to the service in a sealed memfd, rather than
+ * in the message, if the service supports it.
+ *
  * This function returns immediately and completes asynchronously.
  */
 void
@@ -1735,6 +1788,315 @@ secret_item_set_secret_sync (SecretItem *self,
 	return ret;
 }
 
+typedef struct {
+	GCancellable *cancellable;
+	GInputStream *stream;
+	gchar *content_type;
+	SecretSessionEncoder *encoder;
+	gboolean use_fd;
+	gsize n_read;
+	GUnixFDList *fds;
+} StreamClosure;
+
+static void
+stream_closure_free (gpointer data)
+{
+	StreamClosure *closure = data;
+	g_clear_object (&closure->cancellable);
+	g_clear_object (&closure->fds);
+	g_object_unref (closure->stream);
+	g_free (closure->content_type);
+	_secret_session_encoder_free (closure->encoder);
+	g_slice_free (StreamClosure, closure);
+}
+
+static void
+on_stream_set_secret (GObject *source,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
+	GError *error = NULL;
+	GVariant *retval;
+
+	retval = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), result, &error);
+
+	/* We never held the whole secret, so don't cache a stale one */
+	if (error == NULL)
+		_secret_item_set_cached_secret (self, NULL);
+	else
+		g_simple_async_result_take_error (res, error);
+	if (retval != NULL)
+		g_variant_unref (retval);
+
+	g_simple_async_result_complete (res);
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
+static void
+stream_read_next (GSimpleAsyncResult *res);
+
+static void
+on_stream_read (GObject *source,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GVariant *encoded = NULL;
+	GError *error = NULL;
+	gssize count;
+
+	count = g_input_stream_read_finish (closure->stream, result, &error);
+
+	if (count > 0) {
+		closure->n_read += count;
+
+		if (!_secret_session_encoder_update (closure->encoder, count)) {
+			g_set_error (&error, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+			             _("Couldn't encrypt the secret"));
+
+		} else {
+			/* Once it's large, like secret_item_set_secret(), the rest goes in a memfd */
+			if (closure->use_fd && closure->n_read >= SECRET_SESSION_FD_THRESHOLD) {
+				if (_secret_session_encoder_use_fd (closure->encoder))
+					closure->fds = g_unix_fd_list_new ();
+				closure->use_fd = FALSE;
+			}
+			stream_read_next (res);
+		}
+
+	/* The end of the stream, send it all */
+	} else if (count == 0) {
+		if (closure->fds)
+			encoded = _secret_session_encoder_finish_fd (closure->encoder, closure->fds);
+		else
+			encoded = _secret_session_encoder_finish (closure->encoder);
+
+		if (encoded == NULL)
+			g_set_error (&error, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+			             _("Couldn't encrypt the secret"));
+		else if (closure->fds)
+			g_dbus_proxy_call_with_unix_fd_list (G_DBUS_PROXY (self),
+			                                     SECRET_FD_TRANSFER_INTERFACE ".SetSecret",
+			                                     g_variant_new ("(@(oayhs))", encoded),
+			                                     G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+			                                     closure->fds, closure->cancellable,
+			                                     on_stream_set_secret, g_object_ref (res));
+		else
+			g_dbus_proxy_call (G_DBUS_PROXY (self), "SetSecret",
+			                   g_variant_new ("(@(oayays))", encoded),
+			                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, closure->cancellable,
+			                   on_stream_set_secret, g_object_ref (res));
+	}
+
+	if (error != NULL) {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	}
+
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
+static void
+stream_read_next (GSimpleAsyncResult *res)
+{
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	gpointer buffer;
+	gsize length;
+
+	buffer = _secret_session_encoder_buffer (closure->encoder, &length);
+	g_input_stream_read_async (closure->stream, buffer, length, G_PRIORITY_DEFAULT,
+	                           closure->cancellable, on_stream_read, g_object_ref (res));
+}
+
+static void
+on_stream_negotiate_fd (GObject *source,
+                        GAsyncResult *result,
+                        gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	SecretSession *session;
+
+	session = _secret_service_get_session (self->pv->service);
+	closure->encoder = _secret_session_encoder_new (session, closure->content_type);
+
+	if (closure->encoder == NULL) {
+		g_simple_async_result_set_error (res, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+		                                 _("Couldn't encrypt the secret"));
+		g_simple_async_result_complete (res);
+
+	} else {
+		/* The size isn't known up front, so switch to a memfd when it gets large */
+		closure->use_fd = _secret_session_negotiate_fd_finish (result);
+		stream_read_next (res);
+	}
+
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
+static void
+on_stream_ensure_session (GObject *source,
+                          GAsyncResult *result,
+                          gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretItem *self = SECRET_ITEM (g_async_result_get_source_object (user_data));
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GError *error = NULL;
+
+	secret_service_ensure_session_finish (self->pv->service, result, &error);
+	if (error != NULL) {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	} else {
+		_secret_session_negotiate_fd (self->pv->service, closure->cancellable,
+		                              on_stream_negotiate_fd, g_object_ref (res));
+	}
+
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
+/**
+ * secret_item_set_secret_from_stream:
+ * @self: an item
+ * @stream: stream to read the new secret from
+ * @content_type: the content type of the secret, such as
+ *                <literal>application/octet-stream</literal>
+ * @cancellable: optional cancellation object
+ * @callback: called when the operation completes
+ * @user_data: data to pass to the callback
+ *
+ * Set the secret value of this item to the contents of @stream, which is
+ * read until its end, but not closed.
+ *
+ * This is meant for large secrets, such as certificate bundles. The secret
+ * is encrypted as it is read, a chunk at a time, so that it is never held
+ * in memory in full. Unlike secret_item_set_secret() the new secret is not
+ * cached by the item.
+ *
+ * If the service supports it, a large secret is written to a sealed memfd
+ * once it has been read past the same size as in secret_item_set_secret(),
+ * and the memfd is passed to the service instead of the message carrying it.
+ *
+ * This function returns immediately and completes asynchronously.
+ */
+void
+secret_item_set_secret_from_stream (SecretItem *self,
+                                    GInputStream *stream,
+                                    const gchar *content_type,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data)
+{
+	GSimpleAsyncResult *res;
+	StreamClosure *closure;
+
+	g_return_if_fail (SECRET_IS_ITEM (self));
+	g_return_if_fail (G_IS_INPUT_STREAM (stream));
+	g_return_if_fail (content_type != NULL);
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	res = g_simple_async_result_new (G_OBJECT (self), callback, user_data,
+	                                 secret_item_set_secret_from_stream);
+	closure = g_slice_new0 (StreamClosure);
+	closure->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+	closure->stream = g_object_ref (stream);
+	closure->content_type = g_strdup (content_type);
+	g_simple_async_result_set_op_res_gpointer (res, closure, stream_closure_free);
+
+	secret_service_ensure_session (self->pv->service, cancellable,
+	                               on_stream_ensure_session,
+	                               g_object_ref (res));
+
+	g_object_unref (res);
+}
+
+/**
+ * secret_item_set_secret_from_stream_finish:
+ * @self: an item
+ * @result: asynchronous result passed to callback
+ * @error: location to place error on failure
+ *
+ * Complete asynchronous operation to set the secret value of this item
+ * from a stream.
+ *
+ * Returns: whether the change was successful or not
+ */
+gboolean
+secret_item_set_secret_from_stream_finish (SecretItem *self,
+                                           GAsyncResult *result,
+                                           GError **error)
+{
+	GSimpleAsyncResult *res;
+
+	g_return_val_if_fail (g_simple_async_result_is_valid (result, G_OBJECT (self),
+	                      secret_item_set_secret_from_stream), FALSE);
+
+	res = G_SIMPLE_ASYNC_RESULT (result);
+	if (_secret_util_propagate_error (res, error))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * secret_item_set_secret_from_stream_sync:
+ * @self: an item
+ * @stream: stream to read the new secret from
+ * @content_type: the content type of the secret
+ * @cancellable: optional cancellation object
+ * @error: location to place error on failure
+ *
+ * Set the secret value of this item to the contents of @stream, which is
+ * read until its end, but not closed. See
+ * secret_item_set_secret_from_stream() for details.
+ *
+ * This function may block indefinetely. Use the asynchronous version
+ * in user interface threads.
+ *
+ * Returns: whether the change was successful or not
+ */
+gboolean
+secret_item_set_secret_from_stream_sync (SecretItem *self,
+                                         GInputStream *stream,
+                                         const gchar *content_type,
+                                         GCancellable *cancellable,
+                                         GError **error)
+{
+	SecretSync *sync;
+	gboolean ret;
+
+	g_return_val_if_fail (SECRET_IS_ITEM (self), FALSE);
+	g_return_val_if_fail (G_IS_INPUT_STREAM (stream), FALSE);
+	g_return_val_if_fail (content_type != NULL, FALSE);
+	g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	sync = _secret_sync_new ();
+	g_main_context_push_thread_default (sync->context);
+
+	secret_item_set_secret_from_stream (self, stream, content_type, cancellable,
+	                                    _secret_sync_on_result, sync);
+
+	g_main_loop_run (sync->loop);
+
+	ret = secret_item_set_secret_from_stream_finish (self, sync->result, error);
+
+	g_main_context_pop_thread_default (sync->context);
+	_secret_sync_free (sync);
+
+	return ret;
+}
+
 /**
  * secret_item_get_schema_name:
  * @self: an item
@@ -147,6 +147,23 @@ gboolean            secret_item_set_secret_sync            (SecretItem *self,
                                                             GCancellable *cancellable,
                                                             GError **error);
 
+void                secret_item_set_secret_from_stream     (SecretItem *self,
+                                                            GInputStream *stream,
+                                                            const gchar *content_type,
+                                                            GCancellable *cancellable,
+                                                            GAsyncReadyCallback callback,
+                                                            gpointer user_data);
+
+gboolean            secret_item_set_secret_from_stream_finish (SecretItem *self,
+                                                               GAsyncResult *result,
+                                                               GError **error);
+
+gboolean            secret_item_set_secret_from_stream_sync (SecretItem *self,
+                                                             GInputStream *stream,
+                                                             const gchar *content_type,
+                                                             GCancellable *cancellable,
+                                                             GError **error);
+
 gchar *             secret_item_get_schema_name            (SecretItem *self);
 
 GHashTable*         secret_item_get_attributes             (SecretItem *self);
@@ -0,0 +1,391 @@
+/* libsecret - GLib wrapper for Secret Service
+ *
+ * Copyright 2013 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#include "config.h"
+
+#include "secret-attributes.h"
+#include "secret-lookup.h"
+#include "secret-private.h"
+#include "secret-service.h"
+#include "secret-value.h"
+
+#include <string.h>
+
+/**
+ * SECTION:secret-lookup
+ * @title: SecretLookup
+ * @short_description: a prepared password lookup
+ *
+ * A #SecretLookup holds the attributes for a password lookup, validated
+ * against their schema when the lookup is created. It can then be run any
+ * number of times with secret_lookup_password() or
+ * secret_lookup_password_sync(), without the attributes being built,
+ * validated or serialized again.
+ *
+ * Lookups with the same attributes are equal according to
+ * secret_lookup_equal(), and secret_lookup_hash() returns the same value
+ * for them, regardless of the order the attributes were specified in. This
+ * makes a #SecretLookup usable as a key in a #GHashTable of cached results.
+ *
+ * #SecretLookup is reference counted and immutable.
+ *
+ * These functions have an unstable API and may change across versions. Use
+ * <literal>libsecret-unstable</literal> package to access them.
+ *
+ * Stability: Unstable
+ */
+
+/**
+ * SecretLookup:
+ *
+ * A prepared lookup of a password.
+ */
+
+struct _SecretLookup {
+	gint refs;
+	GVariant *attributes;
+	guint hash;
+};
+
+GType
+secret_lookup_get_type (void)
+{
+	static gsize initialized = 0;
+	static GType type = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		type = g_boxed_type_register_static ("SecretLookup",
+		                                     (GBoxedCopyFunc)secret_lookup_ref,
+		                                     (GBoxedFreeFunc)secret_lookup_unref);
+		g_once_init_leave (&initialized, 1);
+	}
+
+	return type;
+}
+
+/* Sorted by name, so that the same attributes always serialize the same */
+static GVariant *
+attributes_to_sorted_variant (GHashTable *attributes,
+                              const gchar *schema_name)
+{
+	GVariantBuilder builder;
+	const gchar *value;
+	GList *names, *l;
+
+	names = g_hash_table_get_keys (attributes);
+	if (schema_name && !g_hash_table_contains (attributes, "xdg:schema"))
+		names = g_list_prepend (names, "xdg:schema");
+	names = g_list_sort (names, (GCompareFunc)strcmp);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
+
+	for (l = names; l != NULL; l = g_list_next (l)) {
+		if (schema_name && g_str_equal (l->data, "xdg:schema"))
+			value = schema_name;
+		else
+			value = g_hash_table_lookup (attributes, l->data);
+		g_variant_builder_add (&builder, "{ss}", l->data, value);
+	}
+
+	g_list_free (names);
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/* Of the serialized form, which doesn't change between runs */
+static guint
+attributes_hash (GVariant *attributes)
+{
+	const guchar *data;
+	guint hash = 5381;
+	gsize length;
+	gsize i;
+
+	data = g_variant_get_data (attributes);
+	length = g_variant_get_size (attributes);
+
+	for (i = 0; i < length; i++)
+		hash = (hash << 5) + hash + data[i];
+
+	return hash;
+}
+
+/**
+ * secret_lookup_new: (skip)
+ * @schema: the schema for the attributes
+ * @...: the attribute keys and values, terminated with %NULL
+ *
+ * Prepare a lookup of a password in the secret service.
+ *
+ * The variable argument list should contain pairs of a) The attribute name as
+ * a null-terminated string, followed by b) attribute value, either a character
+ * string, an int number, or a gboolean value, as defined in the password
+ * @schema. The list of attribtues should be terminated with a %NULL.
+ *
+ * Returns: (transfer full): the new lookup, which should be released with
+ *          secret_lookup_unref(), or %NULL if the attributes are invalid
+ */
+SecretLookup *
+secret_lookup_new (const SecretSchema *schema,
+                   ...)
+{
+	GHashTable *attributes;
+	SecretLookup *lookup;
+	va_list va;
+
+	g_return_val_if_fail (schema != NULL, NULL);
+
+	va_start (va, schema);
+	attributes = secret_attributes_buildv (schema, va);
+	va_end (va);
+
+	/* Precondition failed, already warned */
+	if (!attributes)
+		return NULL;
+
+	lookup = secret_lookup_newv (schema, attributes);
+
+	g_hash_table_unref (attributes);
+	return lookup;
+}
+
+/**
+ * secret_lookup_newv:
+ * @schema: the schema for attributes
+ * @attributes: (element-type utf8 utf8): the attribute keys and values
+ *
+ * Prepare a lookup of a password in the secret service.
+ *
+ * The @attributes should be a set of key and value string pairs. They are
+ * validated against the @schema now, rather than each time the lookup
+ * is run.
+ *
+ * Rename to: secret_lookup_new
+ *
+ * Returns: (transfer full): the new lookup, which should be released with
+ *          secret_lookup_unref(), or %NULL if the attributes are invalid
+ */
+SecretLookup *
+secret_lookup_newv (const SecretSchema *schema,
+                    GHashTable *attributes)
+{
+	const gchar *schema_name = NULL;
+	SecretLookup *lookup;
+
+	g_return_val_if_fail (schema != NULL, NULL);
+	g_return_val_if_fail (attributes != NULL, NULL);
+
+	/* Warnings raised already */
+	if (!_secret_attributes_validate (schema, attributes, G_STRFUNC, TRUE))
+		return NULL;
+
+	if (!(schema->flags & SECRET_SCHEMA_DONT_MATCH_NAME))
+		schema_name = schema->name;
+
+	lookup = g_slice_new0 (SecretLookup);
+	lookup->refs = 1;
+	lookup->attributes = attributes_to_sorted_variant (attributes, schema_name);
+	lookup->hash = attributes_hash (lookup->attributes);
+
+	return lookup;
+}
+
+/**
+ * secret_lookup_get_attributes:
+ * @lookup: the lookup
+ *
+ * Get the attributes that the lookup searches for, sorted by name. This
+ * includes the schema name, unless the schema has the
+ * %SECRET_SCHEMA_DONT_MATCH_NAME flag.
+ *
+ * Returns: (transfer none): the attributes, an a{ss} variant
+ */
+GVariant *
+secret_lookup_get_attributes (SecretLookup *lookup)
+{
+	g_return_val_if_fail (lookup != NULL, NULL);
+	return lookup->attributes;
+}
+
+/**
+ * secret_lookup_hash:
+ * @lookup: (type SecretUnstable.Lookup): the lookup
+ *
+ * Get a hash value for the lookup, suitable for use with #GHashTable.
+ * Lookups that are equal according to secret_lookup_equal() have the same
+ * hash value, which also doesn't change between runs of the program.
+ *
+ * Returns: the hash value
+ */
+guint
+secret_lookup_hash (gconstpointer lookup)
+{
+	g_return_val_if_fail (lookup != NULL, 0);
+	return ((const SecretLookup *)lookup)->hash;
+}
+
+/**
+ * secret_lookup_equal:
+ * @lookup1: (type SecretUnstable.Lookup): a lookup
+ * @lookup2: (type SecretUnstable.Lookup): another lookup
+ *
+ * Check whether two lookups search for the same attributes, suitable for
+ * use with #GHashTable.
+ *
+ * Returns: whether the lookups are equal
+ */
+gboolean
+secret_lookup_equal (gconstpointer lookup1,
+                     gconstpointer lookup2)
+{
+	const SecretLookup *one = lookup1;
+	const SecretLookup *two = lookup2;
+
+	g_return_val_if_fail (lookup1 != NULL, FALSE);
+	g_return_val_if_fail (lookup2 != NULL, FALSE);
+
+	if (one == two)
+		return TRUE;
+	if (one->hash != two->hash)
+		return FALSE;
+	return g_variant_equal (one->attributes, two->attributes);
+}
+
+/**
+ * secret_lookup_password:
+ * @lookup: the lookup
+ * @cancellable: optional cancellation object
+ * @callback: called when the operation completes
+ * @user_data: data to be passed to the callback
+ *
+ * Run the prepared lookup of a password in the secret service.
+ *
+ * This method will return immediately and complete asynchronously.
+ */
+void
+secret_lookup_password (SecretLookup *lookup,
+                        GCancellable *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer user_data)
+{
+	g_return_if_fail (lookup != NULL);
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	_secret_service_lookup_variant (NULL, lookup->attributes, cancellable,
+	                                callback, user_data);
+}
+
+/**
+ * secret_lookup_password_finish:
+ * @result: the asynchronous result passed to the callback
+ * @error: location to place an error on failure
+ *
+ * Finish an asynchronous operation to run a prepared lookup.
+ *
+ * If no secret is found then %NULL is returned.
+ *
+ * Returns: (transfer full): a new password string which should be freed with
+ *          secret_password_free() or may be freed with g_free() when done
+ */
+gchar *
+secret_lookup_password_finish (GAsyncResult *result,
+                               GError **error)
+{
+	SecretValue *value;
+
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	value = secret_service_lookup_finish (NULL, result, error);
+	if (value == NULL)
+		return NULL;
+
+	return _secret_value_unref_to_string (value);
+}
+
+/**
+ * secret_lookup_password_sync:
+ * @lookup: the lookup
+ * @cancellable: optional cancellation object
+ * @error: location to place an error on failure
+ *
+ * Run the prepared lookup of a password in the secret service.
+ *
+ * If no secret is found then %NULL is returned.
+ *
+ * This method may block indefinitely and should not be used in user interface
+ * threads.
+ *
+ * Returns: (transfer full): a new password string which should be freed with
+ *          secret_password_free() or may be freed with g_free() when done
+ */
+gchar *
+secret_lookup_password_sync (SecretLookup *lookup,
+                             GCancellable *cancellable,
+                             GError **error)
+{
+	SecretSync *sync;
+	gchar *string;
+
+	g_return_val_if_fail (lookup != NULL, NULL);
+	g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	sync = _secret_sync_new ();
+	g_main_context_push_thread_default (sync->context);
+
+	secret_lookup_password (lookup, cancellable, _secret_sync_on_result, sync);
+
+	g_main_loop_run (sync->loop);
+
+	string = secret_lookup_password_finish (sync->result, error);
+
+	g_main_context_pop_thread_default (sync->context);
+	_secret_sync_free (sync);
+
+	return string;
+}
+
+/**
+ * secret_lookup_ref:
+ * @lookup: the lookup
+ *
+ * Add another reference to the #SecretLookup.
+ *
+ * Returns: (transfer full): the lookup
+ */
+SecretLookup *
+secret_lookup_ref (SecretLookup *lookup)
+{
+	g_return_val_if_fail (lookup != NULL, NULL);
+	g_atomic_int_inc (&lookup->refs);
+	return lookup;
+}
+
+/**
+ * secret_lookup_unref:
+ * @lookup: (type SecretUnstable.Lookup) (allow-none): the lookup
+ *
+ * Release a reference to the #SecretLookup. When the last reference is
+ * released, the lookup is freed.
+ */
+void
+secret_lookup_unref (gpointer lookup)
+{
+	SecretLookup *self = lookup;
+
+	if (self == NULL)
+		return;
+
+	if (g_atomic_int_dec_and_test (&self->refs)) {
+		g_variant_unref (self->attributes);
+		g_slice_free (SecretLookup, self);
+	}
+}
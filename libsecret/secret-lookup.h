@@ -0,0 +1,64 @@
+/* libsecret - GLib wrapper for Secret Service
+ *
+ * Copyright 2013 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#if !defined (__SECRET_INSIDE_HEADER__) && !defined (SECRET_COMPILATION)
+#error "Only <libsecret/secret.h> can be included directly."
+#endif
+
+#ifndef __SECRET_LOOKUP_H__
+#define __SECRET_LOOKUP_H__
+
+#include <gio/gio.h>
+
+#include "secret-schema.h"
+#include "secret-types.h"
+
+G_BEGIN_DECLS
+
+typedef struct _SecretLookup  SecretLookup;
+
+#define             SECRET_TYPE_LOOKUP             (secret_lookup_get_type ())
+
+GType               secret_lookup_get_type         (void) G_GNUC_CONST;
+
+SecretLookup *      secret_lookup_new              (const SecretSchema *schema,
+                                                    ...) G_GNUC_NULL_TERMINATED;
+
+SecretLookup *      secret_lookup_newv             (const SecretSchema *schema,
+                                                    GHashTable *attributes);
+
+GVariant *          secret_lookup_get_attributes   (SecretLookup *lookup);
+
+guint               secret_lookup_hash             (gconstpointer lookup);
+
+gboolean            secret_lookup_equal            (gconstpointer lookup1,
+                                                    gconstpointer lookup2);
+
+void                secret_lookup_password         (SecretLookup *lookup,
+                                                    GCancellable *cancellable,
+                                                    GAsyncReadyCallback callback,
+                                                    gpointer user_data);
+
+gchar *             secret_lookup_password_finish  (GAsyncResult *result,
+                                                    GError **error);
+
+gchar *             secret_lookup_password_sync    (SecretLookup *lookup,
+                                                    GCancellable *cancellable,
+                                                    GError **error);
+
+SecretLookup *      secret_lookup_ref              (SecretLookup *lookup);
+
+void                secret_lookup_unref            (gpointer lookup);
+
+G_END_DECLS
+
+#endif /* __SECRET_LOOKUP_H___ */
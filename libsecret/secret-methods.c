@@ -546,22 +546,46 @@ _secret_service_decode_get_secrets_all (SecretService *self,
                                         GVariant *out)
 {
 	SecretSession *session;
-	GVariantIter *iter;
-	GVariant *variant;
+	GVariant *array;
+	GVariant **encoded;
+	SecretValue **decoded;
 	GHashTable *values;
-	SecretValue *value;
-	gchar *path;
+	gchar **paths;
+	guint count, i;
 
 	session = _secret_service_get_session (self);
 	values = g_hash_table_new_full (g_str_hash, g_str_equal,
 	                                g_free, secret_value_unref);
-	g_variant_get (out, "(a{o(oayays)})", &iter);
-	while (g_variant_iter_loop (iter, "{o@(oayays)}", &path, &variant)) {
-		value = _secret_session_decode_secret (session, variant);
-		if (value && path)
-			g_hash_table_insert (values, g_strdup (path), value);
+
+	/* Pull the encoded secrets out of a{o(oayays)}, and decode them in one batch */
+	array = g_variant_get_child_value (out, 0);
+	count = g_variant_n_children (array);
+	paths = g_new0 (gchar *, count);
+	encoded = g_new0 (GVariant *, count);
+	decoded = g_new0 (SecretValue *, count);
+
+	for (i = 0; i < count; i++)
+		g_variant_get_child (array, i, "{o@(oayays)}", paths + i, encoded + i);
+
+	_secret_session_decode_secrets (session, encoded, decoded, count);
+
+	/* Inserted in order, so later duplicates win just like before */
+	for (i = 0; i < count; i++) {
+		if (decoded[i] && paths[i]) {
+			g_hash_table_insert (values, paths[i], decoded[i]);
+		} else {
+			if (decoded[i])
+				secret_value_unref (decoded[i]);
+			g_free (paths[i]);
+		}
+		g_variant_unref (encoded[i]);
 	}
-	g_variant_iter_free (iter);
+
+	g_free (paths);
+	g_free (encoded);
+	g_free (decoded);
+	g_variant_unref (array);
+
 	return values;
 }
 
@@ -1444,8 +1468,6 @@ secret_service_lookup (SecretService *service,
                        gpointer user_data)
 {
 	const gchar *schema_name = NULL;
-	GSimpleAsyncResult *res;
-	LookupClosure *closure;
 
 	g_return_if_fail (service == NULL || SECRET_IS_SERVICE (service));
 	g_return_if_fail (attributes != NULL);
@@ -1458,12 +1480,33 @@ secret_service_lookup (SecretService *service,
 	if (schema != NULL && !(schema->flags & SECRET_SCHEMA_DONT_MATCH_NAME))
 		schema_name = schema->name;
 
+	_secret_service_lookup_variant (service, _secret_attributes_to_variant (attributes, schema_name),
+	                                cancellable, callback, user_data);
+}
+
+/*
+ * Completes with secret_service_lookup_finish(). The @attributes are the
+ * already validated a{ss} to search for, which are sunk if floating.
+ */
+void
+_secret_service_lookup_variant (SecretService *service,
+                                GVariant *attributes,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+	GSimpleAsyncResult *res;
+	LookupClosure *closure;
+
+	g_return_if_fail (service == NULL || SECRET_IS_SERVICE (service));
+	g_return_if_fail (attributes != NULL);
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
 	res = g_simple_async_result_new (G_OBJECT (service), callback, user_data,
 	                                 secret_service_lookup);
 	closure = g_slice_new0 (LookupClosure);
 	closure->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-	closure->attributes = _secret_attributes_to_variant (attributes, schema_name);
-	g_variant_ref_sink (closure->attributes);
+	closure->attributes = g_variant_ref_sink (attributes);
 	g_simple_async_result_set_op_res_gpointer (res, closure, lookup_closure_free);
 
 	if (service == NULL) {
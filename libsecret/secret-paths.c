@@ -22,6 +22,7 @@
 #include "secret-types.h"
 #include "secret-value.h"
 
+#include <glib/gi18n-lib.h>
 
 /**
  * SECTION:secret-paths
@@ -850,6 +851,362 @@ secret_service_get_secret_for_dbus_path_sync (SecretService *self,
 	return value;
 }
 
+typedef struct {
+	GCancellable *cancellable;
+	GOutputStream *stream;
+	gchar *item_path;
+	GVariant *in;
+	SecretSessionDecoder *decoder;
+	gconstpointer chunk;
+	gsize n_chunk;
+	gsize written;
+} StreamClosure;
+
+static void
+stream_closure_free (gpointer data)
+{
+	StreamClosure *closure = data;
+	g_clear_object (&closure->cancellable);
+	g_object_unref (closure->stream);
+	g_free (closure->item_path);
+	g_variant_unref (closure->in);
+	_secret_session_decoder_free (closure->decoder);
+	g_slice_free (StreamClosure, closure);
+}
+
+static void
+stream_write_next (GSimpleAsyncResult *res);
+
+static void
+on_stream_write (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GError *error = NULL;
+	gssize count;
+
+	count = g_output_stream_write_finish (closure->stream, result, &error);
+	if (error == NULL) {
+		closure->written += count;
+		stream_write_next (res);
+	} else {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	}
+
+	g_object_unref (res);
+}
+
+static void
+stream_write_next (GSimpleAsyncResult *res)
+{
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	gssize count;
+
+	/* Decode another chunk when the last has been written out */
+	if (closure->written == closure->n_chunk) {
+		count = _secret_session_decoder_next (closure->decoder, &closure->chunk);
+		if (count < 0) {
+			g_simple_async_result_set_error (res, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+			                                 _("Received invalid secret from the secret storage"));
+			g_simple_async_result_complete (res);
+			return;
+		} else if (count == 0) {
+			g_simple_async_result_complete (res);
+			return;
+		}
+
+		closure->n_chunk = count;
+		closure->written = 0;
+	}
+
+	g_output_stream_write_async (closure->stream,
+	                             (const guchar *)closure->chunk + closure->written,
+	                             closure->n_chunk - closure->written,
+	                             G_PRIORITY_DEFAULT, closure->cancellable,
+	                             on_stream_write, g_object_ref (res));
+}
+
+static void
+on_stream_get_secrets (GObject *source,
+                       GAsyncResult *result,
+                       gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	SecretService *self = SECRET_SERVICE (source);
+	GVariant *encoded = NULL;
+	GError *error = NULL;
+	GVariantIter *iter;
+	GVariant *out;
+	const gchar *path;
+
+	out = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), result, &error);
+	_secret_util_strip_remote_error (&error);
+
+	if (error == NULL) {
+		g_variant_get (out, "(a{o(oayays)})", &iter);
+		if (!g_variant_iter_next (iter, "{&o@(oayays)}", &path, &encoded))
+			encoded = NULL;
+		g_variant_iter_free (iter);
+
+		/* Locked items are left out of the reply */
+		if (encoded == NULL) {
+			g_set_error (&error, SECRET_ERROR, SECRET_ERROR_IS_LOCKED,
+			             _("Cannot get secret of a locked object"));
+		} else {
+			closure->decoder = _secret_session_decoder_new (_secret_service_get_session (self),
+			                                                encoded);
+			if (closure->decoder == NULL)
+				g_set_error (&error, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+				             _("Received invalid secret from the secret storage"));
+			g_variant_unref (encoded);
+		}
+
+		g_variant_unref (out);
+	}
+
+	if (error == NULL) {
+		stream_write_next (res);
+	} else {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	}
+
+	g_object_unref (res);
+}
+
+static void
+on_stream_get_secret_fd (GObject *source,
+                         GAsyncResult *result,
+                         gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	SecretService *self = SECRET_SERVICE (g_async_result_get_source_object (user_data));
+	GUnixFDList *fds = NULL;
+	GVariant *encoded;
+	GError *error = NULL;
+	GVariant *retval;
+
+	retval = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source),
+	                                                          &fds, result, &error);
+	_secret_util_strip_remote_error (&error);
+
+	if (error == NULL) {
+		encoded = g_variant_get_child_value (retval, 0);
+		if (fds != NULL)
+			closure->decoder = _secret_session_decoder_new_fd (_secret_service_get_session (self),
+			                                                   encoded, fds);
+		if (closure->decoder == NULL)
+			g_set_error (&error, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+			             _("Received invalid secret from the secret storage"));
+		g_variant_unref (encoded);
+		g_variant_unref (retval);
+	}
+
+	if (error == NULL) {
+		stream_write_next (res);
+	} else {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	}
+
+	g_clear_object (&fds);
+	g_object_unref (self);
+	g_object_unref (res);
+}
+
+static void
+on_stream_negotiate_fd (GObject *source,
+                        GAsyncResult *result,
+                        gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	const gchar *session;
+
+	session = secret_service_get_session_dbus_path (SECRET_SERVICE (source));
+
+	/*
+	 * The encrypted secret comes in a memfd, rather than in the reply. Only
+	 * the service knows how large the secret is, so SECRET_SESSION_FD_THRESHOLD
+	 * can't be applied here. This is meant for large secrets anyway, and a
+	 * small one costs a memfd on either side.
+	 */
+	if (_secret_session_negotiate_fd_finish (result)) {
+		g_dbus_connection_call_with_unix_fd_list (g_dbus_proxy_get_connection (G_DBUS_PROXY (source)),
+		                                          g_dbus_proxy_get_name (G_DBUS_PROXY (source)),
+		                                          closure->item_path, SECRET_FD_TRANSFER_INTERFACE,
+		                                          "GetSecret", g_variant_new ("(o)", session),
+		                                          G_VARIANT_TYPE ("((oayhs))"),
+		                                          G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL,
+		                                          closure->cancellable, on_stream_get_secret_fd,
+		                                          g_object_ref (res));
+	} else {
+		g_dbus_proxy_call (G_DBUS_PROXY (source), "GetSecrets",
+		                   g_variant_new ("(@aoo)", closure->in, session),
+		                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+		                   closure->cancellable, on_stream_get_secrets,
+		                   g_object_ref (res));
+	}
+
+	g_object_unref (res);
+}
+
+static void
+on_stream_get_secrets_session (GObject *source,
+                               GAsyncResult *result,
+                               gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	StreamClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GError *error = NULL;
+
+	secret_service_ensure_session_finish (SECRET_SERVICE (source), result, &error);
+	if (error != NULL) {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	} else {
+		_secret_session_negotiate_fd (SECRET_SERVICE (source), closure->cancellable,
+		                              on_stream_negotiate_fd, g_object_ref (res));
+	}
+
+	g_object_unref (res);
+}
+
+/**
+ * secret_service_get_secret_for_dbus_path_to_stream:
+ * @self: the secret service
+ * @item_path: the D-Bus path to item to retrieve secret for
+ * @stream: stream to write the secret to
+ * @cancellable: optional cancellation object
+ * @callback: called when the operation completes
+ * @user_data: data to pass to the callback
+ *
+ * Write the secret value for an secret item stored in the service to
+ * @stream. The stream is not closed afterwards.
+ *
+ * This is meant for large secrets, such as certificate bundles. The secret
+ * is decrypted a chunk at a time as it is written, so that it is never held
+ * in memory in full. If the service supports it, the encrypted secret is
+ * received in a sealed memfd rather than in the reply.
+ *
+ * Fails with %SECRET_ERROR_IS_LOCKED if the item is locked.
+ *
+ * This function returns immediately and completes asynchronously.
+ */
+void
+secret_service_get_secret_for_dbus_path_to_stream (SecretService *self,
+                                                   const gchar *item_path,
+                                                   GOutputStream *stream,
+                                                   GCancellable *cancellable,
+                                                   GAsyncReadyCallback callback,
+                                                   gpointer user_data)
+{
+	GSimpleAsyncResult *res;
+	StreamClosure *closure;
+
+	g_return_if_fail (SECRET_IS_SERVICE (self));
+	g_return_if_fail (item_path != NULL);
+	g_return_if_fail (G_IS_OUTPUT_STREAM (stream));
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	res = g_simple_async_result_new (G_OBJECT (self), callback, user_data,
+	                                 secret_service_get_secret_for_dbus_path_to_stream);
+
+	closure = g_slice_new0 (StreamClosure);
+	closure->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+	closure->stream = g_object_ref (stream);
+	closure->item_path = g_strdup (item_path);
+	closure->in = g_variant_ref_sink (g_variant_new_objv (&item_path, 1));
+	g_simple_async_result_set_op_res_gpointer (res, closure, stream_closure_free);
+
+	secret_service_ensure_session (self, cancellable,
+	                               on_stream_get_secrets_session,
+	                               g_object_ref (res));
+
+	g_object_unref (res);
+}
+
+/**
+ * secret_service_get_secret_for_dbus_path_to_stream_finish:
+ * @self: the secret service
+ * @result: asynchronous result passed to callback
+ * @error: location to place an error on failure
+ *
+ * Complete asynchronous operation to write the secret value for an
+ * secret item stored in the service to a stream.
+ *
+ * Returns: whether the whole secret was written or not
+ */
+gboolean
+secret_service_get_secret_for_dbus_path_to_stream_finish (SecretService *self,
+                                                          GAsyncResult *result,
+                                                          GError **error)
+{
+	g_return_val_if_fail (SECRET_IS_SERVICE (self), FALSE);
+	g_return_val_if_fail (g_simple_async_result_is_valid (result, G_OBJECT (self),
+	                      secret_service_get_secret_for_dbus_path_to_stream), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	if (_secret_util_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error))
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * secret_service_get_secret_for_dbus_path_to_stream_sync:
+ * @self: the secret service
+ * @item_path: the D-Bus path to item to retrieve secret for
+ * @stream: stream to write the secret to
+ * @cancellable: optional cancellation object
+ * @error: location to place an error on failure
+ *
+ * Write the secret value for an secret item stored in the service to
+ * @stream. See secret_service_get_secret_for_dbus_path_to_stream() for
+ * details.
+ *
+ * This method may block indefinitely and should not be used in user interface
+ * threads.
+ *
+ * Returns: whether the whole secret was written or not
+ */
+gboolean
+secret_service_get_secret_for_dbus_path_to_stream_sync (SecretService *self,
+                                                        const gchar *item_path,
+                                                        GOutputStream *stream,
+                                                        GCancellable *cancellable,
+                                                        GError **error)
+{
+	SecretSync *sync;
+	gboolean ret;
+
+	g_return_val_if_fail (SECRET_IS_SERVICE (self), FALSE);
+	g_return_val_if_fail (item_path != NULL, FALSE);
+	g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), FALSE);
+	g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	sync = _secret_sync_new ();
+	g_main_context_push_thread_default (sync->context);
+
+	secret_service_get_secret_for_dbus_path_to_stream (self, item_path, stream, cancellable,
+	                                                   _secret_sync_on_result, sync);
+
+	g_main_loop_run (sync->loop);
+
+	ret = secret_service_get_secret_for_dbus_path_to_stream_finish (self, sync->result, error);
+
+	g_main_context_pop_thread_default (sync->context);
+	_secret_sync_free (sync);
+
+	return ret;
+}
+
 /**
  * secret_service_get_secrets_for_dbus_paths:
  * @self: the secret service
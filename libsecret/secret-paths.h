@@ -119,6 +119,23 @@ SecretValue *       secret_service_get_secret_for_dbus_path_sync       (SecretSe
                                                                         GCancellable *cancellable,
                                                                         GError **error);
 
+void                secret_service_get_secret_for_dbus_path_to_stream  (SecretService *self,
+                                                                        const gchar *item_path,
+                                                                        GOutputStream *stream,
+                                                                        GCancellable *cancellable,
+                                                                        GAsyncReadyCallback callback,
+                                                                        gpointer user_data);
+
+gboolean            secret_service_get_secret_for_dbus_path_to_stream_finish (SecretService *self,
+                                                                              GAsyncResult *result,
+                                                                              GError **error);
+
+gboolean            secret_service_get_secret_for_dbus_path_to_stream_sync (SecretService *self,
+                                                                            const gchar *item_path,
+                                                                            GOutputStream *stream,
+                                                                            GCancellable *cancellable,
+                                                                            GError **error);
+
 void                secret_service_get_secrets_for_dbus_paths          (SecretService *self,
                                                                         const gchar **item_paths,
                                                                         GCancellable *cancellable,
@@ -16,6 +16,7 @@
 #define __SECRET_PRIVATE_H__
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 
 #include "secret-item.h"
 #include "secret-service.h"
@@ -31,8 +32,16 @@ typedef struct {
 
 typedef struct _SecretSession SecretSession;
 
+typedef struct _SecretSessionEncoder SecretSessionEncoder;
+
+typedef struct _SecretSessionDecoder SecretSessionDecoder;
+
 #define              SECRET_ALIAS_PREFIX                      "/org/freedesktop/secrets/aliases/"
 
+#define              SECRET_SESSION_STREAM_CHUNK              4096
+
+#define              SECRET_SESSION_FD_THRESHOLD              (64 * 1024)
+
 #define              SECRET_SERVICE_PATH                      "/org/freedesktop/secrets"
 
 #define              SECRET_SERVICE_BUS_NAME                  "org.freedesktop.secrets"
@@ -41,6 +50,7 @@ typedef struct _SecretSession SecretSession;
 #define              SECRET_COLLECTION_INTERFACE              "org.freedesktop.Secret.Collection"
 #define              SECRET_PROMPT_INTERFACE                  "org.freedesktop.Secret.Prompt"
 #define              SECRET_SERVICE_INTERFACE                 "org.freedesktop.Secret.Service"
+#define              SECRET_FD_TRANSFER_INTERFACE             "org.gnome.libsecret.FdTransfer"
 
 #define              SECRET_SIGNAL_COLLECTION_CREATED "CollectionCreated"
 #define              SECRET_SIGNAL_COLLECTION_CHANGED "CollectionChanged"
@@ -147,6 +157,12 @@ void                 _secret_service_search_for_paths_variant (SecretService *se
                                                                GAsyncReadyCallback callback,
                                                                gpointer user_data);
 
+void                 _secret_service_lookup_variant           (SecretService *service,
+                                                               GVariant *attributes,
+                                                               GCancellable *cancellable,
+                                                               GAsyncReadyCallback callback,
+                                                               gpointer user_data);
+
 SecretItem *         _secret_service_find_item_instance       (SecretService *self,
                                                                const gchar *item_path);
 
@@ -179,6 +195,15 @@ GHashTable *         _secret_collection_properties_new        (const gchar *labe
 SecretItem *         _secret_collection_find_item_instance    (SecretCollection *self,
                                                                const gchar *item_path);
 
+gsize                _secret_value_shared_size                (void);
+
+SecretValue *        _secret_value_new_shared                 (gpointer memory,
+                                                               gchar *secret,
+                                                               gsize length,
+                                                               const gchar *content_type,
+                                                               GDestroyNotify destroy,
+                                                               gpointer destroy_data);
+
 gchar *              _secret_value_unref_to_password          (SecretValue *value);
 
 gchar *              _secret_value_unref_to_string            (SecretValue *value);
@@ -189,6 +214,10 @@ const gchar *        _secret_session_get_algorithms           (SecretSession *se
 
 const gchar *        _secret_session_get_path                 (SecretSession *session);
 
+void                 _secret_session_prewarm                  (void);
+
+void                 _secret_session_prepare                  (void);
+
 void                 _secret_session_open                     (SecretService *service,
                                                                GCancellable *cancellable,
                                                                GAsyncReadyCallback callback,
@@ -203,6 +232,59 @@ GVariant *           _secret_session_encode_secret            (SecretSession *se
 SecretValue *        _secret_session_decode_secret            (SecretSession *session,
                                                                GVariant *encoded);
 
+void                 _secret_session_decode_secrets           (SecretSession *session,
+                                                               GVariant **encoded,
+                                                               SecretValue **values,
+                                                               guint count);
+
+void                 _secret_session_negotiate_fd             (SecretService *service,
+                                                               GCancellable *cancellable,
+                                                               GAsyncReadyCallback callback,
+                                                               gpointer user_data);
+
+gboolean             _secret_session_negotiate_fd_finish      (GAsyncResult *result);
+
+GVariant *           _secret_session_encode_secret_fd         (SecretSession *session,
+                                                               SecretValue *value,
+                                                               GUnixFDList *fds);
+
+SecretSessionEncoder * _secret_session_encoder_new             (SecretSession *session,
+                                                               const gchar *content_type);
+
+gpointer             _secret_session_encoder_buffer           (SecretSessionEncoder *encoder,
+                                                               gsize *length);
+
+gboolean             _secret_session_encoder_update           (SecretSessionEncoder *encoder,
+                                                               gsize length);
+
+GVariant *           _secret_session_encoder_finish           (SecretSessionEncoder *encoder);
+
+GVariant *           _secret_session_encoder_finish_fd        (SecretSessionEncoder *encoder,
+                                                               GUnixFDList *fds);
+
+gboolean             _secret_session_encoder_use_fd           (SecretSessionEncoder *encoder);
+
+void                 _secret_session_encoder_free             (SecretSessionEncoder *encoder);
+
+SecretSessionDecoder * _secret_session_decoder_new             (SecretSession *session,
+                                                               GVariant *encoded);
+
+SecretSessionDecoder * _secret_session_decoder_new_fd          (SecretSession *session,
+                                                               GVariant *encoded,
+                                                               GUnixFDList *fds);
+
+const gchar *        _secret_session_decoder_get_content_type (SecretSessionDecoder *decoder);
+
+gssize               _secret_session_decoder_next             (SecretSessionDecoder *decoder,
+                                                               gconstpointer *chunk);
+
+void                 _secret_session_decoder_free             (SecretSessionDecoder *decoder);
+
+void                 _secret_session_set_decode_threads       (guint n_threads,
+                                                               guint threshold);
+
+void                 _secret_session_set_fd_transfer          (gboolean enabled);
+
 void                 _secret_item_set_cached_secret           (SecretItem *self,
                                                                SecretValue *value);
 
@@ -210,6 +292,12 @@ const SecretSchema * _secret_schema_ref_if_nonstatic          (const SecretSchem
 
 void                 _secret_schema_unref_if_nonstatic        (const SecretSchema *schema);
 
+GHashTable *         _secret_schema_get_index                 (const SecretSchema *schema);
+
+const SecretSchemaAttribute * _secret_schema_find_attribute  (const SecretSchema *schema,
+                                                              GHashTable *index,
+                                                              const gchar *attribute_name);
+
 G_END_DECLS
 
 #endif /* __SECRET_PRIVATE_H___ */
@@ -147,6 +147,80 @@ schema_attribute_free (SecretSchemaAttribute *attribute)
 G_DEFINE_BOXED_TYPE (SecretSchemaAttribute, secret_schema_attribute,
                      schema_attribute_copy, schema_attribute_free);
 
+/*
+ * Attribute names are looked up in a hash table built the first time it's
+ * needed. Only schemas from secret_schema_new() have one, kept in a reserved
+ * field. Static schemas are usually const, and can't be written to, so their
+ * attributes are scanned instead.
+ */
+
+static GHashTable *
+schema_index_new (const SecretSchema *schema)
+{
+	GHashTable *index;
+	gint i;
+
+	index = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* Same as a linear scan: stop at the first gap, and the first of a name wins */
+	for (i = 0; i < G_N_ELEMENTS (schema->attributes); i++) {
+		if (schema->attributes[i].name == NULL)
+			break;
+		if (!g_hash_table_contains (index, schema->attributes[i].name))
+			g_hash_table_insert (index, (gpointer)schema->attributes[i].name,
+			                     (gpointer)&schema->attributes[i]);
+	}
+
+	return index;
+}
+
+GHashTable *
+_secret_schema_get_index (const SecretSchema *schema)
+{
+	GHashTable *index;
+
+	g_return_val_if_fail (schema != NULL, NULL);
+
+	if (g_atomic_int_get (&schema->reserved) <= 0)
+		return NULL;
+
+	index = g_atomic_pointer_get (&schema->reserved1);
+	if (index == NULL) {
+		index = schema_index_new (schema);
+
+		/* Another thread might have got there first */
+		if (!g_atomic_pointer_compare_and_exchange ((gpointer *)&schema->reserved1, NULL, index)) {
+			g_hash_table_unref (index);
+			index = g_atomic_pointer_get (&schema->reserved1);
+		}
+	}
+
+	return index;
+}
+
+const SecretSchemaAttribute *
+_secret_schema_find_attribute (const SecretSchema *schema,
+                               GHashTable *index,
+                               const gchar *attribute_name)
+{
+	gint i;
+
+	g_return_val_if_fail (schema != NULL, NULL);
+	g_return_val_if_fail (attribute_name != NULL, NULL);
+
+	if (index != NULL)
+		return g_hash_table_lookup (index, attribute_name);
+
+	for (i = 0; i < G_N_ELEMENTS (schema->attributes); i++) {
+		if (schema->attributes[i].name == NULL)
+			break;
+		if (g_str_equal (schema->attributes[i].name, attribute_name))
+			return &schema->attributes[i];
+	}
+
+	return NULL;
+}
+
 /**
  * secret_schema_newv:
  * @name: the dotted name of the schema
@@ -366,6 +440,8 @@ secret_schema_unref (SecretSchema *schema)
 		g_warning ("should not unreference a static or invalid SecretSchema");
 
 	} else if (refs == 0) {
+		if (schema->reserved1)
+			g_hash_table_unref (schema->reserved1);
 		g_free ((gpointer)schema->name);
 		for (i = 0; i < G_N_ELEMENTS (schema->attributes); i++)
 			g_free ((gpointer)schema->attributes[i].name);
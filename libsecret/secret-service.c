@@ -772,6 +772,7 @@ secret_service_get (SecretServiceFlags flags,
 
 	/* Create a whole new service */
 	if (service == NULL) {
+		_secret_session_prepare ();
 		g_async_initable_new_async (SECRET_TYPE_SERVICE, G_PRIORITY_DEFAULT,
 		                            cancellable, callback, user_data,
 		                            "g-flags", G_DBUS_PROXY_FLAGS_NONE,
@@ -871,6 +872,7 @@ secret_service_get_sync (SecretServiceFlags flags,
 	service = service_get_instance ();
 
 	if (service == NULL) {
+		_secret_session_prepare ();
 		service = g_initable_new (SECRET_TYPE_SERVICE, cancellable, error,
 		                          "g-flags", G_DBUS_PROXY_FLAGS_NONE,
 		                          "g-interface-info", _secret_gen_service_interface_info (),
@@ -913,6 +915,24 @@ secret_service_disconnect (void)
 	service_uncache_instance (NULL);
 }
 
+/**
+ * secret_service_prewarm:
+ *
+ * Start preparing the keys used to open a session with the Secret Service,
+ * on a background thread.
+ *
+ * It is not necessary to call this function, but an application can call
+ * it early, so that opening a session later does not have to wait for key
+ * generation.
+ *
+ * This function returns immediately and is safe to call at any time.
+ */
+void
+secret_service_prewarm (void)
+{
+	_secret_session_prewarm ();
+}
+
 /**
  * secret_service_new:
  * @service_gtype: the GType of the new secret service
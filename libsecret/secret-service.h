@@ -104,6 +104,8 @@ SecretService *      secret_service_get_sync                      (SecretService
 
 void                 secret_service_disconnect                    (void);
 
+void                 secret_service_prewarm                       (void);
+
 void                 secret_service_new                           (GType service_gtype,
                                                                    const gchar *service_bus_name,
                                                                    SecretServiceFlags flags,
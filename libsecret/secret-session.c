@@ -28,10 +28,34 @@
 
 #include <glib/gi18n-lib.h>
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 EGG_SECURE_DECLARE (secret_session);
 
-#define ALGORITHMS_AES    "dh-ietf1024-sha256-aes128-cbc-pkcs7"
-#define ALGORITHMS_PLAIN  "plain"
+#define ALGORITHMS_X25519_GCM "ecdh-x25519-sha256-aes128-gcm"
+#define ALGORITHMS_X25519     "ecdh-x25519-sha256-aes128-cbc-pkcs7"
+#define ALGORITHMS_AES_GCM    "dh-ietf1024-sha256-aes128-gcm"
+#define ALGORITHMS_AES        "dh-ietf1024-sha256-aes128-cbc-pkcs7"
+#define ALGORITHMS_PLAIN      "plain"
+
+/* Authenticated encryption needs libgcrypt 1.6 */
+#if defined (WITH_GCRYPT) && GCRYPT_VERSION_NUMBER >= 0x010600
+#define WITH_AES_GCM 1
+#endif
+
+#define GCM_IV_SIZE       12
+#define GCM_TAG_SIZE      16
+
+#define DH_GROUP          "ietf-ike-grp-modp-1024"
 
 struct _SecretSession {
 	gchar *path;
@@ -40,9 +64,21 @@ struct _SecretSession {
 	gcry_mpi_t prime;
 	gcry_mpi_t privat;
 	gcry_mpi_t publi;
+	guchar *x25519;
+	gboolean gcm;
+	gcry_cipher_hd_t cih;
+	GMutex mutex;
 #endif
 	gpointer key;
 	gsize n_key;
+	gint fd_transfer;
+};
+
+/* Whether the service can transfer secrets in a memfd, see _secret_session_negotiate_fd() */
+enum {
+	FD_TRANSFER_UNKNOWN = 0,
+	FD_TRANSFER_YES,
+	FD_TRANSFER_NO,
 };
 
 void
@@ -58,6 +94,10 @@ _secret_session_free (gpointer data)
 	gcry_mpi_release (session->publi);
 	gcry_mpi_release (session->privat);
 	gcry_mpi_release (session->prime);
+	egg_secure_free (session->x25519);
+	if (session->cih)
+		gcry_cipher_close (session->cih);
+	g_mutex_clear (&session->mutex);
 #endif
 	egg_secure_free (session->key);
 	g_free (session);
@@ -65,38 +105,212 @@ _secret_session_free (gpointer data)
 
 #ifdef WITH_GCRYPT
 
-static GVariant *
-request_open_session_aes (SecretSession *session)
+static gcry_cipher_hd_t
+session_cipher_new (SecretSession *session)
 {
+	gcry_cipher_hd_t cih;
 	gcry_error_t gcry;
-	gcry_mpi_t base;
-	unsigned char *buffer;
-	size_t n_buffer;
-	GVariant *argument;
 
-	g_assert (session->prime == NULL);
-	g_assert (session->privat == NULL);
-	g_assert (session->publi == NULL);
+	g_assert (session->key != NULL);
 
-	egg_libgcrypt_initialize ();
+	gcry = gcry_cipher_open (&cih, GCRY_CIPHER_AES,
+#ifdef WITH_AES_GCM
+	                         session->gcm ? GCRY_CIPHER_MODE_GCM :
+#endif
+	                         GCRY_CIPHER_MODE_CBC,
+	                         GCRY_CIPHER_SECURE);
+	if (gcry != 0) {
+		g_warning ("couldn't create AES cipher: %s", gcry_strerror (gcry));
+		return NULL;
+	}
+
+	gcry = gcry_cipher_setkey (cih, session->key, session->n_key);
+	if (gcry != 0) {
+		g_warning ("couldn't set AES cipher key: %s", gcry_strerror (gcry));
+		gcry_cipher_close (cih);
+		return NULL;
+	}
+
+	return cih;
+}
+
+static gboolean
+session_setup_key (SecretSession *session,
+                   gpointer ikm,
+                   gsize n_ikm,
+                   const gchar *algorithms)
+{
+	gconstpointer info = NULL;
+	gsize n_info = 0;
+
+	/*
+	 * The GCM algorithms bind the key to the negotiated algorithm name,
+	 * the older CBC ones derive it without any info.
+	 */
+	session->gcm = g_str_has_suffix (algorithms, "-gcm");
+	if (session->gcm) {
+		info = algorithms;
+		n_info = strlen (algorithms);
+	}
+
+	session->n_key = 16;
+	session->key = egg_secure_alloc (session->n_key);
+	if (!egg_hkdf_perform ("sha256", ikm, n_ikm, NULL, 0, info, n_info,
+	                       session->key, session->n_key))
+		g_return_val_if_reached (FALSE);
+	egg_secure_free (ikm);
+
+	/*
+	 * The key schedule is computed once here, and the same cipher is
+	 * then used for every secret transferred, only resetting the IV.
+	 */
+	session->cih = session_cipher_new (session);
+	if (session->cih == NULL)
+		return FALSE;
+
+	session->algorithms = algorithms;
+	return TRUE;
+}
+
+/*
+ * Generating a DH keypair is the expensive part of opening a session, so
+ * a few keypairs can be generated ahead of time on a worker thread.
+ */
+
+#define DH_KEYPAIRS       2
+
+typedef struct {
+	gcry_mpi_t prime;
+	gcry_mpi_t privat;
+	gcry_mpi_t publi;
+} DHKeypair;
+
+static GQueue dh_keypairs = G_QUEUE_INIT;
+static gboolean dh_generating = FALSE;
+G_LOCK_DEFINE_STATIC (dh_keypairs);
+
+static gboolean
+dh_keypair_generate (gcry_mpi_t *prime,
+                     gcry_mpi_t *privat,
+                     gcry_mpi_t *publi)
+{
+	gcry_mpi_t base;
 
 	/* Initialize our local parameters and values */
-	if (!egg_dh_default_params ("ietf-ike-grp-modp-1024",
-	                            &session->prime, &base))
-		g_return_val_if_reached (NULL);
+	if (!egg_dh_default_params (DH_GROUP, prime, &base))
+		g_return_val_if_reached (FALSE);
 
 #if 0
 	g_printerr ("\n lib prime: ");
-	gcry_mpi_dump (session->prime);
+	gcry_mpi_dump (*prime);
 	g_printerr ("\n  lib base: ");
 	gcry_mpi_dump (base);
 	g_printerr ("\n");
 #endif
 
-	if (!egg_dh_gen_pair (session->prime, base, 0,
-	                      &session->publi, &session->privat))
-		g_return_val_if_reached (NULL);
+	/* A short private exponent, sized to the strength of the group */
+	if (!egg_dh_gen_pair (*prime, base,
+	                      egg_dh_default_exponent_bits (DH_GROUP),
+	                      publi, privat)) {
+		gcry_mpi_release (base);
+		gcry_mpi_release (*prime);
+		*prime = NULL;
+		g_return_val_if_reached (FALSE);
+	}
+
 	gcry_mpi_release (base);
+	return TRUE;
+}
+
+static gpointer
+dh_keypairs_fill (gpointer unused)
+{
+	DHKeypair *keypair;
+
+	G_LOCK (dh_keypairs);
+
+	while (dh_keypairs.length < DH_KEYPAIRS) {
+		G_UNLOCK (dh_keypairs);
+
+		keypair = g_slice_new0 (DHKeypair);
+		if (!dh_keypair_generate (&keypair->prime, &keypair->privat, &keypair->publi)) {
+			g_slice_free (DHKeypair, keypair);
+			G_LOCK (dh_keypairs);
+			break;
+		}
+
+		G_LOCK (dh_keypairs);
+		g_queue_push_tail (&dh_keypairs, keypair);
+	}
+
+	dh_generating = FALSE;
+	G_UNLOCK (dh_keypairs);
+
+	return NULL;
+}
+
+static gboolean
+session_take_keypair (SecretSession *session)
+{
+	DHKeypair *keypair;
+
+	G_LOCK (dh_keypairs);
+	keypair = g_queue_pop_head (&dh_keypairs);
+	G_UNLOCK (dh_keypairs);
+
+	if (keypair == NULL)
+		return FALSE;
+
+	session->prime = keypair->prime;
+	session->privat = keypair->privat;
+	session->publi = keypair->publi;
+	g_slice_free (DHKeypair, keypair);
+	return TRUE;
+}
+
+#endif /* WITH_GCRYPT */
+
+void
+_secret_session_prewarm (void)
+{
+#ifdef WITH_GCRYPT
+	gboolean start = FALSE;
+
+	egg_libgcrypt_initialize ();
+
+	G_LOCK (dh_keypairs);
+	if (!dh_generating && dh_keypairs.length < DH_KEYPAIRS)
+		start = dh_generating = TRUE;
+	G_UNLOCK (dh_keypairs);
+
+	if (start)
+		g_thread_unref (g_thread_new ("secret-dh-keypairs", dh_keypairs_fill, NULL));
+#endif
+}
+
+void
+_secret_session_prepare (void)
+{
+	/* Only worth it when a DH session is what will be requested first */
+#if defined (WITH_GCRYPT) && !defined (EGG_DH_WITH_X25519)
+	_secret_session_prewarm ();
+#endif
+}
+
+#ifdef WITH_GCRYPT
+
+static GVariant *
+request_open_session_aes (SecretSession *session,
+                          const gchar *algorithms)
+{
+	gcry_error_t gcry;
+	unsigned char *buffer;
+	size_t n_buffer;
+	GVariant *argument;
+
+	g_assert (session->prime != NULL);
+	g_assert (session->privat != NULL);
+	g_assert (session->publi != NULL);
 
 	gcry = gcry_mpi_aprint (GCRYMPI_FMT_USG, &buffer, &n_buffer, session->publi);
 	g_return_val_if_fail (gcry == 0, NULL);
@@ -104,12 +318,13 @@ request_open_session_aes (SecretSession *session)
 	                                    buffer, n_buffer, TRUE,
 	                                    gcry_free, buffer);
 
-	return g_variant_new ("(sv)", ALGORITHMS_AES, argument);
+	return g_variant_new ("(sv)", algorithms, argument);
 }
 
 static gboolean
 response_open_session_aes (SecretSession *session,
-                           GVariant *response)
+                           GVariant *response,
+                           const gchar *algorithms)
 {
 	gconstpointer buffer;
 	GVariant *argument;
@@ -158,17 +373,78 @@ response_open_session_aes (SecretSession *session,
 		return FALSE;
 	}
 
-	session->n_key = 16;
-	session->key = egg_secure_alloc (session->n_key);
-	if (!egg_hkdf_perform ("sha256", ikm, n_ikm, NULL, 0, NULL, 0,
-	                       session->key, session->n_key))
-		g_return_val_if_reached (FALSE);
-	egg_secure_free (ikm);
+	return session_setup_key (session, ikm, n_ikm, algorithms);
+}
 
-	session->algorithms = ALGORITHMS_AES;
-	return TRUE;
+#ifdef EGG_DH_WITH_X25519
+
+static GVariant *
+request_open_session_x25519 (SecretSession *session,
+                             const gchar *algorithms)
+{
+	guchar *publi;
+	GVariant *argument;
+
+	egg_libgcrypt_initialize ();
+
+	/* A fresh keypair for each algorithm we ask for */
+	egg_secure_free (session->x25519);
+	session->x25519 = egg_secure_alloc (EGG_DH_X25519_SIZE);
+	publi = g_malloc (EGG_DH_X25519_SIZE);
+
+	if (!egg_dh_x25519_gen_pair (publi, session->x25519))
+		g_return_val_if_reached (NULL);
+
+	argument = g_variant_new_from_data (G_VARIANT_TYPE ("ay"),
+	                                    publi, EGG_DH_X25519_SIZE, TRUE,
+	                                    g_free, publi);
+
+	return g_variant_new ("(sv)", algorithms, argument);
+}
+
+static gboolean
+response_open_session_x25519 (SecretSession *session,
+                              GVariant *response,
+                              const gchar *algorithms)
+{
+	gconstpointer buffer;
+	GVariant *argument;
+	const gchar *sig;
+	gsize n_buffer;
+	gpointer ikm;
+	gsize n_ikm;
+
+	sig = g_variant_get_type_string (response);
+	g_return_val_if_fail (sig != NULL, FALSE);
+
+	if (!g_str_equal (sig, "(vo)")) {
+		g_warning ("invalid OpenSession() response from daemon with signature: %s", sig);
+		return FALSE;
+	}
+
+	g_assert (session->path == NULL);
+	g_variant_get (response, "(vo)", &argument, &session->path);
+
+	ikm = NULL;
+	if (g_variant_is_of_type (argument, G_VARIANT_TYPE ("ay"))) {
+		buffer = g_variant_get_fixed_array (argument, &n_buffer, sizeof (guchar));
+		ikm = egg_dh_x25519_gen_secret (buffer, n_buffer, session->x25519, &n_ikm);
+	}
+
+	g_variant_unref (argument);
+
+	if (ikm == NULL) {
+		g_warning ("couldn't negotiate a valid AES session key");
+		g_free (session->path);
+		session->path = NULL;
+		return FALSE;
+	}
+
+	return session_setup_key (session, ikm, n_ikm, algorithms);
 }
 
+#endif /* EGG_DH_WITH_X25519 */
+
 #endif /* WITH_GCRYPT */
 
 static GVariant *
@@ -208,6 +484,8 @@ response_open_session_plain (SecretSession *session,
 typedef struct {
 	GCancellable *cancellable;
 	SecretSession *session;
+	GVariant *response;
+	guint algorithm;
 } OpenSessionClosure;
 
 static void
@@ -216,10 +494,20 @@ open_session_closure_free (gpointer data)
 	OpenSessionClosure *closure = data;
 	g_assert (closure);
 	g_clear_object (&closure->cancellable);
+	if (closure->response)
+		g_variant_unref (closure->response);
 	_secret_session_free (closure->session);
 	g_free (closure);
 }
 
+static void         open_session_next          (SecretService *service,
+                                                GSimpleAsyncResult *res);
+
+static void         open_session_accepted      (SecretService *service,
+                                                GSimpleAsyncResult *res);
+
+static const gchar *open_session_algorithms    (GSimpleAsyncResult *res);
+
 static void
 on_service_open_session_plain (GObject *source,
                                GAsyncResult *result,
@@ -236,6 +524,7 @@ on_service_open_session_plain (GObject *source,
 	/* A successful response, decode it */
 	if (response != NULL) {
 		if (response_open_session_plain (closure->session, response)) {
+			open_session_accepted (service, res);
 			_secret_service_take_session (service, closure->session);
 			closure->session = NULL;
 
@@ -255,8 +544,40 @@ on_service_open_session_plain (GObject *source,
 	g_object_unref (res);
 }
 
+static void
+open_session_plain (SecretService *service,
+                    GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+
+	g_dbus_proxy_call (G_DBUS_PROXY (service), "OpenSession",
+	                   request_open_session_plain (closure->session),
+	                   G_DBUS_CALL_FLAGS_NONE, -1,
+	                   closure->cancellable, on_service_open_session_plain,
+	                   g_object_ref (res));
+}
+
 #ifdef WITH_GCRYPT
 
+static void
+open_session_aes_thread (GSimpleAsyncResult *res,
+                         GObject *source,
+                         GCancellable *cancellable)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+
+	if (response_open_session_aes (closure->session, closure->response,
+	                               open_session_algorithms (res))) {
+		open_session_accepted (SECRET_SERVICE (source), res);
+		_secret_service_take_session (SECRET_SERVICE (source), closure->session);
+		closure->session = NULL;
+
+	} else {
+		g_simple_async_result_set_error (res, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+		                                 _("Couldn't communicate with the secret storage"));
+	}
+}
+
 static void
 on_service_open_session_aes (GObject *source,
                              GAsyncResult *result,
@@ -266,32 +587,19 @@ on_service_open_session_aes (GObject *source,
 	OpenSessionClosure * closure = g_simple_async_result_get_op_res_gpointer (res);
 	SecretService *service = SECRET_SERVICE (source);
 	GError *error = NULL;
-	GVariant *response;
-
-	response =  g_dbus_proxy_call_finish (G_DBUS_PROXY (service), result, &error);
-
-	/* A successful response, decode it */
-	if (response != NULL) {
-		if (response_open_session_aes (closure->session, response)) {
-			_secret_service_take_session (service, closure->session);
-			closure->session = NULL;
 
-		} else {
-			g_simple_async_result_set_error (res, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
-			                                 _("Couldn't communicate with the secret storage"));
-		}
+	closure->response = g_dbus_proxy_call_finish (G_DBUS_PROXY (service), result, &error);
 
-		g_simple_async_result_complete (res);
-		g_variant_unref (response);
+	/* A successful response, derive the key without blocking the caller */
+	if (closure->response != NULL) {
+		g_simple_async_result_run_in_thread (res, open_session_aes_thread,
+		                                     G_PRIORITY_DEFAULT, closure->cancellable);
 
 	} else {
-		/* AES session not supported, request a plain session */
+		/* Algorithm not supported, request the next one */
 		if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED)) {
-			g_dbus_proxy_call (G_DBUS_PROXY (source), "OpenSession",
-			                   request_open_session_plain (closure->session),
-			                   G_DBUS_CALL_FLAGS_NONE, -1,
-			                   closure->cancellable, on_service_open_session_plain,
-			                   g_object_ref (res));
+			closure->algorithm++;
+			open_session_next (service, res);
 			g_error_free (error);
 
 		/* Other errors result in a failure */
@@ -304,67 +612,313 @@ on_service_open_session_aes (GObject *source,
 	g_object_unref (res);
 }
 
-#endif /* WITH_GCRYPT */
-
-
-void
-_secret_session_open (SecretService *service,
-                      GCancellable *cancellable,
-                      GAsyncReadyCallback callback,
-                      gpointer user_data)
+static void
+call_open_session_aes (SecretService *service,
+                       GSimpleAsyncResult *res)
 {
-	GSimpleAsyncResult *res;
-	OpenSessionClosure *closure;
-
-	res = g_simple_async_result_new (G_OBJECT (service), callback, user_data,
-	                                 _secret_session_open);
-	closure = g_new (OpenSessionClosure, 1);
-	closure->cancellable = cancellable ? g_object_ref (cancellable) : cancellable;
-	closure->session = g_new0 (SecretSession, 1);
-	g_simple_async_result_set_op_res_gpointer (res, closure, open_session_closure_free);
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
 
 	g_dbus_proxy_call (G_DBUS_PROXY (service), "OpenSession",
-#ifdef WITH_GCRYPT
-	                   request_open_session_aes (closure->session),
+	                   request_open_session_aes (closure->session,
+	                                             open_session_algorithms (res)),
 	                   G_DBUS_CALL_FLAGS_NONE, -1,
-	                   cancellable, on_service_open_session_aes,
-#else
-	                   request_open_session_plain (closure->session),
-	                   G_DBUS_CALL_FLAGS_NONE, -1,
-	                   cancellable, on_service_open_session_plain,
-#endif
+	                   closure->cancellable, on_service_open_session_aes,
 	                   g_object_ref (res));
-
-	g_object_unref (res);
 }
 
-gboolean
-_secret_session_open_finish (GAsyncResult *result,
-                              GError **error)
+static void
+generate_keypair_thread (GSimpleAsyncResult *gen,
+                         GObject *source,
+                         GCancellable *cancellable)
 {
-	if (_secret_util_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error))
-		return FALSE;
+	SecretSession *session = g_simple_async_result_get_op_res_gpointer (gen);
 
-	return TRUE;
+	if (!dh_keypair_generate (&session->prime, &session->privat, &session->publi)) {
+		g_simple_async_result_set_error (gen, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+		                                 _("Couldn't communicate with the secret storage"));
+	}
 }
 
-#ifdef WITH_GCRYPT
-
-static gboolean
-pkcs7_unpad_bytes_in_place (guchar *padded,
-                            gsize *n_padded)
+static void
+on_generate_keypair (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
 {
-	gsize n_pad, i;
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	GError *error = NULL;
 
-	if (*n_padded == 0)
-		return FALSE;
+	if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result), &error)) {
+		g_simple_async_result_take_error (res, error);
+		g_simple_async_result_complete (res);
+	} else {
+		call_open_session_aes (SECRET_SERVICE (source), res);
+	}
 
-	n_pad = padded[*n_padded - 1];
+	g_object_unref (res);
+}
 
-	/* Validate the padding */
-	if (n_pad == 0 || n_pad > 16)
-		return FALSE;
-	if (n_pad > *n_padded)
+static void
+open_session_aes (SecretService *service,
+                  GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GSimpleAsyncResult *gen;
+
+	egg_libgcrypt_initialize ();
+
+	/* Falling back between DH algorithms reuses the same keypair */
+	if (closure->session->publi != NULL) {
+		call_open_session_aes (service, res);
+
+	/* Use a keypair generated in advance if there is one */
+	} else if (session_take_keypair (closure->session)) {
+		call_open_session_aes (service, res);
+
+	/* Otherwise generate one without blocking the caller */
+	} else {
+		g_assert (closure->session->prime == NULL);
+		g_assert (closure->session->privat == NULL);
+
+		gen = g_simple_async_result_new (G_OBJECT (service), on_generate_keypair,
+		                                 g_object_ref (res), open_session_aes);
+		g_simple_async_result_set_op_res_gpointer (gen, closure->session, NULL);
+		g_simple_async_result_run_in_thread (gen, generate_keypair_thread,
+		                                     G_PRIORITY_DEFAULT, closure->cancellable);
+		g_object_unref (gen);
+	}
+}
+
+#ifdef EGG_DH_WITH_X25519
+
+static void
+on_service_open_session_x25519 (GObject *source,
+                                GAsyncResult *result,
+                                gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	OpenSessionClosure * closure = g_simple_async_result_get_op_res_gpointer (res);
+	SecretService *service = SECRET_SERVICE (source);
+	GError *error = NULL;
+	GVariant *response;
+
+	response =  g_dbus_proxy_call_finish (G_DBUS_PROXY (service), result, &error);
+
+	/* A successful response, decode it */
+	if (response != NULL) {
+		if (response_open_session_x25519 (closure->session, response,
+		                                  open_session_algorithms (res))) {
+			open_session_accepted (service, res);
+			_secret_service_take_session (service, closure->session);
+			closure->session = NULL;
+
+		} else {
+			g_simple_async_result_set_error (res, SECRET_ERROR, SECRET_ERROR_PROTOCOL,
+			                                 _("Couldn't communicate with the secret storage"));
+		}
+
+		g_simple_async_result_complete (res);
+		g_variant_unref (response);
+
+	} else {
+		/* Algorithm not supported, request the next one */
+		if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED)) {
+			closure->algorithm++;
+			open_session_next (service, res);
+			g_error_free (error);
+
+		/* Other errors result in a failure */
+		} else {
+			g_simple_async_result_take_error (res, error);
+			g_simple_async_result_complete (res);
+		}
+	}
+
+	g_object_unref (res);
+}
+
+static void
+open_session_x25519 (SecretService *service,
+                     GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+
+	g_dbus_proxy_call (G_DBUS_PROXY (service), "OpenSession",
+	                   request_open_session_x25519 (closure->session,
+	                                                open_session_algorithms (res)),
+	                   G_DBUS_CALL_FLAGS_NONE, -1,
+	                   closure->cancellable, on_service_open_session_x25519,
+	                   g_object_ref (res));
+}
+
+#endif /* EGG_DH_WITH_X25519 */
+
+#endif /* WITH_GCRYPT */
+
+/*
+ * The algorithms we ask for, most preferred first. When the service
+ * doesn't support one we fall back to the next, ending with plain.
+ */
+static const struct {
+	const gchar *algorithms;
+	void (* open) (SecretService *service, GSimpleAsyncResult *res);
+} session_algorithms[] = {
+#ifdef EGG_DH_WITH_X25519
+#ifdef WITH_AES_GCM
+	{ ALGORITHMS_X25519_GCM, open_session_x25519 },
+#endif
+	{ ALGORITHMS_X25519, open_session_x25519 },
+#endif
+#ifdef WITH_AES_GCM
+	{ ALGORITHMS_AES_GCM, open_session_aes },
+#endif
+#ifdef WITH_GCRYPT
+	{ ALGORITHMS_AES, open_session_aes },
+#endif
+	{ ALGORITHMS_PLAIN, open_session_plain },
+};
+
+static const gchar *
+open_session_algorithms (GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	g_assert (closure->algorithm < G_N_ELEMENTS (session_algorithms));
+	return session_algorithms[closure->algorithm].algorithms;
+}
+
+static void
+open_session_next (SecretService *service,
+                   GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	g_assert (closure->algorithm < G_N_ELEMENTS (session_algorithms));
+	(session_algorithms[closure->algorithm].open) (service, res);
+}
+
+/*
+ * The algorithm each service accepted, so that later sessions start with
+ * it, rather than asking for the ones it doesn't support all over again.
+ * These are kept with the connection, by the unique name of the service,
+ * so that a restarted service is asked afresh.
+ */
+
+G_LOCK_DEFINE_STATIC (accepted_algorithms);
+
+/* Called with the lock held */
+static GHashTable *
+accepted_algorithms_for (GDBusConnection *connection)
+{
+	static GQuark quark = 0;
+	GHashTable *accepted;
+
+	if (quark == 0)
+		quark = g_quark_from_static_string ("secret-session-accepted-algorithms");
+
+	accepted = g_object_get_qdata (G_OBJECT (connection), quark);
+	if (accepted == NULL) {
+		accepted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+		g_object_set_qdata_full (G_OBJECT (connection), quark, accepted,
+		                         (GDestroyNotify)g_hash_table_unref);
+	}
+
+	return accepted;
+}
+
+static guint
+open_session_first (SecretService *service)
+{
+	GDBusConnection *connection;
+	gpointer algorithm = NULL;
+	gchar *owner;
+
+	connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (service));
+	owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (service));
+	if (owner == NULL)
+		return 0;
+
+	G_LOCK (accepted_algorithms);
+	algorithm = g_hash_table_lookup (accepted_algorithms_for (connection), owner);
+	G_UNLOCK (accepted_algorithms);
+
+	g_free (owner);
+
+	/* Stored plus one, so that zero means nothing was */
+	if (algorithm == NULL || GPOINTER_TO_UINT (algorithm) > G_N_ELEMENTS (session_algorithms))
+		return 0;
+	return GPOINTER_TO_UINT (algorithm) - 1;
+}
+
+static void
+open_session_accepted (SecretService *service,
+                       GSimpleAsyncResult *res)
+{
+	OpenSessionClosure *closure = g_simple_async_result_get_op_res_gpointer (res);
+	GDBusConnection *connection;
+	gchar *owner;
+
+	connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (service));
+	owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (service));
+	if (owner == NULL)
+		return;
+
+	G_LOCK (accepted_algorithms);
+	g_hash_table_replace (accepted_algorithms_for (connection), owner,
+	                      GUINT_TO_POINTER (closure->algorithm + 1));
+	G_UNLOCK (accepted_algorithms);
+}
+
+void
+_secret_session_open (SecretService *service,
+                      GCancellable *cancellable,
+                      GAsyncReadyCallback callback,
+                      gpointer user_data)
+{
+	GSimpleAsyncResult *res;
+	OpenSessionClosure *closure;
+
+	res = g_simple_async_result_new (G_OBJECT (service), callback, user_data,
+	                                 _secret_session_open);
+	closure = g_new0 (OpenSessionClosure, 1);
+	closure->cancellable = cancellable ? g_object_ref (cancellable) : cancellable;
+	closure->session = g_new0 (SecretSession, 1);
+#ifdef WITH_GCRYPT
+	g_mutex_init (&closure->session->mutex);
+#endif
+	g_simple_async_result_set_op_res_gpointer (res, closure, open_session_closure_free);
+
+	/* Each algorithm falls back to the next one if not supported */
+	closure->algorithm = open_session_first (service);
+	open_session_next (service, res);
+
+	g_object_unref (res);
+}
+
+gboolean
+_secret_session_open_finish (GAsyncResult *result,
+                              GError **error)
+{
+	if (_secret_util_propagate_error (G_SIMPLE_ASYNC_RESULT (result), error))
+		return FALSE;
+
+	return TRUE;
+}
+
+#ifdef WITH_GCRYPT
+
+static gboolean
+pkcs7_unpad_bytes_in_place (guchar *padded,
+                            gsize *n_padded)
+{
+	gsize n_pad, i;
+
+	if (*n_padded == 0)
+		return FALSE;
+
+	n_pad = padded[*n_padded - 1];
+
+	/* Validate the padding */
+	if (n_pad == 0 || n_pad > 16)
+		return FALSE;
+	if (n_pad > *n_padded)
 		return FALSE;
 	for (i = *n_padded - n_pad; i < *n_padded; ++i) {
 		if (padded[i] != n_pad)
@@ -380,276 +934,1586 @@ pkcs7_unpad_bytes_in_place (guchar *padded,
 	return TRUE;
 }
 
-static SecretValue *
-service_decode_aes_secret (SecretSession *session,
+static guchar *
+decrypt_aes_secret (gcry_cipher_hd_t cih,
+                    gconstpointer param,
+                    const guchar *value,
+                    gsize n_value,
+                    guchar *into,
+                    gsize *n_secret)
+{
+	gcry_error_t gcry;
+	guchar last[16];
+	gsize n_last;
+	guchar *secret;
+
+	/*
+	 * Decrypt the last block first to find out how much padding there is.
+	 * In CBC mode its IV is the previous block of ciphertext.
+	 */
+	gcry = gcry_cipher_setiv (cih, n_value > 16 ? value + n_value - 32 : param, 16);
+	if (gcry == 0)
+		gcry = gcry_cipher_decrypt (cih, last, 16, value + n_value - 16, 16);
+	if (gcry != 0) {
+		g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+		return NULL;
+	}
+
+	n_last = 16;
+	if (!pkcs7_unpad_bytes_in_place (last, &n_last)) {
+		egg_secure_clear (last, sizeof (last));
+		g_message ("received an invalid or unencryptable secret");
+		return NULL;
+	}
+
+	/*
+	 * Now the secret can be allocated at its exact size, unless we were
+	 * given a place for it, and the rest decrypted straight from the
+	 * message into place.
+	 */
+	*n_secret = n_value - 16 + n_last;
+	secret = into ? into : egg_secure_alloc (*n_secret + 1);
+
+	if (n_value > 16) {
+		gcry = gcry_cipher_setiv (cih, param, 16);
+		if (gcry == 0)
+			gcry = gcry_cipher_decrypt (cih, secret, n_value - 16, value, n_value - 16);
+		if (gcry != 0) {
+			g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+			egg_secure_clear (last, sizeof (last));
+			if (secret != into)
+				egg_secure_free (secret);
+			return NULL;
+		}
+	}
+
+	memcpy (secret + n_value - 16, last, n_last);
+	egg_secure_clear (last, sizeof (last));
+
+	/* Null teriminate as a courtesy */
+	secret[*n_secret] = 0;
+
+	return secret;
+}
+
+#ifdef WITH_AES_GCM
+
+static guchar *
+decrypt_gcm_secret (gcry_cipher_hd_t cih,
+                    gconstpointer param,
+                    const gchar *content_type,
+                    const guchar *value,
+                    gsize n_value,
+                    guchar *into,
+                    gsize *n_secret)
+{
+	gcry_error_t gcry;
+	guchar *secret;
+
+	/*
+	 * No padding, so the secret is allocated at its exact size and
+	 * decrypted straight from the message into place. The content type
+	 * is authenticated along with it.
+	 */
+	*n_secret = n_value - GCM_TAG_SIZE;
+	secret = into ? into : egg_secure_alloc (*n_secret + 1);
+
+	gcry = gcry_cipher_setiv (cih, param, GCM_IV_SIZE);
+	if (gcry == 0)
+		gcry = gcry_cipher_authenticate (cih, content_type, strlen (content_type));
+	if (gcry == 0 && *n_secret > 0)
+		gcry = gcry_cipher_decrypt (cih, secret, *n_secret, value, *n_secret);
+	if (gcry == 0)
+		gcry = gcry_cipher_checktag (cih, value + *n_secret, GCM_TAG_SIZE);
+
+	if (gcry != 0) {
+		egg_secure_clear (secret, *n_secret);
+		if (secret != into)
+			egg_secure_free (secret);
+		if (gcry_err_code (gcry) == GPG_ERR_CHECKSUM)
+			g_message ("received an encrypted secret that failed authentication");
+		else
+			g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+		return NULL;
+	}
+
+	/* Null teriminate as a courtesy */
+	secret[*n_secret] = 0;
+
+	return secret;
+}
+
+static guchar *
+service_decode_gcm_secret (SecretSession *session,
+                           gcry_cipher_hd_t cih,
                            gconstpointer param,
                            gsize n_param,
+                           const gchar *content_type,
                            gconstpointer value,
                            gsize n_value,
-                           const gchar *content_type)
+                           guchar *into,
+                           gsize *n_secret)
 {
-	gcry_cipher_hd_t cih;
-	gsize n_padded;
-	gcry_error_t gcry;
-	guchar *padded;
-	gsize pos;
+	guchar *secret;
 
-	if (n_param != 16) {
+	if (n_param != GCM_IV_SIZE) {
 		g_message ("received an encrypted secret structure with invalid parameter");
 		return NULL;
 	}
 
-	if (n_value == 0 || n_value % 16 != 0) {
+	if (n_value < GCM_TAG_SIZE) {
 		g_message ("received an encrypted secret structure with bad secret length");
 		return NULL;
 	}
 
-	gcry = gcry_cipher_open (&cih, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CBC, 0);
-	if (gcry != 0) {
-		g_warning ("couldn't create AES cipher: %s", gcry_strerror (gcry));
+	if (cih == NULL) {
+		g_mutex_lock (&session->mutex);
+		secret = decrypt_gcm_secret (session->cih, param, content_type,
+		                             value, n_value, into, n_secret);
+		g_mutex_unlock (&session->mutex);
+	} else {
+		secret = decrypt_gcm_secret (cih, param, content_type,
+		                             value, n_value, into, n_secret);
+	}
+
+	return secret;
+}
+
+#endif /* WITH_AES_GCM */
+
+static guchar *
+service_decode_aes_secret (SecretSession *session,
+                           gcry_cipher_hd_t cih,
+                           gconstpointer param,
+                           gsize n_param,
+                           const gchar *content_type,
+                           gconstpointer value,
+                           gsize n_value,
+                           guchar *into,
+                           gsize *n_secret)
+{
+	guchar *secret;
+
+#ifdef WITH_AES_GCM
+	if (session->gcm)
+		return service_decode_gcm_secret (session, cih, param, n_param, content_type,
+		                                  value, n_value, into, n_secret);
+#endif
+
+	if (n_param != 16) {
+		g_message ("received an encrypted secret structure with invalid parameter");
+		return NULL;
+	}
+
+	if (n_value == 0 || n_value % 16 != 0) {
+		g_message ("received an encrypted secret structure with bad secret length");
 		return NULL;
 	}
 
 #if 0
 	g_printerr ("    lib iv:  %s\n", egg_hex_encode (param, n_param));
+	g_printerr ("   lib key:  %s\n", egg_hex_encode (session->key, session->n_key));
 #endif
 
-	gcry = gcry_cipher_setiv (cih, param, n_param);
-	g_return_val_if_fail (gcry == 0, NULL);
+	if (cih == NULL) {
+		g_mutex_lock (&session->mutex);
+		secret = decrypt_aes_secret (session->cih, param, value, n_value, into, n_secret);
+		g_mutex_unlock (&session->mutex);
+	} else {
+		secret = decrypt_aes_secret (cih, param, value, n_value, into, n_secret);
+	}
+
+	return secret;
+}
+
+#endif /* WITH_GCRYPT */
+
+static guchar *
+service_decode_plain_secret (SecretSession *session,
+                             gconstpointer param,
+                             gsize n_param,
+                             gconstpointer value,
+                             gsize n_value,
+                             guchar *into,
+                             gsize *n_secret)
+{
+	guchar *secret;
+
+	if (n_param != 0) {
+		g_message ("received a plain secret structure with invalid parameter");
+		return NULL;
+	}
+
+	/* Copied straight from the message into place */
+	secret = into ? into : egg_secure_alloc (n_value + 1);
+	memcpy (secret, value, n_value);
+	secret[n_value] = 0;
+
+	*n_secret = n_value;
+	return secret;
+}
+
+/*
+ * When decoding many secrets at once, they're placed together in secure
+ * regions, which are shared by the values and freed along with the last
+ * of them. Each secret gets a slot holding its SecretValue, followed by
+ * room for its encoded value plus a null terminator, which always fits
+ * the decoded secret. Slots are aligned for the SecretValue.
+ *
+ * Regions are kept well inside a secure memory block, so that a large
+ * reply doesn't need one huge allocation, which would fall back to
+ * pageable memory for all the secrets if it couldn't be locked.
+ */
+
+#define DECODE_ARENA_MAX 8192
+
+typedef struct {
+	gint refs;
+	gsize length;
+} DecodeArena;
+
+static DecodeArena *
+decode_arena_new (gsize length)
+{
+	DecodeArena *arena;
+
+	arena = egg_secure_alloc (sizeof (DecodeArena) + length);
+	arena->refs = 1;
+	arena->length = length;
+
+	return arena;
+}
+
+static guchar *
+decode_arena_slot (DecodeArena *arena,
+                   gsize offset)
+{
+	g_assert (offset < arena->length);
+	return ((guchar *)(arena + 1)) + offset;
+}
+
+static void
+decode_arena_unref (gpointer data)
+{
+	DecodeArena *arena = data;
+
+	if (g_atomic_int_dec_and_test (&arena->refs))
+		egg_secure_free (arena);
+}
+
+static gsize
+decode_slot_length (GVariant *encoded)
+{
+	GVariant *vvalue;
+	gsize length;
+
+	vvalue = g_variant_get_child_value (encoded, 2);
+	length = _secret_value_shared_size () + g_variant_get_size (vvalue) + 1;
+	g_variant_unref (vvalue);
+
+	return (length + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+}
+
+/*
+ * The @cipher is a cipher handle private to the calling thread, or %NULL
+ * to use the cipher shared by the session (and its lock).
+ */
+static SecretValue *
+session_decode_secret (SecretSession *session,
+                       gpointer cipher,
+                       GVariant *encoded,
+                       DecodeArena *arena,
+                       gsize offset)
+{
+	SecretValue *result = NULL;
+	guchar *slot = NULL;
+	guchar *into = NULL;
+	guchar *secret;
+	gsize n_secret;
+	gconstpointer param;
+	gconstpointer value;
+	const gchar *session_path;
+	const gchar *content_type;
+	gsize n_param;
+	gsize n_value;
+	GVariant *vparam;
+	GVariant *vvalue;
+
+	/* Parsing (oayays), the strings point into the encoded data */
+	g_variant_get_child (encoded, 0, "&o", &session_path);
+
+	if (session_path == NULL || !g_str_equal (session_path, session->path)) {
+		g_message ("received a secret encoded with wrong session: %s != %s",
+		           session_path, session->path);
+		return NULL;
+	}
+
+	vparam = g_variant_get_child_value (encoded, 1);
+	param = g_variant_get_fixed_array (vparam, &n_param, sizeof (guchar));
+	vvalue = g_variant_get_child_value (encoded, 2);
+	value = g_variant_get_fixed_array (vvalue, &n_value, sizeof (guchar));
+	g_variant_get_child (encoded, 3, "&s", &content_type);
+
+	if (arena != NULL) {
+		slot = decode_arena_slot (arena, offset);
+		into = slot + _secret_value_shared_size ();
+	}
+
+#ifdef WITH_GCRYPT
+	if (session->key != NULL)
+		secret = service_decode_aes_secret (session, cipher, param, n_param, content_type,
+		                                    value, n_value, into, &n_secret);
+	else
+#endif
+		secret = service_decode_plain_secret (session, param, n_param,
+		                                      value, n_value, into, &n_secret);
+
+	if (secret != NULL && arena != NULL) {
+		g_atomic_int_inc (&arena->refs);
+		result = _secret_value_new_shared (slot, (gchar *)secret, n_secret, content_type,
+		                                   decode_arena_unref, arena);
+	} else if (secret != NULL) {
+		result = secret_value_new_full ((gchar *)secret, n_secret, content_type,
+		                                egg_secure_free);
+	}
+
+	g_variant_unref (vparam);
+	g_variant_unref (vvalue);
+
+	return result;
+}
+
+SecretValue *
+_secret_session_decode_secret (SecretSession *session,
+                               GVariant *encoded)
+{
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (encoded != NULL, NULL);
+
+	return session_decode_secret (session, NULL, encoded, NULL, 0);
+}
+
+/*
+ * Decoding many secrets at once can optionally be spread over several
+ * threads. This is off by default, and is enabled by setting the
+ * SECRET_DECODE_THREADS environment variable to the number of threads
+ * to use. Only replies with more than decode_threshold secrets are split.
+ * The threads are started the first time they're needed, and then kept
+ * for the following replies.
+ */
+
+#define DEFAULT_DECODE_THRESHOLD 256
+
+static guint decode_threads = 0;
+static guint decode_threshold = DEFAULT_DECODE_THRESHOLD;
+static GThreadPool *decode_pool = NULL;
+G_LOCK_DEFINE_STATIC (decode_pool);
+
+static void
+decode_threads_init (void)
+{
+	static volatile gsize initialized = 0;
+	const gchar *env;
+
+	if (g_once_init_enter (&initialized)) {
+		env = g_getenv ("SECRET_DECODE_THREADS");
+		if (env != NULL)
+			decode_threads = (guint)strtoul (env, NULL, 10);
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+void
+_secret_session_set_decode_threads (guint n_threads,
+                                    guint threshold)
+{
+	decode_threads_init ();
+
+	G_LOCK (decode_pool);
+	decode_threads = n_threads;
+	decode_threshold = threshold;
+	if (decode_pool != NULL && n_threads > 1)
+		g_thread_pool_set_max_threads (decode_pool, n_threads - 1, NULL);
+	G_UNLOCK (decode_pool);
+}
+
+typedef struct {
+	GMutex mutex;
+	GCond cond;
+	guint pending;
+} DecodeWait;
+
+typedef struct {
+	SecretSession *session;
+	DecodeArena **arenas;
+	gsize *offsets;
+	GVariant **encoded;
+	SecretValue **values;
+	guint count;
+	DecodeWait *wait;
+} DecodeChunk;
+
+static void
+decode_chunk (DecodeChunk *chunk)
+{
+	gpointer cipher = NULL;
+	guint i;
+
+#ifdef WITH_GCRYPT
+	/* Each thread gets its own cipher, so they don't contend on the session */
+	if (chunk->session->key != NULL)
+		cipher = session_cipher_new (chunk->session);
+#endif
+
+	for (i = 0; i < chunk->count; i++)
+		chunk->values[i] = session_decode_secret (chunk->session, cipher,
+		                                          chunk->encoded[i], chunk->arenas[i],
+		                                          chunk->offsets[i]);
+
+#ifdef WITH_GCRYPT
+	if (cipher != NULL)
+		gcry_cipher_close (cipher);
+#endif
+}
+
+static void
+on_decode_chunk (gpointer data,
+                 gpointer unused)
+{
+	DecodeChunk *chunk = data;
+	DecodeWait *wait = chunk->wait;
+
+	decode_chunk (chunk);
+
+	g_mutex_lock (&wait->mutex);
+	if (--wait->pending == 0)
+		g_cond_signal (&wait->cond);
+	g_mutex_unlock (&wait->mutex);
+}
+
+/* The calling thread decodes too, so the pool has one thread less */
+static GThreadPool *
+decode_pool_get (void)
+{
+	GThreadPool *pool;
+	GError *error = NULL;
+
+	G_LOCK (decode_pool);
+
+	if (decode_pool == NULL && decode_threads > 1) {
+		decode_pool = g_thread_pool_new (on_decode_chunk, NULL, decode_threads - 1,
+		                                 TRUE, &error);
+		if (error != NULL) {
+			g_message ("couldn't start threads to decode secrets: %s", error->message);
+			g_clear_error (&error);
+			decode_pool = NULL;
+		}
+	}
+
+	pool = decode_pool;
+
+	G_UNLOCK (decode_pool);
+
+	return pool;
+}
+
+/* Returns the arenas, one per secret, or %NULL for a secret not in one */
+static DecodeArena **
+decode_arenas_layout (GVariant **encoded,
+                      guint count,
+                      gsize *offsets)
+{
+	DecodeArena **arenas;
+	DecodeArena *arena;
+	gsize length = 0;
+	gsize slot = 0;
+	guint first = 0;
+	guint i, j;
+
+	arenas = g_new0 (DecodeArena *, count);
+
+	for (i = 0; i <= count; i++) {
+		if (i < count)
+			slot = decode_slot_length (encoded[i]);
+
+		/* Close the current region when full, unless it holds just one secret */
+		if (i == count || (length > 0 && length + slot > DECODE_ARENA_MAX)) {
+			if (i - first > 1) {
+				arena = decode_arena_new (length);
+				for (j = first; j < i; j++)
+					arenas[j] = arena;
+			}
+			first = i;
+			length = 0;
+		}
+
+		if (i < count) {
+			offsets[i] = length;
+			length += slot;
+		}
+	}
+
+	return arenas;
+}
+
+void
+_secret_session_decode_secrets (SecretSession *session,
+                                GVariant **encoded,
+                                SecretValue **values,
+                                guint count)
+{
+	GThreadPool *pool = NULL;
+	DecodeArena **arenas;
+	DecodeChunk *chunks;
+	DecodeWait wait;
+	gsize *offsets;
+	guint n_chunks;
+	guint per_chunk;
+	guint i, offset;
+
+	g_return_if_fail (session != NULL);
+	g_return_if_fail (count == 0 || encoded != NULL);
+	g_return_if_fail (count == 0 || values != NULL);
+
+	/* Lay out a slot for each secret in shared secure regions */
+	offsets = g_new (gsize, count);
+	arenas = decode_arenas_layout (encoded, count, offsets);
+
+	decode_threads_init ();
+
+	if (decode_threads > 1 && count > decode_threshold)
+		pool = decode_pool_get ();
+
+	/* Decode everything on this thread */
+	if (pool == NULL) {
+		for (i = 0; i < count; i++)
+			values[i] = session_decode_secret (session, NULL, encoded[i],
+			                                   arenas[i], offsets[i]);
+
+	} else {
+		n_chunks = MIN (decode_threads, count);
+		per_chunk = (count + n_chunks - 1) / n_chunks;
+		chunks = g_new0 (DecodeChunk, n_chunks);
+
+		g_mutex_init (&wait.mutex);
+		g_cond_init (&wait.cond);
+		wait.pending = 0;
+
+		for (i = 0, offset = 0; i < n_chunks && offset < count; i++, offset += per_chunk) {
+			chunks[i].session = session;
+			chunks[i].arenas = arenas + offset;
+			chunks[i].offsets = offsets + offset;
+			chunks[i].encoded = encoded + offset;
+			chunks[i].values = values + offset;
+			chunks[i].count = MIN (per_chunk, count - offset);
+			chunks[i].wait = &wait;
+		}
+		n_chunks = i;
+
+		/* All but the first chunk go to the pool, and we do that one */
+		g_mutex_lock (&wait.mutex);
+		for (i = 1; i < n_chunks; i++) {
+			wait.pending++;
+			g_thread_pool_push (pool, chunks + i, NULL);
+		}
+		g_mutex_unlock (&wait.mutex);
+
+		decode_chunk (chunks);
+
+		g_mutex_lock (&wait.mutex);
+		while (wait.pending > 0)
+			g_cond_wait (&wait.cond, &wait.mutex);
+		g_mutex_unlock (&wait.mutex);
+
+		g_mutex_clear (&wait.mutex);
+		g_cond_clear (&wait.cond);
+		g_free (chunks);
+	}
+
+	/* The values now hold the regions, freed if none were decoded */
+	for (i = 0; i < count; i++) {
+		if (arenas[i] != NULL && (i == 0 || arenas[i] != arenas[i - 1]))
+			decode_arena_unref (arenas[i]);
+	}
+
+	g_free (arenas);
+	g_free (offsets);
+}
+
+#ifdef WITH_GCRYPT
+
+static guchar*
+pkcs7_pad_bytes_in_secure_memory (gconstpointer secret,
+                                  gsize length,
+                                  gsize *n_padded)
+{
+	gsize n_pad;
+	guchar *padded;
+
+	/* Pad the secret */
+	*n_padded = ((length + 16) / 16) * 16;
+	g_assert (length < *n_padded);
+	g_assert (*n_padded > 0);
+	n_pad = *n_padded - length;
+	g_assert (n_pad > 0 && n_pad <= 16);
+	padded = egg_secure_alloc (*n_padded);
+	memcpy (padded, secret, length);
+	memset (padded + length, n_pad, n_pad);
+	return padded;
+}
+
+#ifdef WITH_AES_GCM
+
+static gboolean
+service_encode_gcm_secret (SecretSession *session,
+                           SecretValue *value,
+                           GVariantBuilder *builder)
+{
+	const gchar *content_type;
+	gconstpointer secret;
+	gsize n_secret;
+	gcry_error_t gcry;
+	guchar *encrypted;
+	gsize n_encrypted;
+	gpointer iv;
+	GVariant *child;
+
+	g_variant_builder_add (builder, "o", session->path);
+
+	secret = secret_value_get (value, &n_secret);
+	content_type = secret_value_get_content_type (value);
+
+	/* Setup the IV, which must never repeat for this key */
+	iv = g_malloc0 (GCM_IV_SIZE);
+	gcry_create_nonce (iv, GCM_IV_SIZE);
+
+	/*
+	 * Encrypted straight from the value, with the tag on the end. There's
+	 * no padding, and the ciphertext need not be in secure memory.
+	 */
+	n_encrypted = n_secret + GCM_TAG_SIZE;
+	encrypted = g_malloc (n_encrypted);
+
+	g_mutex_lock (&session->mutex);
+	gcry = gcry_cipher_setiv (session->cih, iv, GCM_IV_SIZE);
+	if (gcry == 0)
+		gcry = gcry_cipher_authenticate (session->cih, content_type, strlen (content_type));
+	if (gcry == 0 && n_secret > 0)
+		gcry = gcry_cipher_encrypt (session->cih, encrypted, n_secret, secret, n_secret);
+	if (gcry == 0)
+		gcry = gcry_cipher_gettag (session->cih, encrypted + n_secret, GCM_TAG_SIZE);
+	g_mutex_unlock (&session->mutex);
+
+	if (gcry != 0) {
+		g_warning ("couldn't encrypt AES secret: %s", gcry_strerror (gcry));
+		g_free (encrypted);
+		g_free (iv);
+		return FALSE;
+	}
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), iv, GCM_IV_SIZE, TRUE, g_free, iv);
+	g_variant_builder_add_value (builder, child);
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), encrypted, n_encrypted, TRUE, g_free, encrypted);
+	g_variant_builder_add_value (builder, child);
+
+	g_variant_builder_add (builder, "s", content_type);
+	return TRUE;
+}
+
+#endif /* WITH_AES_GCM */
+
+static gboolean
+service_encode_aes_secret (SecretSession *session,
+                           SecretValue *value,
+                           GVariantBuilder *builder)
+{
+	guchar *padded;
+	gsize n_padded;
+	gcry_error_t gcry;
+	gpointer iv;
+	gconstpointer secret;
+	gsize n_secret;
+	GVariant *child;
+
+#ifdef WITH_AES_GCM
+	if (session->gcm)
+		return service_encode_gcm_secret (session, value, builder);
+#endif
+
+	g_variant_builder_add (builder, "o", session->path);
+
+	secret = secret_value_get (value, &n_secret);
+
+	/* Perform the encoding here */
+	padded = pkcs7_pad_bytes_in_secure_memory (secret, n_secret, &n_padded);
+	g_assert (padded != NULL);
+
+	/* Setup the IV */
+	iv = g_malloc0 (16);
+	gcry_create_nonce (iv, 16);
+
+	/* Perform the encryption of the whole buffer in one go */
+	g_mutex_lock (&session->mutex);
+	gcry = gcry_cipher_setiv (session->cih, iv, 16);
+	if (gcry == 0)
+		gcry = gcry_cipher_encrypt (session->cih, padded, n_padded, NULL, 0);
+	g_mutex_unlock (&session->mutex);
+
+	if (gcry != 0) {
+		g_warning ("couldn't encrypt AES secret: %s", gcry_strerror (gcry));
+		egg_secure_free (padded);
+		g_free (iv);
+		return FALSE;
+	}
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), iv, 16, TRUE, g_free, iv);
+	g_variant_builder_add_value (builder, child);
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), padded, n_padded, TRUE, egg_secure_free, padded);
+	g_variant_builder_add_value (builder, child);
+
+	g_variant_builder_add (builder, "s", secret_value_get_content_type (value));
+	return TRUE;
+}
+
+#endif /* WITH_GCRYPT */
+
+static gboolean
+service_encode_plain_secret (SecretSession *session,
+                             SecretValue *value,
+                             GVariantBuilder *builder)
+{
+	gconstpointer secret;
+	gsize n_secret;
+	GVariant *child;
+
+	g_variant_builder_add (builder, "o", session->path);
+
+	secret = secret_value_get (value, &n_secret);
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), "", 0, TRUE, NULL, NULL);
+	g_variant_builder_add_value (builder, child);
+	g_variant_unref (child);
+
+	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), secret, n_secret, TRUE,
+	                                 secret_value_unref, secret_value_ref (value));
+	g_variant_builder_add_value (builder, child);
+	g_variant_unref (child);
+
+	g_variant_builder_add (builder, "s", secret_value_get_content_type (value));
+	return TRUE;
+}
+
+GVariant *
+_secret_session_encode_secret (SecretSession *session,
+                               SecretValue *value)
+{
+	GVariantBuilder *builder;
+	GVariant *result = NULL;
+	GVariantType *type;
+	gboolean ret;
+
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (value != NULL, NULL);
+
+	type = g_variant_type_new ("(oayays)");
+	builder = g_variant_builder_new (type);
+
+#ifdef WITH_GCRYPT
+	if (session->key)
+		ret = service_encode_aes_secret (session, value, builder);
+	else
+#endif
+		ret = service_encode_plain_secret (session, value, builder);
+	if (ret)
+		result = g_variant_builder_end (builder);
+
+	g_variant_builder_unref (builder);
+	g_variant_type_free (type);
+	return result;
+}
+
+/*
+ * Large secrets can be encoded and decoded a chunk at a time, so that
+ * the plain text is never held in full. The protocol still carries the
+ * encrypted secret as a single byte array, which is accumulated by the
+ * encoder, and held in the reply by the decoder. Only the plain text is
+ * kept in secure memory, and at most a chunk of it.
+ */
+
+struct _SecretSessionEncoder {
+	SecretSession *session;
+	gchar *content_type;
+#ifdef WITH_GCRYPT
+	gcry_cipher_hd_t cih;
+	gpointer iv;
+	gsize n_iv;
+	gsize n_pending;
+#endif
+	guchar *data;
+	gsize length;
+	gsize allocated;
+	gboolean secure;
+	int fd;
+	guchar chunk[SECRET_SESSION_STREAM_CHUNK + 16];
+};
+
+/* Returns room for @length more bytes at the end of the encoded data */
+static guchar *
+encoder_reserve (SecretSessionEncoder *encoder,
+                 gsize length)
+{
+	guchar *at;
+
+	if (encoder->length + length > encoder->allocated) {
+		encoder->allocated = MAX (encoder->allocated * 2, encoder->length + length);
+		if (encoder->secure)
+			encoder->data = egg_secure_realloc (encoder->data, encoder->allocated);
+		else
+			encoder->data = g_realloc (encoder->data, encoder->allocated);
+	}
+
+	at = encoder->data + encoder->length;
+	encoder->length += length;
+	return at;
+}
+
+/**
+ * _secret_session_encoder_new:
+ *
+ * Start encoding a secret with @content_type for @session. Feed it with
+ * _secret_session_encoder_update() and complete with
+ * _secret_session_encoder_finish().
+ *
+ * Returns: the encoder or %NULL if the cipher couldn't be setup
+ */
+SecretSessionEncoder *
+_secret_session_encoder_new (SecretSession *session,
+                             const gchar *content_type)
+{
+	SecretSessionEncoder *encoder;
+
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (content_type != NULL, NULL);
+
+	encoder = egg_secure_alloc (sizeof (SecretSessionEncoder));
+	encoder->session = session;
+	encoder->content_type = g_strdup (content_type);
+	encoder->fd = -1;
+
+	/* Without a key the secret itself is sent, so keep it secure */
+	encoder->secure = TRUE;
+
+#ifdef WITH_GCRYPT
+	if (session->key != NULL) {
+		gcry_error_t gcry;
+
+		/* The encoded data is cipher text, and need not be secure */
+		encoder->secure = FALSE;
+
+		/* A cipher of our own, as the session one can't be held across chunks */
+		encoder->cih = session_cipher_new (session);
+		if (encoder->cih == NULL) {
+			_secret_session_encoder_free (encoder);
+			return NULL;
+		}
+
+#ifdef WITH_AES_GCM
+		encoder->n_iv = session->gcm ? GCM_IV_SIZE : 16;
+#else
+		encoder->n_iv = 16;
+#endif
+		encoder->iv = g_malloc0 (encoder->n_iv);
+		gcry_create_nonce (encoder->iv, encoder->n_iv);
+
+		gcry = gcry_cipher_setiv (encoder->cih, encoder->iv, encoder->n_iv);
+#ifdef WITH_AES_GCM
+		if (gcry == 0 && session->gcm)
+			gcry = gcry_cipher_authenticate (encoder->cih, encoder->content_type,
+			                                 strlen (encoder->content_type));
+#endif
+		if (gcry != 0) {
+			g_warning ("couldn't encrypt AES secret: %s", gcry_strerror (gcry));
+			_secret_session_encoder_free (encoder);
+			return NULL;
+		}
+	}
+#endif
+
+	return encoder;
+}
+
+/**
+ * _secret_session_encoder_buffer:
+ *
+ * The secure buffer that the next part of the secret should be placed
+ * in, before calling _secret_session_encoder_update().
+ */
+gpointer
+_secret_session_encoder_buffer (SecretSessionEncoder *encoder,
+                                gsize *length)
+{
+	g_return_val_if_fail (encoder != NULL, NULL);
+	g_return_val_if_fail (length != NULL, NULL);
+
+	*length = SECRET_SESSION_STREAM_CHUNK;
+#ifdef WITH_GCRYPT
+	return encoder->chunk + encoder->n_pending;
+#else
+	return encoder->chunk;
+#endif
+}
+
+/* In a memfd the encoded data only passes through our buffer on its way */
+static gboolean
+encoder_flush (SecretSessionEncoder *encoder)
+{
+#ifdef HAVE_MEMFD_CREATE
+	gsize written = 0;
+	gssize res;
+
+	if (encoder->fd < 0)
+		return TRUE;
+
+	while (written < encoder->length) {
+		res = write (encoder->fd, encoder->data + written, encoder->length - written);
+		if (res < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			g_warning ("couldn't write secret to memfd: %s", g_strerror (errno));
+			return FALSE;
+		}
+		written += res;
+	}
+
+	if (encoder->secure)
+		egg_secure_clear (encoder->data, encoder->length);
+	encoder->length = 0;
+#endif
+
+	return TRUE;
+}
+
+/**
+ * _secret_session_encoder_use_fd:
+ *
+ * Have the encoder write into a memfd, to be completed with
+ * _secret_session_encoder_finish_fd(). Anything already encoded is moved
+ * into the memfd, so this can be called once the secret turns out to be
+ * large.
+ *
+ * Returns: %FALSE if memfds aren't available
+ */
+gboolean
+_secret_session_encoder_use_fd (SecretSessionEncoder *encoder)
+{
+	g_return_val_if_fail (encoder != NULL, FALSE);
+	g_return_val_if_fail (encoder->fd < 0, FALSE);
+
+#ifdef HAVE_MEMFD_CREATE
+	encoder->fd = memfd_create ("libsecret", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (encoder->fd < 0) {
+		g_message ("couldn't create memfd for secret: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	/* Carry on in memory if it can't be written to */
+	if (!encoder_flush (encoder)) {
+		close (encoder->fd);
+		encoder->fd = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/**
+ * _secret_session_encoder_update:
+ *
+ * Encode @length bytes placed in the buffer from _secret_session_encoder_buffer()
+ *
+ * Returns: %FALSE if the encryption failed
+ */
+gboolean
+_secret_session_encoder_update (SecretSessionEncoder *encoder,
+                                gsize length)
+{
+#ifdef WITH_GCRYPT
+	gcry_error_t gcry;
+	gsize n_blocks;
+#endif
+
+	g_return_val_if_fail (encoder != NULL, FALSE);
+	g_return_val_if_fail (length <= SECRET_SESSION_STREAM_CHUNK, FALSE);
+
+#ifdef WITH_GCRYPT
+	if (encoder->cih != NULL) {
+		/*
+		 * Both CBC and GCM carry on where the last call left off, as long
+		 * as it was a whole number of blocks. Any partial block at the end
+		 * is kept at the front of the buffer until more arrives.
+		 */
+		length += encoder->n_pending;
+		n_blocks = length & ~(gsize)15;
+		if (n_blocks > 0) {
+			gcry = gcry_cipher_encrypt (encoder->cih, encoder_reserve (encoder, n_blocks),
+			                            n_blocks, encoder->chunk, n_blocks);
+			if (gcry != 0) {
+				g_warning ("couldn't encrypt AES secret: %s", gcry_strerror (gcry));
+				return FALSE;
+			}
+		}
+
+		encoder->n_pending = length - n_blocks;
+		memmove (encoder->chunk, encoder->chunk + n_blocks, encoder->n_pending);
+		egg_secure_clear (encoder->chunk + encoder->n_pending, length - encoder->n_pending);
+		return encoder_flush (encoder);
+	}
+#endif
+
+	memcpy (encoder_reserve (encoder, length), encoder->chunk, length);
+	egg_secure_clear (encoder->chunk, length);
+	return encoder_flush (encoder);
+}
+
+/* Encrypts whatever is left, and returns the parameter for the cipher */
+static gboolean
+encoder_complete (SecretSessionEncoder *encoder,
+                  gconstpointer *iv,
+                  gsize *n_iv)
+{
+#ifdef WITH_GCRYPT
+	gcry_error_t gcry = 0;
+	gsize n_pad;
+#endif
+
+	*iv = "";
+	*n_iv = 0;
+
+#ifdef WITH_GCRYPT
+	if (encoder->cih != NULL) {
+#ifdef WITH_AES_GCM
+		if (encoder->session->gcm) {
+			/* The last part need not be a whole block, the tag goes on the end */
+			if (encoder->n_pending > 0)
+				gcry = gcry_cipher_encrypt (encoder->cih,
+				                            encoder_reserve (encoder, encoder->n_pending),
+				                            encoder->n_pending, encoder->chunk,
+				                            encoder->n_pending);
+			if (gcry == 0)
+				gcry = gcry_cipher_gettag (encoder->cih,
+				                           encoder_reserve (encoder, GCM_TAG_SIZE),
+				                           GCM_TAG_SIZE);
+		} else
+#endif
+		{
+			/* Always at least one byte of padding, like pkcs7_pad_bytes_in_secure_memory() */
+			n_pad = 16 - encoder->n_pending;
+			memset (encoder->chunk + encoder->n_pending, n_pad, n_pad);
+			gcry = gcry_cipher_encrypt (encoder->cih, encoder_reserve (encoder, 16),
+			                            16, encoder->chunk, 16);
+		}
+
+		egg_secure_clear (encoder->chunk, 16);
+		encoder->n_pending = 0;
+
+		if (gcry != 0) {
+			g_warning ("couldn't encrypt AES secret: %s", gcry_strerror (gcry));
+			return FALSE;
+		}
+
+		*iv = encoder->iv;
+		*n_iv = encoder->n_iv;
+	}
+#endif
+
+	return TRUE;
+}
+
+/**
+ * _secret_session_encoder_finish:
+ *
+ * Complete the encoding. The encoder should still be freed afterwards.
+ *
+ * Returns: (transfer floating): the encoded (oayays) secret, or %NULL
+ */
+GVariant *
+_secret_session_encoder_finish (SecretSessionEncoder *encoder)
+{
+	GVariant *children[4];
+	GDestroyNotify destroy;
+	gconstpointer iv;
+	gsize n_iv;
+
+	g_return_val_if_fail (encoder != NULL, NULL);
+	g_return_val_if_fail (encoder->fd < 0, NULL);
+
+	if (!encoder_complete (encoder, &iv, &n_iv))
+		return NULL;
+
+	destroy = encoder->secure ? egg_secure_free : g_free;
+
+	children[0] = g_variant_new_object_path (encoder->session->path);
+	children[1] = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, iv, n_iv, sizeof (guchar));
+	children[2] = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), encoder->data, encoder->length,
+	                                       TRUE, destroy, encoder->data);
+	children[3] = g_variant_new_string (encoder->content_type);
+
+	/* Now owned by the variant */
+	encoder->data = NULL;
+	encoder->length = encoder->allocated = 0;
+
+	return g_variant_new_tuple (children, G_N_ELEMENTS (children));
+}
+
+/**
+ * _secret_session_encoder_finish_fd:
+ *
+ * Complete encoding into a memfd, which is sealed and added to @fds.
+ *
+ * Returns: (transfer floating): the encoded (oayhs) secret, or %NULL
+ */
+GVariant *
+_secret_session_encoder_finish_fd (SecretSessionEncoder *encoder,
+                                   GUnixFDList *fds)
+{
+	GVariant *children[4];
+	GError *error = NULL;
+	gconstpointer iv;
+	gsize n_iv;
+	gint handle;
+
+	g_return_val_if_fail (encoder != NULL, NULL);
+	g_return_val_if_fail (encoder->fd >= 0, NULL);
+	g_return_val_if_fail (G_IS_UNIX_FD_LIST (fds), NULL);
+
+	if (!encoder_complete (encoder, &iv, &n_iv) || !encoder_flush (encoder))
+		return NULL;
+
+#ifdef HAVE_MEMFD_CREATE
+	/* So the service can rely on it not changing under its feet */
+	if (fcntl (encoder->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	                                     F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		g_warning ("couldn't seal memfd for secret: %s", g_strerror (errno));
+		return NULL;
+	}
+#endif
+
+	handle = g_unix_fd_list_append (fds, encoder->fd, &error);
+	if (handle < 0) {
+		g_warning ("couldn't send secret memfd: %s", error->message);
+		g_error_free (error);
+		return NULL;
+	}
+
+	children[0] = g_variant_new_object_path (encoder->session->path);
+	children[1] = g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, iv, n_iv, sizeof (guchar));
+	children[2] = g_variant_new_handle (handle);
+	children[3] = g_variant_new_string (encoder->content_type);
+
+	return g_variant_new_tuple (children, G_N_ELEMENTS (children));
+}
+
+void
+_secret_session_encoder_free (SecretSessionEncoder *encoder)
+{
+	if (encoder == NULL)
+		return;
+
+#ifdef WITH_GCRYPT
+	if (encoder->cih)
+		gcry_cipher_close (encoder->cih);
+	g_free (encoder->iv);
+#endif
+#ifdef HAVE_MEMFD_CREATE
+	if (encoder->fd >= 0)
+		close (encoder->fd);
+#endif
+	if (encoder->secure)
+		egg_secure_free (encoder->data);
+	else
+		g_free (encoder->data);
+	g_free (encoder->content_type);
+	egg_secure_free (encoder);
+}
+
+/**
+ * _secret_session_encode_secret_fd:
+ *
+ * Like _secret_session_encode_secret() but places the encrypted secret
+ * in a sealed memfd added to @fds.
+ *
+ * Returns: (transfer floating): the encoded (oayhs) secret, or %NULL
+ */
+GVariant *
+_secret_session_encode_secret_fd (SecretSession *session,
+                                  SecretValue *value,
+                                  GUnixFDList *fds)
+{
+	SecretSessionEncoder *encoder;
+	GVariant *result = NULL;
+	const guchar *secret;
+	gpointer buffer;
+	gsize n_secret;
+	gsize offset;
+	gsize n;
+
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (value != NULL, NULL);
+	g_return_val_if_fail (G_IS_UNIX_FD_LIST (fds), NULL);
+
+	encoder = _secret_session_encoder_new (session, secret_value_get_content_type (value));
+	if (encoder == NULL)
+		return NULL;
+
+	if (_secret_session_encoder_use_fd (encoder)) {
+		secret = secret_value_get (value, &n_secret);
+		for (offset = 0; offset < n_secret; offset += n) {
+			buffer = _secret_session_encoder_buffer (encoder, &n);
+			n = MIN (n, n_secret - offset);
+			memcpy (buffer, secret + offset, n);
+			if (!_secret_session_encoder_update (encoder, n))
+				break;
+		}
+
+		if (offset == n_secret)
+			result = _secret_session_encoder_finish_fd (encoder, fds);
+	}
+
+	_secret_session_encoder_free (encoder);
+	return result;
+}
+
+struct _SecretSessionDecoder {
+	GVariant *encoded;
+	GMappedFile *mapped;
+	const gchar *content_type;
+	const guchar *value;
+	gsize n_value;
+	gsize offset;
+#ifdef WITH_GCRYPT
+	gcry_cipher_hd_t cih;
+	guchar last[16];
+	gsize n_last;
+#endif
+	guchar chunk[SECRET_SESSION_STREAM_CHUNK];
+};
+
+#ifdef WITH_GCRYPT
+
+static gboolean
+decoder_setup_aes (SecretSession *session,
+                   SecretSessionDecoder *decoder,
+                   gconstpointer param,
+                   gsize n_param)
+{
+	gcry_error_t gcry;
+
+#ifdef WITH_AES_GCM
+	if (session->gcm) {
+		gsize n_cipher, offset, n;
+
+		if (n_param != GCM_IV_SIZE || decoder->n_value < GCM_TAG_SIZE) {
+			g_message ("received an encrypted secret structure with bad secret length");
+			return FALSE;
+		}
+
+		/*
+		 * No plain text may be handed out before the tag is checked, so
+		 * make one pass over the cipher text to authenticate it, and then
+		 * another to decrypt it.
+		 */
+		n_cipher = decoder->n_value - GCM_TAG_SIZE;
+		gcry = gcry_cipher_setiv (decoder->cih, param, GCM_IV_SIZE);
+		if (gcry == 0)
+			gcry = gcry_cipher_authenticate (decoder->cih, decoder->content_type,
+			                                 strlen (decoder->content_type));
+		for (offset = 0; gcry == 0 && offset < n_cipher; offset += n) {
+			n = MIN (n_cipher - offset, SECRET_SESSION_STREAM_CHUNK);
+			gcry = gcry_cipher_decrypt (decoder->cih, decoder->chunk, n,
+			                            decoder->value + offset, n);
+		}
+		egg_secure_clear (decoder->chunk, sizeof (decoder->chunk));
+		if (gcry == 0)
+			gcry = gcry_cipher_checktag (decoder->cih, decoder->value + n_cipher,
+			                             GCM_TAG_SIZE);
+		if (gcry == 0)
+			gcry = gcry_cipher_setiv (decoder->cih, param, GCM_IV_SIZE);
+		if (gcry == 0)
+			gcry = gcry_cipher_authenticate (decoder->cih, decoder->content_type,
+			                                 strlen (decoder->content_type));
+
+		if (gcry != 0) {
+			if (gcry_err_code (gcry) == GPG_ERR_CHECKSUM)
+				g_message ("received an encrypted secret that failed authentication");
+			else
+				g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+			return FALSE;
+		}
 
-#if 0
-	g_printerr ("   lib key:  %s\n", egg_hex_encode (session->key, session->n_key));
+		decoder->n_value = n_cipher;
+		return TRUE;
+	}
 #endif
 
-	gcry = gcry_cipher_setkey (cih, session->key, session->n_key);
-	g_return_val_if_fail (gcry == 0, NULL);
-
-	/* Copy the memory buffer */
-	n_padded = n_value;
-	padded = egg_secure_alloc (n_padded);
-	memcpy (padded, value, n_padded);
+	if (n_param != 16) {
+		g_message ("received an encrypted secret structure with invalid parameter");
+		return FALSE;
+	}
 
-	/* Perform the decryption */
-	for (pos = 0; pos < n_padded; pos += 16) {
-		gcry = gcry_cipher_decrypt (cih, (guchar*)padded + pos, 16, NULL, 0);
-		g_return_val_if_fail (gcry == 0, FALSE);
+	if (decoder->n_value == 0 || decoder->n_value % 16 != 0) {
+		g_message ("received an encrypted secret structure with bad secret length");
+		return FALSE;
 	}
 
-	gcry_cipher_close (cih);
+	/* As in decrypt_aes_secret() check the padding in the last block first */
+	gcry = gcry_cipher_setiv (decoder->cih, decoder->n_value > 16 ?
+	                          decoder->value + decoder->n_value - 32 : param, 16);
+	if (gcry == 0)
+		gcry = gcry_cipher_decrypt (decoder->cih, decoder->last, 16,
+		                            decoder->value + decoder->n_value - 16, 16);
+	if (gcry == 0)
+		gcry = gcry_cipher_setiv (decoder->cih, param, 16);
+	if (gcry != 0) {
+		g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+		return FALSE;
+	}
 
-	/* Unpad the resulting value */
-	if (!pkcs7_unpad_bytes_in_place (padded, &n_padded)) {
-		egg_secure_clear (padded, n_padded);
-		egg_secure_free (padded);
+	decoder->n_last = 16;
+	if (!pkcs7_unpad_bytes_in_place (decoder->last, &decoder->n_last)) {
 		g_message ("received an invalid or unencryptable secret");
 		return FALSE;
 	}
 
-	return secret_value_new_full ((gchar *)padded, n_padded, content_type, egg_secure_free);
+	/* The last block is handed out separately */
+	decoder->n_value -= 16;
+	return TRUE;
 }
 
 #endif /* WITH_GCRYPT */
 
-static SecretValue *
-service_decode_plain_secret (SecretSession *session,
-                             gconstpointer param,
-                             gsize n_param,
-                             gconstpointer value,
-                             gsize n_value,
-                             const gchar *content_type)
-{
-	if (n_param != 0) {
-		g_message ("received a plain secret structure with invalid parameter");
-		return NULL;
-	}
-
-	return secret_value_new (value, n_value, content_type);
-}
-
-SecretValue *
-_secret_session_decode_secret (SecretSession *session,
-                               GVariant *encoded)
+/* Takes ownership of @mapped, which holds the encrypted secret if not %NULL */
+static SecretSessionDecoder *
+session_decoder_new (SecretSession *session,
+                     GVariant *encoded,
+                     GMappedFile *mapped)
 {
-	SecretValue *result;
+	SecretSessionDecoder *decoder;
+	const gchar *session_path;
 	gconstpointer param;
-	gconstpointer value;
-	gchar *session_path;
-	gchar *content_type;
 	gsize n_param;
-	gsize n_value;
 	GVariant *vparam;
 	GVariant *vvalue;
+	gboolean ret = TRUE;
 
-	g_return_val_if_fail (session != NULL, NULL);
-	g_return_val_if_fail (encoded != NULL, NULL);
-
-	/* Parsing (oayays) */
-	g_variant_get_child (encoded, 0, "o", &session_path);
-
+	g_variant_get_child (encoded, 0, "&o", &session_path);
 	if (session_path == NULL || !g_str_equal (session_path, session->path)) {
 		g_message ("received a secret encoded with wrong session: %s != %s",
 		           session_path, session->path);
-		g_free (session_path);
+		if (mapped)
+			g_mapped_file_unref (mapped);
 		return NULL;
 	}
 
+	decoder = egg_secure_alloc (sizeof (SecretSessionDecoder));
+	decoder->encoded = g_variant_ref_sink (encoded);
+	decoder->mapped = mapped;
+
+	/* These point into the encoded data or the mapping, which we hold */
 	vparam = g_variant_get_child_value (encoded, 1);
 	param = g_variant_get_fixed_array (vparam, &n_param, sizeof (guchar));
-	vvalue = g_variant_get_child_value (encoded, 2);
-	value = g_variant_get_fixed_array (vvalue, &n_value, sizeof (guchar));
-	g_variant_get_child (encoded, 3, "s", &content_type);
+	if (mapped != NULL) {
+		decoder->value = (const guchar *)g_mapped_file_get_contents (mapped);
+		decoder->n_value = g_mapped_file_get_length (mapped);
+	} else {
+		vvalue = g_variant_get_child_value (encoded, 2);
+		decoder->value = g_variant_get_fixed_array (vvalue, &decoder->n_value, sizeof (guchar));
+		g_variant_unref (vvalue);
+	}
+	g_variant_get_child (encoded, 3, "&s", &decoder->content_type);
 
 #ifdef WITH_GCRYPT
-	if (session->key != NULL)
-		result = service_decode_aes_secret (session, param, n_param,
-		                                    value, n_value, content_type);
-	else
+	if (session->key != NULL) {
+		decoder->cih = session_cipher_new (session);
+		ret = decoder->cih != NULL &&
+		      decoder_setup_aes (session, decoder, param, n_param);
+	} else
 #endif
-		result = service_decode_plain_secret (session, param, n_param,
-		                                      value, n_value, content_type);
+	if (n_param != 0) {
+		g_message ("received a plain secret structure with invalid parameter");
+		ret = FALSE;
+	}
 
 	g_variant_unref (vparam);
-	g_variant_unref (vvalue);
-	g_free (content_type);
-	g_free (session_path);
 
-	return result;
-}
+	if (!ret) {
+		_secret_session_decoder_free (decoder);
+		return NULL;
+	}
 
-#ifdef WITH_GCRYPT
+	return decoder;
+}
 
-static guchar*
-pkcs7_pad_bytes_in_secure_memory (gconstpointer secret,
-                                  gsize length,
-                                  gsize *n_padded)
+/**
+ * _secret_session_decoder_new:
+ *
+ * Start decoding an (oayays) secret, a chunk at a time with
+ * _secret_session_decoder_next().
+ *
+ * Returns: the decoder, or %NULL if the secret is invalid
+ */
+SecretSessionDecoder *
+_secret_session_decoder_new (SecretSession *session,
+                             GVariant *encoded)
 {
-	gsize n_pad;
-	guchar *padded;
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (encoded != NULL, NULL);
 
-	/* Pad the secret */
-	*n_padded = ((length + 16) / 16) * 16;
-	g_assert (length < *n_padded);
-	g_assert (*n_padded > 0);
-	n_pad = *n_padded - length;
-	g_assert (n_pad > 0 && n_pad <= 16);
-	padded = egg_secure_alloc (*n_padded);
-	memcpy (padded, secret, length);
-	memset (padded + length, n_pad, n_pad);
-	return padded;
+	return session_decoder_new (session, encoded, NULL);
 }
 
-static gboolean
-service_encode_aes_secret (SecretSession *session,
-                           SecretValue *value,
-                           GVariantBuilder *builder)
+/**
+ * _secret_session_decoder_new_fd:
+ *
+ * Start decoding an (oayhs) secret, whose handle refers to a sealed memfd
+ * in @fds.
+ *
+ * Returns: the decoder, or %NULL if the secret is invalid
+ */
+SecretSessionDecoder *
+_secret_session_decoder_new_fd (SecretSession *session,
+                                GVariant *encoded,
+                                GUnixFDList *fds)
 {
-	gcry_cipher_hd_t cih;
-	guchar *padded;
-	gsize n_padded, pos;
-	gcry_error_t gcry;
-	gpointer iv;
-	gconstpointer secret;
-	gsize n_secret;
-	GVariant *child;
+#ifdef HAVE_MEMFD_CREATE
+	GMappedFile *mapped;
+	GError *error = NULL;
+	gint handle;
+	int seals;
+	int fd;
 
-	g_variant_builder_add (builder, "o", session->path);
+	g_return_val_if_fail (session != NULL, NULL);
+	g_return_val_if_fail (encoded != NULL, NULL);
+	g_return_val_if_fail (G_IS_UNIX_FD_LIST (fds), NULL);
 
-	/* Create the cipher */
-	gcry = gcry_cipher_open (&cih, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CBC, 0);
-	if (gcry != 0) {
-		g_warning ("couldn't create AES cipher: %s", gcry_strerror (gcry));
-		return FALSE;
+	g_variant_get_child (encoded, 2, "h", &handle);
+	fd = g_unix_fd_list_get (fds, handle, &error);
+	if (fd < 0) {
+		g_message ("received a secret with an invalid memfd: %s", error->message);
+		g_error_free (error);
+		return NULL;
 	}
 
-	secret = secret_value_get (value, &n_secret);
-
-	/* Perform the encoding here */
-	padded = pkcs7_pad_bytes_in_secure_memory (secret, n_secret, &n_padded);
-	g_assert (padded != NULL);
-
-	/* Setup the IV */
-	iv = g_malloc0 (16);
-	gcry_create_nonce (iv, 16);
-	gcry = gcry_cipher_setiv (cih, iv, 16);
-	g_return_val_if_fail (gcry == 0, FALSE);
-
-	/* Setup the key */
-	gcry = gcry_cipher_setkey (cih, session->key, session->n_key);
-	g_return_val_if_fail (gcry == 0, FALSE);
-
-	/* Perform the encryption */
-	for (pos = 0; pos < n_padded; pos += 16) {
-		gcry = gcry_cipher_encrypt (cih, (guchar*)padded + pos, 16, NULL, 0);
-		g_return_val_if_fail (gcry == 0, FALSE);
+	/*
+	 * GCM secrets are read twice, once to check them and once to decrypt,
+	 * so the service must not be able to change them in between.
+	 */
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		g_message ("received a secret in a memfd that isn't sealed");
+		close (fd);
+		return NULL;
 	}
 
-	gcry_cipher_close (cih);
-
-	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), iv, 16, TRUE, g_free, iv);
-	g_variant_builder_add_value (builder, child);
+	mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+	close (fd);
 
-	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), padded, n_padded, TRUE, egg_secure_free, padded);
-	g_variant_builder_add_value (builder, child);
+	if (mapped == NULL) {
+		g_message ("couldn't map received secret: %s", error->message);
+		g_error_free (error);
+		return NULL;
+	}
 
-	g_variant_builder_add (builder, "s", secret_value_get_content_type (value));
-	return TRUE;
+	return session_decoder_new (session, encoded, mapped);
+#else
+	g_return_val_if_reached (NULL);
+#endif
 }
 
-#endif /* WITH_GCRYPT */
+const gchar *
+_secret_session_decoder_get_content_type (SecretSessionDecoder *decoder)
+{
+	g_return_val_if_fail (decoder != NULL, NULL);
+	return decoder->content_type;
+}
 
-static gboolean
-service_encode_plain_secret (SecretSession *session,
-                             SecretValue *value,
-                             GVariantBuilder *builder)
+/**
+ * _secret_session_decoder_next:
+ *
+ * Decode the next part of the secret. The @chunk remains valid until the
+ * next call.
+ *
+ * Returns: the length of @chunk, zero at the end, or -1 on failure
+ */
+gssize
+_secret_session_decoder_next (SecretSessionDecoder *decoder,
+                              gconstpointer *chunk)
 {
-	gconstpointer secret;
-	gsize n_secret;
-	GVariant *child;
+	gsize n;
+#ifdef WITH_GCRYPT
+	gcry_error_t gcry;
+#endif
 
-	g_variant_builder_add (builder, "o", session->path);
+	g_return_val_if_fail (decoder != NULL, -1);
+	g_return_val_if_fail (chunk != NULL, -1);
 
-	secret = secret_value_get (value, &n_secret);
+	egg_secure_clear (decoder->chunk, sizeof (decoder->chunk));
 
-	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), "", 0, TRUE, NULL, NULL);
-	g_variant_builder_add_value (builder, child);
-	g_variant_unref (child);
+	if (decoder->offset == decoder->n_value) {
+#ifdef WITH_GCRYPT
+		/* The unpadded last CBC block, once */
+		if (decoder->n_last > 0) {
+			n = decoder->n_last;
+			memcpy (decoder->chunk, decoder->last, n);
+			egg_secure_clear (decoder->last, sizeof (decoder->last));
+			decoder->n_last = 0;
+			*chunk = decoder->chunk;
+			return n;
+		}
+#endif
+		return 0;
+	}
 
-	child = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), secret, n_secret, TRUE,
-	                                 secret_value_unref, secret_value_ref (value));
-	g_variant_builder_add_value (builder, child);
-	g_variant_unref (child);
+	n = MIN (decoder->n_value - decoder->offset, SECRET_SESSION_STREAM_CHUNK);
 
-	g_variant_builder_add (builder, "s", secret_value_get_content_type (value));
-	return TRUE;
+#ifdef WITH_GCRYPT
+	if (decoder->cih != NULL) {
+		gcry = gcry_cipher_decrypt (decoder->cih, decoder->chunk, n,
+		                            decoder->value + decoder->offset, n);
+		if (gcry != 0) {
+			g_warning ("couldn't decrypt AES secret: %s", gcry_strerror (gcry));
+			return -1;
+		}
+		*chunk = decoder->chunk;
+	} else
+#endif
+	{
+		/* Plain secrets are already in the message, or the mapping */
+		*chunk = decoder->value + decoder->offset;
+	}
+
+	decoder->offset += n;
+	return n;
 }
 
-GVariant *
-_secret_session_encode_secret (SecretSession *session,
-                               SecretValue *value)
+void
+_secret_session_decoder_free (SecretSessionDecoder *decoder)
 {
-	GVariantBuilder *builder;
-	GVariant *result = NULL;
-	GVariantType *type;
-	gboolean ret;
-
-	g_return_val_if_fail (session != NULL, NULL);
-	g_return_val_if_fail (value != NULL, NULL);
-
-	type = g_variant_type_new ("(oayays)");
-	builder = g_variant_builder_new (type);
+	if (decoder == NULL)
+		return;
 
 #ifdef WITH_GCRYPT
-	if (session->key)
-		ret = service_encode_aes_secret (session, value, builder);
-	else
+	if (decoder->cih)
+		gcry_cipher_close (decoder->cih);
 #endif
-		ret = service_encode_plain_secret (session, value, builder);
-	if (ret)
-		result = g_variant_builder_end (builder);
-
-	g_variant_builder_unref (builder);
-	g_variant_type_free (type);
-	return result;
+	g_variant_unref (decoder->encoded);
+	if (decoder->mapped)
+		g_mapped_file_unref (decoder->mapped);
+	egg_secure_free (decoder);
 }
 
 const gchar *
@@ -665,3 +2529,150 @@ _secret_session_get_path (SecretSession *session)
 	g_return_val_if_fail (session != NULL, NULL);
 	return session->path;
 }
+
+/*
+ * Secrets can be sent in a sealed memfd rather than in the message
+ * itself, if the service supports the FdTransfer extension. This saves
+ * copying large secrets in and out of messages, and through the bus. It's
+ * negotiated once per session, the first time it's needed.
+ *
+ * The extension isn't part of the Secret Service spec, and the usual
+ * services don't have it. So this is off by default, and is enabled by
+ * setting the SECRET_FD_TRANSFER environment variable to 1. Otherwise no
+ * Negotiate() call is made at all.
+ */
+
+static gboolean fd_transfer_enabled = FALSE;
+
+static void
+fd_transfer_init (void)
+{
+	static volatile gsize initialized = 0;
+	const gchar *env;
+
+	if (g_once_init_enter (&initialized)) {
+		env = g_getenv ("SECRET_FD_TRANSFER");
+		if (env != NULL && g_str_equal (env, "1"))
+			g_atomic_int_set (&fd_transfer_enabled, TRUE);
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+void
+_secret_session_set_fd_transfer (gboolean enabled)
+{
+	fd_transfer_init ();
+	g_atomic_int_set (&fd_transfer_enabled, enabled);
+}
+
+static gboolean
+session_fd_transfer_possible (SecretService *service)
+{
+#ifdef HAVE_MEMFD_CREATE
+	GDBusConnection *connection;
+
+	fd_transfer_init ();
+	if (!g_atomic_int_get (&fd_transfer_enabled))
+		return FALSE;
+
+	connection = g_dbus_proxy_get_connection (G_DBUS_PROXY (service));
+	return (g_dbus_connection_get_capabilities (connection) &
+	        G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING) != 0;
+#else
+	return FALSE;
+#endif
+}
+
+static void
+on_negotiate_fd (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+	GSimpleAsyncResult *res = G_SIMPLE_ASYNC_RESULT (user_data);
+	SecretService *service = SECRET_SERVICE (g_async_result_get_source_object (user_data));
+	const gchar *path = g_simple_async_result_get_op_res_gpointer (res);
+	SecretSession *session;
+	GError *error = NULL;
+	GVariant *retval;
+	gint transfer;
+
+	retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+
+	/* Services without the extension don't know the method */
+	transfer = retval != NULL ? FD_TRANSFER_YES : FD_TRANSFER_NO;
+
+	/* Remember it, unless the session has changed in the meantime */
+	session = _secret_service_get_session (service);
+	if (session != NULL && g_str_equal (session->path, path) &&
+	    !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_atomic_int_set (&session->fd_transfer, transfer);
+
+	/* Replaces the path */
+	g_simple_async_result_set_op_res_gboolean (res, retval != NULL);
+
+	g_clear_error (&error);
+	if (retval != NULL)
+		g_variant_unref (retval);
+
+	g_simple_async_result_complete (res);
+	g_object_unref (service);
+	g_object_unref (res);
+}
+
+/**
+ * _secret_session_negotiate_fd:
+ *
+ * Find out whether the current session of @service can transfer secrets
+ * in a memfd. The session must already be open.
+ */
+void
+_secret_session_negotiate_fd (SecretService *service,
+                              GCancellable *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer user_data)
+{
+	GSimpleAsyncResult *res;
+	SecretSession *session;
+	gint transfer;
+
+	g_return_if_fail (SECRET_IS_SERVICE (service));
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	session = _secret_service_get_session (service);
+	g_return_if_fail (session != NULL);
+
+	res = g_simple_async_result_new (G_OBJECT (service), callback, user_data,
+	                                 _secret_session_negotiate_fd);
+
+	transfer = g_atomic_int_get (&session->fd_transfer);
+	if (transfer == FD_TRANSFER_UNKNOWN && !session_fd_transfer_possible (service))
+		transfer = FD_TRANSFER_NO;
+
+	if (transfer != FD_TRANSFER_UNKNOWN) {
+		g_simple_async_result_set_op_res_gboolean (res, transfer == FD_TRANSFER_YES);
+		g_simple_async_result_complete_in_idle (res);
+
+	} else {
+		g_simple_async_result_set_op_res_gpointer (res, g_strdup (session->path), g_free);
+		g_dbus_connection_call (g_dbus_proxy_get_connection (G_DBUS_PROXY (service)),
+		                        g_dbus_proxy_get_name (G_DBUS_PROXY (service)),
+		                        session->path, SECRET_FD_TRANSFER_INTERFACE, "Negotiate",
+		                        g_variant_new ("()"), G_VARIANT_TYPE ("()"),
+		                        G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, cancellable,
+		                        on_negotiate_fd, g_object_ref (res));
+	}
+
+	g_object_unref (res);
+}
+
+/**
+ * _secret_session_negotiate_fd_finish:
+ *
+ * Returns: whether secrets can be transferred in a memfd
+ */
+gboolean
+_secret_session_negotiate_fd_finish (GAsyncResult *result)
+{
+	g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), FALSE);
+	return g_simple_async_result_get_op_res_gboolean (G_SIMPLE_ASYNC_RESULT (result));
+}
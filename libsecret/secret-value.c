@@ -52,12 +52,30 @@
 
 EGG_SECURE_DECLARE (secret_value);
 
+/* Secrets up to this size are stored inline, see secret_value_new() */
+#define VALUE_INLINE_MAX 256
+
+/*
+ * How the SecretValue structure itself was allocated. Inline values are
+ * one secure allocation, with the secret data right after the structure.
+ * Shared values live in memory owned by someone else, such as a region of
+ * decoded secrets, which is released by the destroy function.
+ */
+enum {
+	VALUE_SLICE,
+	VALUE_INLINE,
+	VALUE_SHARED
+};
+
 struct _SecretValue {
 	gint refs;
+	guint storage;
 	gpointer secret;
 	gsize length;
 	GDestroyNotify destroy;
-	gchar *content_type;
+	gpointer destroy_data;
+	const gchar *content_type;
+	gboolean owns_content_type;
 };
 
 GType
@@ -76,6 +94,61 @@ secret_value_get_type (void)
 	return type;
 }
 
+/*
+ * Almost every secret has one of the well known content types, which don't
+ * need a copy. Anything else comes from the service or the caller, and is
+ * copied, so that it is freed along with the value.
+ */
+static void
+value_set_content_type (SecretValue *value,
+                        const gchar *content_type)
+{
+	if (g_str_equal (content_type, "text/plain")) {
+		value->content_type = "text/plain";
+		value->owns_content_type = FALSE;
+	} else if (g_str_equal (content_type, "application/octet-stream")) {
+		value->content_type = "application/octet-stream";
+		value->owns_content_type = FALSE;
+	} else {
+		value->content_type = g_strdup (content_type);
+		value->owns_content_type = TRUE;
+	}
+}
+
+static void
+value_free_content_type (SecretValue *value)
+{
+	if (value->owns_content_type)
+		g_free ((gchar *)value->content_type);
+	value->content_type = NULL;
+	value->owns_content_type = FALSE;
+}
+
+static void
+secret_value_free (SecretValue *value)
+{
+	guint storage = value->storage;
+	GDestroyNotify destroy = value->destroy;
+	gpointer destroy_data = value->destroy_data;
+
+	value_free_content_type (value);
+
+	/* Nothing else clears a shared slot, the region is freed with the last one */
+	if (storage == VALUE_SHARED) {
+		egg_secure_clear (value->secret, value->length);
+		egg_secure_clear (value, sizeof (SecretValue));
+	}
+
+	/* This may release the memory a shared value lives in */
+	if (destroy)
+		(destroy) (destroy_data);
+
+	if (storage == VALUE_SLICE)
+		g_slice_free (SecretValue, value);
+	else if (storage == VALUE_INLINE)
+		egg_secure_free (value);
+}
+
 /**
  * secret_value_new:
  * @secret: the secret data
@@ -95,6 +168,7 @@ secret_value_new (const gchar *secret,
                   gssize length,
                   const gchar *content_type)
 {
+	SecretValue *value;
 	gchar *copy;
 
 	g_return_val_if_fail (length == 0 || secret != NULL, NULL);
@@ -103,11 +177,29 @@ secret_value_new (const gchar *secret,
 	if (length < 0)
 		length = strlen (secret);
 
-	copy = egg_secure_alloc (length + 1);
+	/* Large secrets get a secure allocation of their own */
+	if (length > VALUE_INLINE_MAX) {
+		copy = egg_secure_alloc (length + 1);
+		if (secret)
+			memcpy (copy, secret, length);
+		copy[length] = 0;
+		return secret_value_new_full (copy, length, content_type, egg_secure_free);
+	}
+
+	/* The value and its copy of the secret in one allocation */
+	value = egg_secure_alloc (sizeof (SecretValue) + length + 1);
+	copy = (gchar *)(value + 1);
 	if (secret)
 		memcpy (copy, secret, length);
 	copy[length] = 0;
-	return secret_value_new_full (copy, length, content_type, egg_secure_free);
+
+	value->refs = 1;
+	value->storage = VALUE_INLINE;
+	value_set_content_type (value, content_type);
+	value->secret = copy;
+	value->length = length;
+
+	return value;
 }
 
 /**
@@ -140,8 +232,99 @@ secret_value_new_full (gchar *secret,
 
 	value = g_slice_new0 (SecretValue);
 	value->refs = 1;
-	value->content_type = g_strdup (content_type);
+	value->storage = VALUE_SLICE;
+	value_set_content_type (value, content_type);
+	value->destroy = destroy;
+	value->destroy_data = secret;
+	value->length = length;
+	value->secret = secret;
+
+	return value;
+}
+
+/**
+ * secret_value_new_from_bytes:
+ * @bytes: the secret data
+ * @content_type: the content type of the data
+ *
+ * Create a #SecretValue which shares the secret data in @bytes, without
+ * copying it. A reference to @bytes is held for as long as the value.
+ *
+ * Unlike secret_value_new(), the secret data is not moved into
+ * non-pageable 'secure' memory, and is only as safe as @bytes is.
+ *
+ * Returns: (transfer full): the new #SecretValue
+ */
+SecretValue *
+secret_value_new_from_bytes (GBytes *bytes,
+                             const gchar *content_type)
+{
+	SecretValue *value;
+	gconstpointer data;
+	gsize length;
+
+	g_return_val_if_fail (bytes != NULL, NULL);
+	g_return_val_if_fail (content_type, NULL);
+
+	data = g_bytes_get_data (bytes, &length);
+	if (data == NULL)
+		data = "";
+
+	value = secret_value_new_full ((gchar *)data, length, content_type,
+	                               (GDestroyNotify)g_bytes_unref);
+	value->destroy_data = g_bytes_ref (bytes);
+
+	return value;
+}
+
+/**
+ * secret_value_get_bytes:
+ * @value: the value
+ *
+ * Get the secret data in the #SecretValue as #GBytes, without copying it.
+ * The #GBytes holds a reference to the value, or is the #GBytes that the
+ * value was created from.
+ *
+ * Returns: (transfer full): the secret data
+ */
+GBytes *
+secret_value_get_bytes (SecretValue *value)
+{
+	g_return_val_if_fail (value, NULL);
+
+	if (value->storage == VALUE_SLICE && value->destroy == (GDestroyNotify)g_bytes_unref)
+		return g_bytes_ref (value->destroy_data);
+
+	return g_bytes_new_with_free_func (value->secret, value->length,
+	                                   secret_value_unref, secret_value_ref (value));
+}
+
+/* Room needed for the structure of a shared value */
+gsize
+_secret_value_shared_size (void)
+{
+	return sizeof (SecretValue);
+}
+
+/*
+ * The value is placed at @memory, which like the secret data, belongs to
+ * @destroy_data. Both are released by @destroy along with the value.
+ */
+SecretValue *
+_secret_value_new_shared (gpointer memory,
+                          gchar *secret,
+                          gsize length,
+                          const gchar *content_type,
+                          GDestroyNotify destroy,
+                          gpointer destroy_data)
+{
+	SecretValue *value = memory;
+
+	value->refs = 1;
+	value->storage = VALUE_SHARED;
+	value_set_content_type (value, content_type);
 	value->destroy = destroy;
+	value->destroy_data = destroy_data;
 	value->length = length;
 	value->secret = secret;
 
@@ -216,12 +399,8 @@ secret_value_unref (gpointer value)
 
 	g_return_if_fail (value != NULL);
 
-	if (g_atomic_int_dec_and_test (&val->refs)) {
-		g_free (val->content_type);
-		if (val->destroy)
-			(val->destroy) (val->secret);
-		g_slice_free (SecretValue, val);
-	}
+	if (g_atomic_int_dec_and_test (&val->refs))
+		secret_value_free (val);
 }
 
 static gboolean
@@ -241,6 +420,8 @@ gchar *
 _secret_value_unref_to_password (SecretValue *value)
 {
 	SecretValue *val = value;
+	gchar *secret;
+	gsize length;
 	gchar *result;
 
 	g_return_val_if_fail (value != NULL, NULL);
@@ -251,16 +432,27 @@ _secret_value_unref_to_password (SecretValue *value)
 	}
 
 	if (g_atomic_int_dec_and_test (&val->refs)) {
-		if (val->destroy == egg_secure_free) {
+		if (val->storage == VALUE_INLINE) {
+			/*
+			 * Move the password to the start of the allocation, and clear
+			 * the rest. The move overwrites the structure, so don't use it.
+			 */
+			value_free_content_type (val);
+			secret = val->secret;
+			length = val->length;
+			result = (gchar *)val;
+			memmove (result, secret, length + 1);
+			memset (result + length + 1, 0, sizeof (SecretValue));
+
+		} else if (val->storage == VALUE_SLICE && val->destroy == egg_secure_free) {
 			result = val->secret;
+			value_free_content_type (val);
+			g_slice_free (SecretValue, val);
 
 		} else {
 			result = egg_secure_strndup (val->secret, val->length);
-			if (val->destroy)
-				(val->destroy) (val->secret);
+			secret_value_free (val);
 		}
-		g_free (val->content_type);
-		g_slice_free (SecretValue, val);
 
 	} else {
 		result = egg_secure_strndup (val->secret, val->length);
@@ -283,16 +475,15 @@ _secret_value_unref_to_string (SecretValue *value)
 	}
 
 	if (g_atomic_int_dec_and_test (&val->refs)) {
-		if (val->destroy == g_free) {
+		if (val->storage == VALUE_SLICE && val->destroy == g_free) {
 			result = val->secret;
+			value_free_content_type (val);
+			g_slice_free (SecretValue, val);
 
 		} else {
 			result = g_strndup (val->secret, val->length);
-			if (val->destroy)
-				(val->destroy) (val->secret);
+			secret_value_free (val);
 		}
-		g_free (val->content_type);
-		g_slice_free (SecretValue, val);
 
 	} else {
 		result = g_strndup (val->secret, val->length);
@@ -40,9 +40,14 @@ SecretValue *       secret_value_new_full          (gchar *secret,
                                                     const gchar *content_type,
                                                     GDestroyNotify destroy);
 
+SecretValue *       secret_value_new_from_bytes    (GBytes *bytes,
+                                                    const gchar *content_type);
+
 const gchar *       secret_value_get               (SecretValue *value,
                                                     gsize *length);
 
+GBytes *            secret_value_get_bytes         (SecretValue *value);
+
 const gchar *       secret_value_get_content_type  (SecretValue *value);
 
 SecretValue *       secret_value_ref               (SecretValue *value);
@@ -35,6 +35,7 @@
 #include <libsecret/secret-collection.h>
 #include <libsecret/secret-enum-types.h>
 #include <libsecret/secret-item.h>
+#include <libsecret/secret-lookup.h>
 #include <libsecret/secret-paths.h>
 #include <libsecret/secret-prompt.h>
 #include <libsecret/secret-service.h>
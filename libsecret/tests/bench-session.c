@@ -0,0 +1,226 @@
+/* libsecret - GLib wrapper for Secret Service
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#include "config.h"
+
+#include "secret-item.h"
+#include "secret-paths.h"
+#include "secret-service.h"
+#include "secret-private.h"
+
+#include "mock-service.h"
+
+#include "egg/egg-secure-memory.h"
+#include "egg/tests/egg-bench.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	SecretSession *session;
+	SecretValue *value;
+	GVariant *encoded;
+} TransferBench;
+
+static void
+bench_encode (gpointer data)
+{
+	TransferBench *bench = data;
+	GVariant *encoded;
+
+	encoded = _secret_session_encode_secret (bench->session, bench->value);
+	g_assert (encoded != NULL);
+	g_variant_unref (g_variant_ref_sink (encoded));
+}
+
+static void
+bench_decode (gpointer data)
+{
+	TransferBench *bench = data;
+	SecretValue *decoded;
+
+	decoded = _secret_session_decode_secret (bench->session, bench->encoded);
+	g_assert (decoded != NULL);
+	secret_value_unref (decoded);
+}
+
+static void
+bench_open_session (gpointer unused)
+{
+	SecretService *service;
+	GError *error = NULL;
+
+	service = secret_service_new_sync (SECRET_TYPE_SERVICE, NULL,
+	                                   SECRET_SERVICE_OPEN_SESSION, NULL, &error);
+	g_assert_no_error (error);
+	g_object_unref (service);
+}
+
+static void
+bench_session (const gchar *mock_script)
+{
+	SecretService *service;
+	TransferBench bench;
+	const gchar *algorithms;
+	GError *error = NULL;
+	gchar *secret;
+	gchar *param;
+	gsize length;
+
+	mock_service_start (mock_script, &error);
+	g_assert_no_error (error);
+
+	service = secret_service_new_sync (SECRET_TYPE_SERVICE, NULL,
+	                                   SECRET_SERVICE_OPEN_SESSION, NULL, &error);
+	g_assert_no_error (error);
+
+	algorithms = secret_service_get_session_algorithms (service);
+	bench.session = _secret_service_get_session (service);
+	g_assert (bench.session != NULL);
+
+	egg_bench_run ("open-session", algorithms, bench_open_session, NULL);
+
+	for (length = 16; length <= 1024 * 1024; length *= 4) {
+		secret = g_malloc (length);
+		memset (secret, 'x', length);
+		bench.value = secret_value_new (secret, length, "application/octet-stream");
+		bench.encoded = g_variant_ref_sink (_secret_session_encode_secret (bench.session, bench.value));
+		g_free (secret);
+
+		param = g_strdup_printf ("%s/%" G_GSIZE_FORMAT, algorithms, length);
+		egg_bench_run ("session-encode", param, bench_encode, &bench);
+		egg_bench_run ("session-decode", param, bench_decode, &bench);
+		g_free (param);
+
+		g_variant_unref (bench.encoded);
+		secret_value_unref (bench.value);
+	}
+
+	g_object_unref (service);
+	mock_service_stop ();
+}
+
+typedef struct {
+	SecretService *service;
+	SecretItem *item;
+	const gchar *item_path;
+	gchar *secret;
+	gsize length;
+} StreamBench;
+
+static void
+bench_set_from_stream (gpointer data)
+{
+	StreamBench *bench = data;
+	GInputStream *stream;
+	GError *error = NULL;
+
+	stream = g_memory_input_stream_new_from_data (bench->secret, bench->length, NULL);
+	secret_item_set_secret_from_stream_sync (bench->item, stream, "application/octet-stream",
+	                                         NULL, &error);
+	g_assert_no_error (error);
+	g_object_unref (stream);
+}
+
+static void
+bench_get_to_stream (gpointer data)
+{
+	StreamBench *bench = data;
+	GOutputStream *stream;
+	GError *error = NULL;
+
+	stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+	secret_service_get_secret_for_dbus_path_to_stream_sync (bench->service, bench->item_path,
+	                                                        stream, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpuint (g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (stream)), ==, bench->length);
+	g_object_unref (stream);
+}
+
+/*
+ * Large secrets through the stream API, once with the secret inside the
+ * D-Bus message and once passed in a memfd. Throughput is the ops/sec
+ * column times the size.
+ */
+static void
+bench_stream (const gchar *mock_script,
+              const gchar *transfer)
+{
+	StreamBench bench;
+	GError *error = NULL;
+	gchar *param;
+
+	mock_service_start (mock_script, &error);
+	g_assert_no_error (error);
+
+	bench.service = secret_service_new_sync (SECRET_TYPE_SERVICE, NULL,
+	                                         SECRET_SERVICE_OPEN_SESSION, NULL, &error);
+	g_assert_no_error (error);
+
+	bench.item_path = "/org/freedesktop/secrets/collection/english/1";
+	bench.item = secret_item_new_for_dbus_path_sync (bench.service, bench.item_path,
+	                                                 SECRET_ITEM_NONE, NULL, &error);
+	g_assert_no_error (error);
+
+	for (bench.length = 1024 * 1024; bench.length <= 64 * 1024 * 1024; bench.length *= 4) {
+		bench.secret = g_malloc (bench.length);
+		memset (bench.secret, 'x', bench.length);
+
+		param = g_strdup_printf ("%s/%" G_GSIZE_FORMAT, transfer, bench.length);
+		egg_bench_run ("stream-set", param, bench_set_from_stream, &bench);
+		egg_bench_run ("stream-get", param, bench_get_to_stream, &bench);
+		g_free (param);
+
+		g_free (bench.secret);
+	}
+
+	g_object_unref (bench.item);
+	g_object_unref (bench.service);
+	mock_service_stop ();
+}
+
+int
+main (int argc, char **argv)
+{
+	const gchar *scripts[] = {
+		"mock-service-only-plain.py",
+		"mock-service-normal.py",
+#ifdef WITH_GCRYPT
+		"mock-service-x25519.py",
+		"mock-service-gcm.py",
+#endif
+	};
+	guint i;
+
+	g_set_prgname ("bench-session");
+#if !GLIB_CHECK_VERSION(2,35,0)
+	g_type_init ();
+#endif
+
+	egg_bench_init ();
+
+	printf ("# name\tparameter\titerations\tops/sec\tlocks/op\n");
+
+	for (i = 0; i < G_N_ELEMENTS (scripts); i++)
+		bench_session (scripts[i]);
+
+	bench_stream ("mock-service-only-plain.py", "ay");
+#ifdef HAVE_MEMFD_CREATE
+	_secret_session_set_fd_transfer (TRUE);
+	bench_stream ("mock-service-fd-plain.py", "fd");
+	_secret_session_set_fd_transfer (FALSE);
+#endif
+
+	return 0;
+}
@@ -90,3 +90,30 @@ mock_service_stop (void)
 	g_spawn_close_pid (pid);
 	pid = 0;
 }
+
+/* The argument of each call to @method the mock service has seen, in order */
+gchar **
+mock_service_get_calls (const gchar *method)
+{
+	GDBusConnection *connection;
+	GError *error = NULL;
+	GVariant *retval;
+	gchar **calls;
+
+	g_return_val_if_fail (method != NULL, NULL);
+
+	connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+	g_assert_no_error (error);
+
+	retval = g_dbus_connection_call_sync (connection, MOCK_SERVICE_NAME, SECRET_SERVICE_PATH,
+	                                      "org.freedesktop.Secret.MockService", "GetCalls",
+	                                      g_variant_new ("(s)", method), G_VARIANT_TYPE ("(as)"),
+	                                      G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+	g_assert_no_error (error);
+
+	g_variant_get (retval, "(^as)", &calls);
+	g_variant_unref (retval);
+	g_object_unref (connection);
+
+	return calls;
+}
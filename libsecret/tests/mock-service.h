@@ -24,4 +24,6 @@ gboolean      mock_service_start     (const gchar *mock_script,
 
 void          mock_service_stop      (void);
 
+gchar **      mock_service_get_calls (const gchar *method);
+
 #endif /* _MOCK_SERVICE_H_ */
@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+
+#
+# Copyright 2013 Red Hat Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published
+# by the Free Software Foundation; either version 2.1 of the licence or (at
+# your option) any later version.
+#
+# See the included COPYING file for more information.
+#
+
+#
+# AES-GCM from NIST SP 800-38D, for a 96 bit IV and 128 bit tag. This is
+# slow, and only meant for testing.
+#
+
+import aes
+
+def _number(block):
+	return int("".join(["%02x" % b for b in block]), 16)
+
+def _block(number):
+	return [(number >> (8 * (15 - i))) & 0xff for i in range(16)]
+
+R = 0xe1 << 120
+
+def _multiply(x, y):
+	z = 0
+	v = x
+	for i in range(127, -1, -1):
+		if (y >> i) & 1:
+			z ^= v
+		if v & 1:
+			v = (v >> 1) ^ R
+		else:
+			v >>= 1
+	return z
+
+def _ghash(h, aad, ciph):
+	y = 0
+	for data in (aad, ciph):
+		for i in range(0, len(data), 16):
+			chunk = data[i:i + 16]
+			chunk = chunk + [0] * (16 - len(chunk))
+			y = _multiply(y ^ _number(chunk), h)
+	lengths = ((len(aad) * 8) << 64) | (len(ciph) * 8)
+	return _multiply(y ^ lengths, h)
+
+def _cipher(key, block):
+	return aes.AES().encrypt(block, key, len(key))
+
+def _counter(key, iv, data, start):
+	result = []
+	for i in range(0, len(data), 16):
+		counter = iv + _block(start + i // 16)[12:]
+		stream = _cipher(key, counter)
+		result += [a ^ b for (a, b) in zip(data[i:i + 16], stream)]
+	return result
+
+def _tag(key, iv, aad, ciph):
+	h = _number(_cipher(key, [0] * 16))
+	s = _ghash(h, aad, ciph)
+	return [a ^ b for (a, b) in zip(_block(s), _cipher(key, iv + [0, 0, 0, 1]))]
+
+def encrypt(key, iv, data, aad=""):
+	key = map(ord, key)
+	iv = map(ord, iv)
+	ciph = _counter(key, iv, map(ord, data), 2)
+	tag = _tag(key, iv, map(ord, aad), ciph)
+	return "".join([chr(i) for i in ciph + tag])
+
+def decrypt(key, iv, data, aad=""):
+	if len(data) < 16:
+		raise ValueError("GCM data too short")
+	key = map(ord, key)
+	iv = map(ord, iv)
+	data = map(ord, data)
+	ciph, tag = data[:-16], data[-16:]
+	if _tag(key, iv, map(ord, aad), ciph) != tag:
+		raise ValueError("GCM tag does not match")
+	return "".join([chr(i) for i in _counter(key, iv, ciph, 2)])
@@ -11,6 +11,8 @@
 # See the included COPYING file for more information.
 #
 
+import ctypes
+import fcntl
 import getopt
 import os
 import sys
@@ -19,7 +21,9 @@ import unittest
 
 import aes
 import dh
+import gcm
 import hkdf
+import x25519
 
 import dbus
 import dbus.service
@@ -27,6 +31,8 @@ import dbus.glib
 import gobject
 
 COLLECTION_PREFIX = "/org/freedesktop/secrets/collection/"
+FD_TRANSFER_IFACE = "org.gnome.libsecret.FdTransfer"
+MOCK_IFACE = "org.freedesktop.Secret.MockService"
 
 bus_name = 'org.freedesktop.Secret.MockService'
 ready_pipe = -1
@@ -65,6 +71,44 @@ def hex_encode(string):
 def alias_path(name):
 	return "/org/freedesktop/secrets/aliases/%s" % name
 
+# memfd_create(2) and file sealing, which python doesn't wrap for us
+MFD_CLOEXEC = 0x0001
+MFD_ALLOW_SEALING = 0x0002
+F_ADD_SEALS = 1033
+F_GET_SEALS = 1034
+F_SEAL_SEAL = 0x0001
+F_SEAL_SHRINK = 0x0002
+F_SEAL_GROW = 0x0004
+F_SEAL_WRITE = 0x0008
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+def memfd_supported():
+	return hasattr(libc, "memfd_create")
+
+def memfd_write(data):
+	fd = libc.memfd_create("mock-secret", MFD_CLOEXEC | MFD_ALLOW_SEALING)
+	if fd < 0:
+		raise OSError(ctypes.get_errno(), "couldn't create memfd")
+	offset = 0
+	while offset < len(data):
+		offset += os.write(fd, buffer(data, offset, 1024 * 1024))
+	fcntl.fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+	return fd
+
+def memfd_read(fd):
+	seals = fcntl.fcntl(fd, F_GET_SEALS)
+	if seals & (F_SEAL_SHRINK | F_SEAL_WRITE) != (F_SEAL_SHRINK | F_SEAL_WRITE):
+		raise InvalidArgs("secret memfd is not sealed")
+	os.lseek(fd, 0, os.SEEK_SET)
+	chunks = [ ]
+	while True:
+		chunk = os.read(fd, 1024 * 1024)
+		if not chunk:
+			break
+		chunks.append(chunk)
+	return "".join(chunks)
+
 class PlainAlgorithm():
 	def negotiate(self, service, sender, param):
 		if type (param) != dbus.String:
@@ -72,11 +116,11 @@ class PlainAlgorithm():
 		session = SecretSession(service, sender, self, None)
 		return (dbus.String("", variant_level=1), session)
 
-	def encrypt(self, key, data):
+	def encrypt(self, key, data, content_type):
 		return ("", data)
 
-	def decrypt(self, param, data):
-		if params == "":
+	def decrypt(self, key, param, data, content_type):
+		if param != "":
 			raise InvalidArgs("invalid secret plain parameter")
 		return data
 
@@ -85,18 +129,25 @@ class AesAlgorithm():
 	def negotiate(self, service, sender, param):
 		if type (param) != dbus.ByteArray:
 			raise InvalidArgs("invalid argument passed to OpenSession")
+		(ikm, publi) = self.exchange(param)
+		# print "  mock ikm: ", hex_encode(ikm)
+		key = self.derive_key(ikm)
+		# print "  mock key: ", hex_encode(key)
+		session = SecretSession(service, sender, self, key)
+		return (dbus.ByteArray(publi, variant_level=1), session)
+
+	def exchange(self, param):
 		privat, publi = dh.generate_pair()
 		peer = dh.bytes_to_number(param)
 		# print "mock publi: ", hex(publi)
 		# print " mock peer: ", hex(peer)
 		ikm = dh.derive_key(privat, peer)
-		# print "  mock ikm: ", hex_encode(ikm)
-		key = hkdf.hkdf(ikm, 16)
-		# print "  mock key: ", hex_encode(key)
-		session = SecretSession(service, sender, self, key)
-		return (dbus.ByteArray(dh.number_to_bytes(publi), variant_level=1), session)
+		return (ikm, dh.number_to_bytes(publi))
 
-	def encrypt(self, key, data):
+	def derive_key(self, ikm):
+		return hkdf.hkdf(ikm, 16)
+
+	def encrypt(self, key, data, content_type):
 		key = map(ord, key)
 		data = aes.append_PKCS7_padding(data)
 		keysize = len(key)
@@ -107,7 +158,7 @@ class AesAlgorithm():
 		return ("".join([chr(i) for i in iv]),
 		        "".join([chr(i) for i in ciph]))
 
-	def decrypt(self, key, param, data):
+	def decrypt(self, key, param, data, content_type):
 		key = map(ord, key)
 		keysize = len(key)
 		iv = map(ord, param[:16])
@@ -118,6 +169,44 @@ class AesAlgorithm():
 		return aes.strip_PKCS7_padding(decr)
 
 
+class AesGcmAlgorithm(AesAlgorithm):
+	def __init__(self, name):
+		self.name = name
+
+	def derive_key(self, ikm):
+		return hkdf.hkdf(ikm, 16, info=self.name)
+
+	def encrypt(self, key, data, content_type):
+		iv = os.urandom(12)
+		return (iv, gcm.encrypt(key, iv, data, content_type))
+
+	def decrypt(self, key, param, data, content_type):
+		if len(param) != 12:
+			raise InvalidArgs("invalid secret GCM parameter")
+		try:
+			return gcm.decrypt(key, param, data, content_type)
+		except ValueError:
+			raise InvalidArgs("invalid secret GCM data")
+
+
+class X25519Exchange():
+	def exchange(self, param):
+		privat, publi = x25519.generate_pair()
+		try:
+			ikm = x25519.derive_key(privat, param)
+		except ValueError:
+			raise InvalidArgs("invalid X25519 public key passed to OpenSession")
+		return (ikm, publi)
+
+
+class X25519AesAlgorithm(X25519Exchange, AesAlgorithm):
+	pass
+
+
+class X25519AesGcmAlgorithm(X25519Exchange, AesGcmAlgorithm):
+	pass
+
+
 class SecretPrompt(dbus.service.Object):
 	def __init__(self, service, sender, prompt_name=None, delay=0,
 	             dismiss=False, action=None):
@@ -165,13 +254,14 @@ class SecretSession(dbus.service.Object):
 		self.service = service
 		self.algorithm = algorithm
 		self.key = key
+		self.fd_transfer = False
 		self.path = "/org/freedesktop/secrets/sessions/%s" % next_identifier('s')
 		dbus.service.Object.__init__(self, service.bus_name, self.path)
 		service.add_session(self)
 		objects[self.path] = self
 
 	def encode_secret(self, secret, content_type):
-		(params, data) = self.algorithm.encrypt(self.key, secret)
+		(params, data) = self.algorithm.encrypt(self.key, secret, content_type)
 		# print "   mock iv: ", hex_encode(params)
 		# print " mock ciph: ", hex_encode(data)
 		return dbus.Struct((dbus.ObjectPath(self.path), dbus.ByteArray(params),
@@ -179,7 +269,7 @@ class SecretSession(dbus.service.Object):
 		                   signature="oayays")
 
 	def decode_secret(self, value):
-		plain = self.algorithm.decrypt(self.key, value[1], value[2])
+		plain = self.algorithm.decrypt(self.key, value[1], value[2], value[3])
 		return (plain, value[3])
 
 	@dbus.service.method('org.freedesktop.Secret.Session')
@@ -187,8 +277,47 @@ class SecretSession(dbus.service.Object):
 		self.remove_from_connection()
 		self.service.remove_session(self)
 
+	@dbus.service.method(FD_TRANSFER_IFACE)
+	def Negotiate(self):
+		self.service.add_call("Negotiate", self.path)
+		if not self.service.fd_transfer or not memfd_supported():
+			raise NotSupported("fd transfer is not supported")
+		self.fd_transfer = True
+
+
+
+class FdTransferItem(dbus.service.Object):
+	# The methods have the same names as those on the Item interface, so
+	# they have to live in a class of their own
 
-class SecretItem(dbus.service.Object):
+	@dbus.service.method(FD_TRANSFER_IFACE, sender_keyword='sender', out_signature='(oayhs)')
+	def GetSecret(self, session_path, sender=None):
+		session = objects.get(session_path, None)
+		if not session or not session.fd_transfer:
+			raise NotSupported("fd transfer not negotiated: %s" % session_path)
+		encoded = SecretItem.GetSecret(self, session_path, sender)
+		fd = memfd_write(str(encoded[2]))
+		try:
+			return dbus.Struct((encoded[0], encoded[1], dbus.types.UnixFd(fd), encoded[3]),
+			                   signature="oayhs")
+		finally:
+			os.close(fd)
+
+	@dbus.service.method(FD_TRANSFER_IFACE, sender_keyword='sender', byte_arrays=True)
+	def SetSecret(self, secret, sender=None):
+		session = objects.get(secret[0], None)
+		if not session or not session.fd_transfer:
+			raise NotSupported("fd transfer not negotiated: %s" % secret[0])
+		fd = secret[2].take()
+		try:
+			data = memfd_read(fd)
+		finally:
+			os.close(fd)
+		SecretItem.SetSecret(self, dbus.Struct((secret[0], secret[1], dbus.ByteArray(data),
+		                                        secret[3]), signature="oayays"), sender)
+
+
+class SecretItem(FdTransferItem):
 	SUPPORTS_MULTIPLE_OBJECT_PATHS = True
 
 	def __init__(self, collection, identifier=None, label="Item", attributes={ },
@@ -476,6 +605,9 @@ class SecretService(dbus.service.Object):
 		"dh-ietf1024-sha256-aes128-cbc-pkcs7": AesAlgorithm(),
 	}
 
+	# Whether sessions can negotiate the FdTransfer extension
+	fd_transfer = False
+
 	def __init__(self, name=None):
 		if name == None:
 			name = bus_name
@@ -487,6 +619,7 @@ class SecretService(dbus.service.Object):
 		self.collections = { }
 		self.aliases = { }
 		self.aliased = { }
+		self.calls = [ ]
 
 		def on_name_owner_changed(owned, old_owner, new_owner):
 			if not new_owner:
@@ -540,6 +673,9 @@ class SecretService(dbus.service.Object):
 			ready_pipe = -1
 		loop.run()
 
+	def add_call(self, method, argument):
+		self.calls.append((method, argument))
+
 	def add_session(self, session):
 		if session.sender not in self.sessions:
 			self.sessions[session.sender] = []
@@ -617,12 +753,18 @@ class SecretService(dbus.service.Object):
 	@dbus.service.method('org.freedesktop.Secret.Service', byte_arrays=True, sender_keyword='sender')
 	def OpenSession(self, algorithm, param, sender=None):
 		assert type(algorithm) == dbus.String
+		self.add_call("OpenSession", algorithm)
 
 		if algorithm not in self.algorithms:
 			raise NotSupported("algorithm %s is not supported" % algorithm)
 
 		return self.algorithms[algorithm].negotiate(self, sender, param)
 
+	# Lets the tests check which calls were made, and with what
+	@dbus.service.method(MOCK_IFACE, in_signature='s', out_signature='as')
+	def GetCalls(self, method):
+		return [argument for (name, argument) in self.calls if name == method]
+
 	@dbus.service.method('org.freedesktop.Secret.Service', sender_keyword='sender')
 	def CreateCollection(self, properties, alias, sender=None):
 		label = properties.get("org.freedesktop.Secret.Collection.Label", None)
@@ -0,0 +1,83 @@
+
+#
+# Copyright 2013 Red Hat Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published
+# by the Free Software Foundation; either version 2.1 of the licence or (at
+# your option) any later version.
+#
+# See the included COPYING file for more information.
+#
+
+# WARNING: This is for use in mock objects during testing, and NOT
+# cryptographically secure or performant.
+
+#
+# X25519 key agreement as described in RFC 7748
+#
+
+import os
+
+PRIME = 2 ** 255 - 19
+A24 = 121665
+BASE = chr(9) + chr(0) * 31
+
+def decode_scalar(data):
+	k = [ord(c) for c in data]
+	k[0] &= 248
+	k[31] &= 127
+	k[31] |= 64
+	return sum([k[i] << (8 * i) for i in range(32)])
+
+def decode_u(data):
+	u = [ord(c) for c in data]
+	u[31] &= 127
+	return sum([u[i] << (8 * i) for i in range(32)])
+
+def encode_u(number):
+	number = number % PRIME
+	return "".join([chr((number >> (8 * i)) & 0xff) for i in range(32)])
+
+def x25519(scalar, point):
+	k = decode_scalar(scalar)
+	x1 = decode_u(point)
+	x2, z2, x3, z3 = 1, 0, x1, 1
+	swap = 0
+	for t in range(254, -1, -1):
+		kt = (k >> t) & 1
+		swap ^= kt
+		if swap:
+			x2, x3 = x3, x2
+			z2, z3 = z3, z2
+		swap = kt
+		a = x2 + z2
+		aa = a * a % PRIME
+		b = x2 - z2
+		bb = b * b % PRIME
+		e = aa - bb
+		c = x3 + z3
+		d = x3 - z3
+		da = d * a % PRIME
+		cb = c * b % PRIME
+		x3 = (da + cb) ** 2 % PRIME
+		z3 = x1 * (da - cb) ** 2 % PRIME
+		x2 = aa * bb % PRIME
+		z2 = e * (aa + A24 * e) % PRIME
+	if swap:
+		x2, x3 = x3, x2
+		z2, z3 = z3, z2
+	return encode_u(x2 * pow(z2, PRIME - 2, PRIME))
+
+def generate_pair():
+	privat = os.urandom(32)
+	publi = x25519(privat, BASE)
+	return (privat, publi)
+
+def derive_key(privat, peer):
+	if len(peer) != 32:
+		raise ValueError("invalid X25519 public key")
+	key = x25519(privat, peer)
+	if key == chr(0) * 32:
+		raise ValueError("invalid X25519 public key")
+	return key
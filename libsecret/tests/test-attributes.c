@@ -124,6 +124,70 @@ test_build_bad_type (void)
 	g_test_trap_assert_stderr ("*invalid type*");
 }
 
+static void
+test_build_new_schema (void)
+{
+	GHashTable *attributes;
+	GHashTable *index;
+	SecretSchema *schema;
+	gboolean ret;
+
+	schema = secret_schema_new ("org.mock.New", SECRET_SCHEMA_NONE,
+	                            "number", SECRET_SCHEMA_ATTRIBUTE_INTEGER,
+	                            "even", SECRET_SCHEMA_ATTRIBUTE_BOOLEAN,
+	                            NULL);
+
+	/* Twice, the second time with the cached index */
+	attributes = secret_attributes_build (schema, "number", 4, "even", TRUE, NULL);
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "number"), ==, "4");
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "even"), ==, "true");
+	g_hash_table_unref (attributes);
+
+	attributes = secret_attributes_build (schema, "number", 5, "even", FALSE, NULL);
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "number"), ==, "5");
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "even"), ==, "false");
+
+	ret = _secret_attributes_validate (schema, attributes, G_STRFUNC, TRUE);
+	g_assert (ret == TRUE);
+
+	index = _secret_schema_get_index (schema);
+	g_assert (index != NULL);
+	g_assert (_secret_schema_find_attribute (schema, index, "string") == NULL);
+	g_assert_cmpint (_secret_schema_find_attribute (schema, index, "even")->type, ==, SECRET_SCHEMA_ATTRIBUTE_BOOLEAN);
+
+	g_hash_table_unref (attributes);
+	secret_schema_unref (schema);
+}
+
+static void
+test_build_copied_schema (void)
+{
+	GHashTable *attributes;
+	GHashTable *index;
+	SecretSchema *schema;
+
+	/* Static schemas are scanned, and have no index */
+	attributes = secret_attributes_build (&MOCK_SCHEMA, "string", "four", NULL);
+	g_hash_table_unref (attributes);
+	g_assert (_secret_schema_get_index (&MOCK_SCHEMA) == NULL);
+
+	schema = secret_schema_ref ((SecretSchema *)&MOCK_SCHEMA);
+	g_assert (schema != &MOCK_SCHEMA);
+
+	attributes = secret_attributes_build (schema, "number", 4, "string", "four", NULL);
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "number"), ==, "4");
+	g_assert_cmpstr (g_hash_table_lookup (attributes, "string"), ==, "four");
+	g_hash_table_unref (attributes);
+
+	/* The copy gets its own index, pointing at its own attributes */
+	index = _secret_schema_get_index (schema);
+	g_assert (index != NULL);
+	g_assert (_secret_schema_find_attribute (schema, index, "even") == &schema->attributes[2]);
+	g_assert (_secret_schema_find_attribute (&MOCK_SCHEMA, NULL, "even") == &MOCK_SCHEMA.attributes[2]);
+
+	secret_schema_unref (schema);
+}
+
 static void
 test_validate_schema (void)
 {
@@ -191,6 +255,8 @@ main (int argc, char **argv)
 	g_test_add_func ("/attributes/build-null-string", test_build_null_string);
 	g_test_add_func ("/attributes/build-non-utf8-string", test_build_non_utf8_string);
 	g_test_add_func ("/attributes/build-bad-type", test_build_bad_type);
+	g_test_add_func ("/attributes/build-new-schema", test_build_new_schema);
+	g_test_add_func ("/attributes/build-copied-schema", test_build_copied_schema);
 
 	g_test_add_func ("/attributes/validate-schema", test_validate_schema);
 	g_test_add_func ("/attributes/validate-schema-bad", test_validate_schema_bad);
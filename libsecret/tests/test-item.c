@@ -58,6 +58,15 @@ setup (Test *test,
 	g_assert_no_error (error);
 }
 
+static void
+setup_fd (Test *test,
+          gconstpointer data)
+{
+	/* Off unless asked for, see secret-session.c */
+	_secret_session_set_fd_transfer (TRUE);
+	setup (test, data);
+}
+
 static void
 teardown (Test *test,
           gconstpointer unused)
@@ -69,6 +78,14 @@ teardown (Test *test,
 	mock_service_stop ();
 }
 
+static void
+teardown_fd (Test *test,
+             gconstpointer unused)
+{
+	teardown (test, unused);
+	_secret_session_set_fd_transfer (FALSE);
+}
+
 static void
 on_async_result (GObject *source,
                  GAsyncResult *result,
@@ -670,6 +687,194 @@ test_set_secret_sync (Test *test,
 	g_object_unref (item);
 }
 
+static void
+check_set_secret_stream (Test *test,
+                         gsize length)
+{
+	const gchar *item_path = "/org/freedesktop/secrets/collection/english/1";
+	GError *error = NULL;
+	GInputStream *input;
+	GOutputStream *output;
+	SecretItem *item;
+	SecretValue *value;
+	gconstpointer data;
+	gchar *secret;
+	gboolean ret;
+	gsize i;
+
+	secret = g_malloc (length);
+	for (i = 0; i < length; i++)
+		secret[i] = 'a' + (i % 26);
+
+	item = secret_item_new_for_dbus_path_sync (test->service, item_path, SECRET_ITEM_NONE, NULL, &error);
+	g_assert_no_error (error);
+
+	input = g_memory_input_stream_new_from_data (secret, length, NULL);
+	ret = secret_item_set_secret_from_stream_sync (item, input, "application/x-pem-file", NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_object_unref (input);
+
+	/* Not cached, as the item never saw the whole secret */
+	g_assert (secret_item_get_secret (item) == NULL);
+
+	ret = secret_item_load_secret_sync (item, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	value = secret_item_get_secret (item);
+	g_assert (value != NULL);
+	data = secret_value_get (value, &i);
+	egg_assert_cmpmem (data, i, ==, secret, length);
+	g_assert_cmpstr (secret_value_get_content_type (value), ==, "application/x-pem-file");
+	secret_value_unref (value);
+
+	/* And read it back out the same way */
+	output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+	ret = secret_service_get_secret_for_dbus_path_to_stream_sync (test->service, item_path,
+	                                                              output, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	egg_assert_cmpmem (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+	                   g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)),
+	                   ==, secret, length);
+	g_object_unref (output);
+
+	g_object_unref (item);
+	g_free (secret);
+}
+
+static void
+test_set_secret_stream (Test *test,
+                        gconstpointer unused)
+{
+	/* Several chunks, and not a whole number of cipher blocks */
+	check_set_secret_stream (test, SECRET_SESSION_STREAM_CHUNK * 3 + 7);
+}
+
+static void
+test_set_secret_stream_large (Test *test,
+                              gconstpointer unused)
+{
+	/* Switches to a memfd part way through, where the service supports it */
+	check_set_secret_stream (test, SECRET_SESSION_FD_THRESHOLD + SECRET_SESSION_STREAM_CHUNK * 2 + 7);
+}
+
+static void
+test_set_secret_large (Test *test,
+                       gconstpointer unused)
+{
+	const gchar *item_path = "/org/freedesktop/secrets/collection/english/1";
+	GError *error = NULL;
+	SecretItem *item;
+	SecretValue *value;
+	gconstpointer data;
+	gchar *secret;
+	gboolean ret;
+	gsize length;
+	gsize i;
+
+	/* Big enough to be sent in a memfd, where the service supports it */
+	length = SECRET_SESSION_FD_THRESHOLD + 3;
+	secret = g_malloc (length);
+	for (i = 0; i < length; i++)
+		secret[i] = 'A' + (i % 26);
+
+	item = secret_item_new_for_dbus_path_sync (test->service, item_path, SECRET_ITEM_NONE, NULL, &error);
+	g_assert_no_error (error);
+
+	value = secret_value_new (secret, length, "application/octet-stream");
+	ret = secret_item_set_secret_sync (item, value, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	secret_value_unref (value);
+
+	ret = secret_item_load_secret_sync (item, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	value = secret_item_get_secret (item);
+	g_assert (value != NULL);
+	data = secret_value_get (value, &i);
+	egg_assert_cmpmem (data, i, ==, secret, length);
+	secret_value_unref (value);
+
+	g_object_unref (item);
+	g_free (secret);
+}
+
+static void
+test_fd_transfer_off (Test *test,
+                      gconstpointer unused)
+{
+	gchar **calls;
+
+	test_set_secret_large (test, unused);
+
+	/* Not asked for, so the service isn't asked about it */
+	calls = mock_service_get_calls ("Negotiate");
+	g_assert_cmpuint (g_strv_length (calls), ==, 0);
+	g_strfreev (calls);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+
+static void
+test_fd_transfer_on (Test *test,
+                     gconstpointer unused)
+{
+	gchar **calls;
+
+	test_set_secret_large (test, unused);
+
+	calls = mock_service_get_calls ("Negotiate");
+	g_assert_cmpuint (g_strv_length (calls), ==, 1);
+	g_strfreev (calls);
+}
+
+#endif /* HAVE_MEMFD_CREATE */
+
+static void
+test_set_secret_stream_empty (Test *test,
+                              gconstpointer unused)
+{
+	const gchar *item_path = "/org/freedesktop/secrets/collection/english/1";
+	GError *error = NULL;
+	GInputStream *input;
+	GAsyncResult *result = NULL;
+	SecretItem *item;
+	SecretValue *value;
+	gboolean ret;
+	gsize length;
+
+	item = secret_item_new_for_dbus_path_sync (test->service, item_path, SECRET_ITEM_NONE, NULL, &error);
+	g_assert_no_error (error);
+
+	input = g_memory_input_stream_new ();
+	secret_item_set_secret_from_stream (item, input, "text/plain", NULL, on_async_result, &result);
+	g_assert (result == NULL);
+
+	egg_test_wait ();
+
+	ret = secret_item_set_secret_from_stream_finish (item, result, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_object_unref (result);
+	g_object_unref (input);
+
+	ret = secret_item_load_secret_sync (item, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	value = secret_item_get_secret (item);
+	g_assert (value != NULL);
+	secret_value_get (value, &length);
+	g_assert_cmpuint (length, ==, 0);
+	secret_value_unref (value);
+
+	g_object_unref (item);
+}
+
 static void
 test_secrets_sync (Test *test,
                    gconstpointer used)
@@ -860,6 +1065,22 @@ main (int argc, char **argv)
 	g_test_add ("/item/load-secret-sync", Test, "mock-service-normal.py", setup, test_load_secret_sync, teardown);
 	g_test_add ("/item/load-secret-async", Test, "mock-service-normal.py", setup, test_load_secret_async, teardown);
 	g_test_add ("/item/set-secret-sync", Test, "mock-service-normal.py", setup, test_set_secret_sync, teardown);
+	g_test_add ("/item/set-secret-stream", Test, "mock-service-normal.py", setup, test_set_secret_stream, teardown);
+	g_test_add ("/item/set-secret-stream-plain", Test, "mock-service-only-plain.py", setup, test_set_secret_stream, teardown);
+	g_test_add ("/item/set-secret-stream-gcm", Test, "mock-service-gcm.py", setup, test_set_secret_stream, teardown);
+	g_test_add ("/item/set-secret-stream-fd", Test, "mock-service-fd.py", setup_fd, test_set_secret_stream, teardown_fd);
+	g_test_add ("/item/set-secret-stream-fd-plain", Test, "mock-service-fd-plain.py", setup_fd, test_set_secret_stream, teardown_fd);
+	g_test_add ("/item/set-secret-stream-large", Test, "mock-service-normal.py", setup, test_set_secret_stream_large, teardown);
+	g_test_add ("/item/set-secret-stream-large-fd", Test, "mock-service-fd.py", setup_fd, test_set_secret_stream_large, teardown_fd);
+	g_test_add ("/item/set-secret-stream-large-fd-plain", Test, "mock-service-fd-plain.py", setup_fd, test_set_secret_stream_large, teardown_fd);
+	g_test_add ("/item/set-secret-stream-empty", Test, "mock-service-normal.py", setup, test_set_secret_stream_empty, teardown);
+	g_test_add ("/item/set-secret-stream-empty-fd", Test, "mock-service-fd.py", setup_fd, test_set_secret_stream_empty, teardown_fd);
+	g_test_add ("/item/set-secret-large", Test, "mock-service-normal.py", setup, test_set_secret_large, teardown);
+	g_test_add ("/item/set-secret-large-fd", Test, "mock-service-fd.py", setup_fd, test_set_secret_large, teardown_fd);
+	g_test_add ("/item/fd-transfer-off", Test, "mock-service-fd.py", setup, test_fd_transfer_off, teardown);
+#ifdef HAVE_MEMFD_CREATE
+	g_test_add ("/item/fd-transfer-on", Test, "mock-service-fd.py", setup_fd, test_fd_transfer_on, teardown_fd);
+#endif
 	g_test_add ("/item/secrets-sync", Test, "mock-service-normal.py", setup, test_secrets_sync, teardown);
 	g_test_add ("/item/secrets-async", Test, "mock-service-normal.py", setup, test_secrets_async, teardown);
 	g_test_add ("/item/delete-sync", Test, "mock-service-normal.py", setup, test_delete_sync, teardown);
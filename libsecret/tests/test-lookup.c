@@ -0,0 +1,263 @@
+/* libsecret - GLib wrapper for Secret Service
+ *
+ * Copyright 2013 Red Hat Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#include "config.h"
+
+#include "secret-attributes.h"
+#include "secret-lookup.h"
+#include "secret-password.h"
+#include "secret-private.h"
+
+#include "mock-service.h"
+
+#include "egg/egg-testing.h"
+
+#include <glib.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+static const SecretSchema MOCK_SCHEMA = {
+	"org.mock.Schema",
+	SECRET_SCHEMA_NONE,
+	{
+		{ "number", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+		{ "string", SECRET_SCHEMA_ATTRIBUTE_STRING },
+		{ "even", SECRET_SCHEMA_ATTRIBUTE_BOOLEAN },
+	}
+};
+
+static const SecretSchema NO_NAME_SCHEMA = {
+	"unused.Schema.Name",
+	SECRET_SCHEMA_DONT_MATCH_NAME,
+	{
+		{ "number", SECRET_SCHEMA_ATTRIBUTE_INTEGER },
+		{ "string", SECRET_SCHEMA_ATTRIBUTE_STRING },
+	}
+};
+
+typedef struct {
+	GPid pid;
+} Test;
+
+static void
+setup (Test *test,
+       gconstpointer data)
+{
+	GError *error = NULL;
+	const gchar *mock_script = data;
+
+	mock_service_start (mock_script, &error);
+	g_assert_no_error (error);
+}
+
+static void
+teardown (Test *test,
+          gconstpointer unused)
+{
+	secret_service_disconnect ();
+	mock_service_stop ();
+}
+
+static void
+on_complete_get_result (GObject *source,
+                        GAsyncResult *result,
+                        gpointer user_data)
+{
+	GAsyncResult **ret = user_data;
+	g_assert (ret != NULL);
+	g_assert (*ret == NULL);
+	*ret = g_object_ref (result);
+	egg_test_wait_stop ();
+}
+
+static void
+test_lookup_sync (Test *test,
+                  gconstpointer used)
+{
+	SecretLookup *lookup;
+	GError *error = NULL;
+	gchar *password;
+	gint i;
+
+	lookup = secret_lookup_new (&MOCK_SCHEMA,
+	                            "even", FALSE,
+	                            "string", "one",
+	                            "number", 1,
+	                            NULL);
+	g_assert (lookup != NULL);
+
+	/* Prepared once, run many times */
+	for (i = 0; i < 3; i++) {
+		password = secret_lookup_password_sync (lookup, NULL, &error);
+		g_assert_no_error (error);
+		g_assert_cmpstr (password, ==, "111");
+		secret_password_free (password);
+	}
+
+	secret_lookup_unref (lookup);
+}
+
+static void
+test_lookup_async (Test *test,
+                   gconstpointer used)
+{
+	GAsyncResult *result = NULL;
+	SecretLookup *lookup;
+	GError *error = NULL;
+	gchar *password;
+
+	lookup = secret_lookup_new (&MOCK_SCHEMA,
+	                            "even", FALSE,
+	                            "string", "one",
+	                            "number", 1,
+	                            NULL);
+
+	secret_lookup_password (lookup, NULL, on_complete_get_result, &result);
+	g_assert (result == NULL);
+
+	/* The caller's reference isn't needed while running */
+	secret_lookup_unref (lookup);
+
+	egg_test_wait ();
+
+	password = secret_lookup_password_finish (result, &error);
+	g_assert_no_error (error);
+	g_object_unref (result);
+
+	g_assert_cmpstr (password, ==, "111");
+	secret_password_free (password);
+}
+
+static void
+test_lookup_no_name (Test *test,
+                     gconstpointer used)
+{
+	SecretLookup *lookup;
+	GError *error = NULL;
+	gchar *password;
+
+	/* should return null, because nothing with mock schema and 5 */
+	lookup = secret_lookup_new (&MOCK_SCHEMA, "number", 5, NULL);
+	password = secret_lookup_password_sync (lookup, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (password == NULL);
+	secret_lookup_unref (lookup);
+
+	/* should return an item, because we have a prime schema with 5, and flags not to match name */
+	lookup = secret_lookup_new (&NO_NAME_SCHEMA, "number", 5, NULL);
+	password = secret_lookup_password_sync (lookup, NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (password, ==, "555");
+	secret_password_free (password);
+	secret_lookup_unref (lookup);
+}
+
+static void
+test_attributes_sorted (void)
+{
+	SecretLookup *lookup;
+	gchar *printed;
+
+	lookup = secret_lookup_new (&MOCK_SCHEMA,
+	                            "string", "one",
+	                            "number", 1,
+	                            "even", FALSE,
+	                            NULL);
+
+	printed = g_variant_print (secret_lookup_get_attributes (lookup), FALSE);
+	g_assert_cmpstr (printed, ==, "{'even': 'false', 'number': '1', 'string': 'one', "
+	                              "'xdg:schema': 'org.mock.Schema'}");
+	g_free (printed);
+	secret_lookup_unref (lookup);
+
+	/* No schema name to match on */
+	lookup = secret_lookup_new (&NO_NAME_SCHEMA, "string", "one", "number", 1, NULL);
+	printed = g_variant_print (secret_lookup_get_attributes (lookup), FALSE);
+	g_assert_cmpstr (printed, ==, "{'number': '1', 'string': 'one'}");
+	g_free (printed);
+	secret_lookup_unref (lookup);
+}
+
+static void
+test_hash_equal (void)
+{
+	SecretLookup *one, *two, *other;
+	GHashTable *attributes;
+	GHashTable *cache;
+
+	one = secret_lookup_new (&MOCK_SCHEMA, "number", 1, "string", "one", NULL);
+
+	attributes = g_hash_table_new (g_str_hash, g_str_equal);
+	g_hash_table_insert (attributes, "string", "one");
+	g_hash_table_insert (attributes, "number", "1");
+	g_hash_table_insert (attributes, "xdg:schema", "org.mock.Schema");
+	two = secret_lookup_newv (&MOCK_SCHEMA, attributes);
+	g_hash_table_unref (attributes);
+
+	other = secret_lookup_new (&MOCK_SCHEMA, "number", 2, "string", "one", NULL);
+
+	g_assert (secret_lookup_equal (one, two));
+	g_assert_cmpuint (secret_lookup_hash (one), ==, secret_lookup_hash (two));
+	g_assert (!secret_lookup_equal (one, other));
+
+	cache = g_hash_table_new_full (secret_lookup_hash, secret_lookup_equal,
+	                               secret_lookup_unref, g_free);
+	g_hash_table_insert (cache, secret_lookup_ref (one), g_strdup ("111"));
+	g_assert_cmpstr (g_hash_table_lookup (cache, two), ==, "111");
+	g_assert (g_hash_table_lookup (cache, other) == NULL);
+	g_hash_table_unref (cache);
+
+	secret_lookup_unref (one);
+	secret_lookup_unref (two);
+	secret_lookup_unref (other);
+}
+
+static void
+test_new_invalid (void)
+{
+	SecretLookup *lookup;
+	GHashTable *attributes;
+
+	attributes = g_hash_table_new (g_str_hash, g_str_equal);
+	g_hash_table_insert (attributes, "number", "not a number");
+
+	if (g_test_trap_fork (0, G_TEST_TRAP_SILENCE_STDERR)) {
+		lookup = secret_lookup_newv (&MOCK_SCHEMA, attributes);
+		g_assert (lookup == NULL);
+	}
+
+	g_test_trap_assert_failed ();
+	g_test_trap_assert_stderr ("*invalid number integer value*");
+
+	g_hash_table_unref (attributes);
+}
+
+int
+main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+	g_set_prgname ("test-lookup");
+#if !GLIB_CHECK_VERSION(2,35,0)
+	g_type_init ();
+#endif
+
+	g_test_add ("/lookup/lookup-sync", Test, "mock-service-normal.py", setup, test_lookup_sync, teardown);
+	g_test_add ("/lookup/lookup-async", Test, "mock-service-normal.py", setup, test_lookup_async, teardown);
+	g_test_add ("/lookup/lookup-no-name", Test, "mock-service-normal.py", setup, test_lookup_no_name, teardown);
+
+	g_test_add_func ("/lookup/attributes-sorted", test_attributes_sorted);
+	g_test_add_func ("/lookup/hash-equal", test_hash_equal);
+	g_test_add_func ("/lookup/new-invalid", test_new_invalid);
+
+	return egg_tests_run_with_loop ();
+}
@@ -85,6 +85,15 @@ setup (Test *test,
 	g_assert_no_error (error);
 }
 
+static void
+setup_threaded (Test *test,
+                gconstpointer data)
+{
+	/* Decode every GetSecrets() reply on two threads */
+	_secret_session_set_decode_threads (2, 0);
+	setup (test, data);
+}
+
 static void
 teardown_mock (Test *test,
                gconstpointer unused)
@@ -106,6 +115,14 @@ teardown (Test *test,
 	teardown_mock (test, unused);
 }
 
+static void
+teardown_threaded (Test *test,
+                   gconstpointer unused)
+{
+	teardown (test, unused);
+	_secret_session_set_decode_threads (0, 256);
+}
+
 static void
 on_complete_get_result (GObject *source,
                         GAsyncResult *result,
@@ -727,6 +744,8 @@ main (int argc, char **argv)
 	g_test_add ("/service/secret-for-path-async", Test, "mock-service-normal.py", setup, test_secret_for_path_async, teardown);
 	g_test_add ("/service/secrets-for-paths-sync", Test, "mock-service-normal.py", setup, test_secrets_for_paths_sync, teardown);
 	g_test_add ("/service/secrets-for-paths-async", Test, "mock-service-normal.py", setup, test_secrets_for_paths_async, teardown);
+	g_test_add ("/service/secrets-for-paths-threaded", Test, "mock-service-normal.py", setup_threaded, test_secrets_for_paths_sync, teardown_threaded);
+	g_test_add ("/service/secrets-for-paths-threaded-plain", Test, "mock-service-only-plain.py", setup_threaded, test_secrets_for_paths_sync, teardown_threaded);
 
 	g_test_add ("/service/delete-for-path", Test, "mock-service-delete.py", setup, test_delete_for_path_sync, teardown);
 	g_test_add ("/service/delete-for-path-with-prompt", Test, "mock-service-delete.py", setup, test_delete_for_path_sync_prompt, teardown);
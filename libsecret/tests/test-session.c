@@ -20,12 +20,23 @@
 
 #include "mock-service.h"
 
+#include "egg/egg-secure-memory.h"
 #include "egg/egg-testing.h"
 
+#ifdef WITH_GCRYPT
+#include "egg/egg-dh.h"
+#endif
+
 #include <glib.h>
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 typedef struct {
 	SecretService *service;
@@ -118,6 +129,135 @@ test_ensure_plain (Test *test,
 	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, "plain");
 }
 
+static void
+test_ensure_reconnect (Test *test,
+                       gconstpointer data)
+{
+	const gchar *algorithms = data;
+	GError *error = NULL;
+	gchar **calls;
+	guint n_calls;
+	gboolean ret;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, algorithms);
+
+	calls = mock_service_get_calls ("OpenSession");
+	n_calls = g_strv_length (calls);
+	g_assert_cmpuint (n_calls, >=, 1);
+	g_assert_cmpstr (calls[n_calls - 1], ==, algorithms);
+#ifdef WITH_GCRYPT
+	/* The only-plain service turned down the others first */
+	if (g_str_equal (algorithms, "plain"))
+		g_assert_cmpuint (n_calls, >, 1);
+#endif
+	g_strfreev (calls);
+
+	/* A new proxy starts with the algorithm the service accepted last time */
+	g_object_unref (test->service);
+	secret_service_disconnect ();
+	egg_assert_not_object (test->service);
+
+	test->service = secret_service_get_sync (SECRET_SERVICE_NONE, NULL, &error);
+	g_assert_no_error (error);
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, algorithms);
+
+	/* Only one more OpenSession() call, and it was for that algorithm */
+	calls = mock_service_get_calls ("OpenSession");
+	g_assert_cmpuint (g_strv_length (calls), ==, n_calls + 1);
+	g_assert_cmpstr (calls[n_calls], ==, algorithms);
+	g_strfreev (calls);
+}
+
+static void
+setup_reconnect (Test *test,
+                 gconstpointer data)
+{
+	setup (test, g_str_equal (data, "plain") ? "mock-service-only-plain.py" : "mock-service-normal.py");
+}
+
+#ifdef EGG_DH_WITH_X25519
+
+static void
+test_ensure_x25519 (Test *test,
+                    gconstpointer unused)
+{
+	GError *error = NULL;
+	gboolean ret;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_dbus_path (test->service), !=, NULL);
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, "ecdh-x25519-sha256-aes128-cbc-pkcs7");
+}
+
+#endif /* EGG_DH_WITH_X25519 */
+
+#if defined (EGG_DH_WITH_X25519)
+#define EXPECT_GCM "ecdh-x25519-sha256-aes128-gcm"
+#elif defined (WITH_GCRYPT) && GCRYPT_VERSION_NUMBER >= 0x010600
+#define EXPECT_GCM "dh-ietf1024-sha256-aes128-gcm"
+#endif
+
+static void
+test_ensure_gcm (Test *test,
+                 gconstpointer unused)
+{
+	const gchar *collection_path = "/org/freedesktop/secrets/collection/english";
+	GHashTable *attributes;
+	SecretValue *value;
+	GError *error = NULL;
+	const gchar *password;
+	gsize length;
+	gboolean ret;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_dbus_path (test->service), !=, NULL);
+#ifdef EXPECT_GCM
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, EXPECT_GCM);
+#endif
+
+	/* Decrypt a secret encrypted by the service */
+	value = secret_service_get_secret_for_dbus_path_sync (test->service, "/org/freedesktop/secrets/collection/english/1",
+	                                                      NULL, &error);
+	g_assert_no_error (error);
+	g_assert (value != NULL);
+
+	password = secret_value_get (value, &length);
+	g_assert_cmpuint (length, ==, 3);
+	g_assert_cmpstr (password, ==, "111");
+	g_assert_cmpstr (secret_value_get_content_type (value), ==, "text/plain");
+	secret_value_unref (value);
+
+	/* And have the service decrypt one of ours */
+	attributes = g_hash_table_new (g_str_hash, g_str_equal);
+	g_hash_table_insert (attributes, "string", "gcm");
+
+	value = secret_value_new ("authenticated", -1, "text/plain");
+	ret = secret_service_store_sync (test->service, NULL, attributes, collection_path,
+	                                 "GCM Label", value, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	secret_value_unref (value);
+
+	value = secret_service_lookup_sync (test->service, NULL, attributes, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (value != NULL);
+	g_assert_cmpstr (secret_value_get (value, NULL), ==, "authenticated");
+	secret_value_unref (value);
+
+	g_hash_table_unref (attributes);
+}
+
 static void
 on_complete_get_result (GObject *source,
                         GAsyncResult *result,
@@ -174,6 +314,40 @@ test_ensure_async_aes (Test *test,
 	g_object_unref (result);
 }
 
+static void
+test_ensure_prewarm (Test *test,
+                     gconstpointer unused)
+{
+	SecretService *service;
+	SecretValue *value;
+	GError *error = NULL;
+	const gchar *password;
+	gsize length;
+	gint i;
+
+	/* Sessions opened with or without a keypair ready must all work */
+	for (i = 0; i < 4; i++) {
+		secret_service_prewarm ();
+
+		service = secret_service_new_sync (SECRET_TYPE_SERVICE, NULL,
+		                                   SECRET_SERVICE_OPEN_SESSION, NULL, &error);
+		g_assert_no_error (error);
+		g_assert_cmpstr (secret_service_get_session_algorithms (service), ==, "dh-ietf1024-sha256-aes128-cbc-pkcs7");
+
+		value = secret_service_get_secret_for_dbus_path_sync (service, "/org/freedesktop/secrets/collection/english/1",
+		                                                      NULL, &error);
+		g_assert_no_error (error);
+		g_assert (value != NULL);
+
+		password = secret_value_get (value, &length);
+		g_assert_cmpuint (length, ==, 3);
+		g_assert_cmpstr (password, ==, "111");
+
+		secret_value_unref (value);
+		g_object_unref (service);
+	}
+}
+
 static void
 test_ensure_async_twice (Test *test,
                          gconstpointer unused)
@@ -213,6 +387,655 @@ test_ensure_async_twice (Test *test,
 	g_free (path);
 }
 
+static void
+count_secure_records (guint *count,
+                      gsize *length)
+{
+	egg_secure_rec *records;
+	guint i, n_records;
+
+	*count = 0;
+	*length = 0;
+
+	records = egg_secure_records (&n_records);
+	for (i = 0; i < n_records; i++) {
+		if (g_strcmp0 (records[i].tag, "secret_session") == 0) {
+			(*count)++;
+			*length += records[i].request_length;
+		}
+	}
+
+	free (records);
+}
+
+static void
+test_decode_allocations (Test *test,
+                         gconstpointer unused)
+{
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded[48];
+	GVariant *encoded;
+	GError *error = NULL;
+	guint before, after;
+	gsize n_before, n_after;
+	gsize n_expected;
+	gchar *password;
+	gboolean ret;
+	guint i;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+	g_assert (session != NULL);
+
+	count_secure_records (&before, &n_before);
+	n_expected = 0;
+
+	/* Lengths on and around the AES block boundaries */
+	for (i = 0; i < G_N_ELEMENTS (decoded); i++) {
+		password = g_strnfill (i, 'a' + (i % 26));
+		value = secret_value_new (password, i, "text/plain");
+		encoded = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+		secret_value_unref (value);
+
+		decoded[i] = _secret_session_decode_secret (session, encoded);
+		g_assert (decoded[i] != NULL);
+		g_assert_cmpstr (secret_value_get (decoded[i], NULL), ==, password);
+
+		n_expected += i + 1;
+		g_variant_unref (encoded);
+		g_free (password);
+	}
+
+	/* Exactly one allocation, of the exact size, for each secret */
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after - before, ==, G_N_ELEMENTS (decoded));
+	egg_assert_cmpsize (n_after - n_before, ==, n_expected);
+
+	for (i = 0; i < G_N_ELEMENTS (decoded); i++)
+		secret_value_unref (decoded[i]);
+}
+
+static void
+test_decode_arena (Test *test,
+                   gconstpointer unused)
+{
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded[48];
+	GVariant *encoded[48];
+	GError *error = NULL;
+	guint before, after;
+	gsize n_before, n_after;
+	gchar *password;
+	gboolean ret;
+	guint i;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+	g_assert (session != NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (encoded); i++) {
+		password = g_strnfill (i, 'a' + (i % 26));
+		value = secret_value_new (password, i, "text/plain");
+		encoded[i] = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+		secret_value_unref (value);
+		g_free (password);
+	}
+
+	count_secure_records (&before, &n_before);
+
+	_secret_session_decode_secrets (session, encoded, decoded, G_N_ELEMENTS (encoded));
+
+	/* All the secrets share one allocation */
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after - before, ==, 1);
+
+	for (i = 0; i < G_N_ELEMENTS (decoded); i++) {
+		g_assert (decoded[i] != NULL);
+		password = g_strnfill (i, 'a' + (i % 26));
+		g_assert_cmpstr (secret_value_get (decoded[i], NULL), ==, password);
+		g_free (password);
+		g_variant_unref (encoded[i]);
+	}
+
+	/* Which is only freed along with the last of them */
+	for (i = 1; i < G_N_ELEMENTS (decoded); i++)
+		secret_value_unref (decoded[i]);
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after - before, ==, 1);
+
+	secret_value_unref (decoded[0]);
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after, ==, before);
+}
+
+static void
+test_decode_arena_bounded (Test *test,
+                           gconstpointer unused)
+{
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded[32];
+	GVariant *encoded[32];
+	GError *error = NULL;
+	guint before, after;
+	gsize n_before, n_after;
+	gchar *password;
+	gboolean ret;
+	guint i;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+	g_assert (session != NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (encoded); i++) {
+		password = g_strnfill (1024, 'a' + (i % 26));
+		value = secret_value_new (password, -1, "text/plain");
+		encoded[i] = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+		secret_value_unref (value);
+		g_free (password);
+	}
+
+	count_secure_records (&before, &n_before);
+
+	_secret_session_decode_secrets (session, encoded, decoded, G_N_ELEMENTS (encoded));
+
+	/* Split over several regions, each holding more than one secret */
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after - before, >, 1);
+	g_assert_cmpuint (after - before, <, G_N_ELEMENTS (decoded) / 2);
+
+	for (i = 0; i < G_N_ELEMENTS (decoded); i++) {
+		g_assert (decoded[i] != NULL);
+		password = g_strnfill (1024, 'a' + (i % 26));
+		g_assert_cmpstr (secret_value_get (decoded[i], NULL), ==, password);
+		g_free (password);
+		g_variant_unref (encoded[i]);
+		secret_value_unref (decoded[i]);
+	}
+
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after, ==, before);
+}
+
+static GVariant *
+encode_stream (SecretSession *session,
+               const gchar *secret,
+               gsize length,
+               gsize step)
+{
+	SecretSessionEncoder *encoder;
+	GVariant *encoded;
+	gpointer buffer;
+	gsize offset, n;
+
+	encoder = _secret_session_encoder_new (session, "text/plain");
+	g_assert (encoder != NULL);
+
+	for (offset = 0; offset < length; offset += n) {
+		buffer = _secret_session_encoder_buffer (encoder, &n);
+		n = MIN (MIN (n, step), length - offset);
+		memcpy (buffer, secret + offset, n);
+		if (!_secret_session_encoder_update (encoder, n))
+			g_assert_not_reached ();
+	}
+
+	encoded = _secret_session_encoder_finish (encoder);
+	g_assert (encoded != NULL);
+	_secret_session_encoder_free (encoder);
+
+	return g_variant_ref_sink (encoded);
+}
+
+static GString *
+decode_stream (SecretSession *session,
+               GVariant *encoded)
+{
+	SecretSessionDecoder *decoder;
+	gconstpointer chunk;
+	GString *result;
+	gssize n;
+
+	decoder = _secret_session_decoder_new (session, encoded);
+	if (decoder == NULL)
+		return NULL;
+
+	g_assert_cmpstr (_secret_session_decoder_get_content_type (decoder), ==, "text/plain");
+
+	result = g_string_new ("");
+	while ((n = _secret_session_decoder_next (decoder, &chunk)) > 0) {
+		g_assert_cmpint (n, <=, SECRET_SESSION_STREAM_CHUNK);
+		g_string_append_len (result, chunk, n);
+	}
+	g_assert_cmpint (n, ==, 0);
+
+	_secret_session_decoder_free (decoder);
+	return result;
+}
+
+static void
+test_stream_codec (Test *test,
+                   gconstpointer unused)
+{
+	const gsize lengths[] = { 0, 1, 15, 16, 17, 33, SECRET_SESSION_STREAM_CHUNK,
+	                          SECRET_SESSION_STREAM_CHUNK * 2 + 21 };
+	const gsize steps[] = { 1, 7, 16, SECRET_SESSION_STREAM_CHUNK };
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded;
+	GVariant *encoded;
+	GError *error = NULL;
+	GString *streamed;
+	gchar *secret;
+	gsize length;
+	gboolean ret;
+	guint i, j;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+
+	for (i = 0; i < G_N_ELEMENTS (lengths); i++) {
+		secret = g_strnfill (lengths[i], 'a' + (i % 26));
+
+		/* Streamed in however it's split up, decoded in one go */
+		for (j = 0; j < G_N_ELEMENTS (steps); j++) {
+			if (lengths[i] / steps[j] > 512)
+				continue;
+			encoded = encode_stream (session, secret, lengths[i], steps[j]);
+			decoded = _secret_session_decode_secret (session, encoded);
+			g_assert (decoded != NULL);
+			egg_assert_cmpmem (secret_value_get (decoded, &length), length,
+			                   ==, secret, lengths[i]);
+			g_assert_cmpstr (secret_value_get_content_type (decoded), ==, "text/plain");
+			secret_value_unref (decoded);
+			g_variant_unref (encoded);
+		}
+
+		/* Encoded in one go, streamed out */
+		value = secret_value_new (secret, lengths[i], "text/plain");
+		encoded = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+		streamed = decode_stream (session, encoded);
+		g_assert (streamed != NULL);
+		egg_assert_cmpmem (streamed->str, streamed->len, ==, secret, lengths[i]);
+		g_string_free (streamed, TRUE);
+		g_variant_unref (encoded);
+		secret_value_unref (value);
+
+		g_free (secret);
+	}
+}
+
+#ifdef HAVE_MEMFD_CREATE
+
+static void
+test_fd_codec (Test *test,
+               gconstpointer unused)
+{
+	SecretSessionDecoder *decoder;
+	SecretSession *session;
+	SecretValue *value;
+	GVariant *encoded;
+	GVariant *unsealed;
+	GVariant *params;
+	GUnixFDList *fds;
+	GError *error = NULL;
+	GString *streamed;
+	gconstpointer chunk;
+	gchar *secret;
+	gsize length;
+	gboolean ret;
+	gssize n;
+	int fd;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+
+	length = SECRET_SESSION_STREAM_CHUNK * 3 + 5;
+	secret = g_strnfill (length, 'm');
+	value = secret_value_new (secret, length, "text/plain");
+
+	fds = g_unix_fd_list_new ();
+	encoded = g_variant_ref_sink (_secret_session_encode_secret_fd (session, value, fds));
+	g_assert (encoded != NULL);
+	g_assert (g_variant_is_of_type (encoded, G_VARIANT_TYPE ("(oayhs)")));
+	g_assert_cmpint (g_unix_fd_list_get_length (fds), ==, 1);
+
+	decoder = _secret_session_decoder_new_fd (session, encoded, fds);
+	g_assert (decoder != NULL);
+
+	streamed = g_string_new ("");
+	while ((n = _secret_session_decoder_next (decoder, &chunk)) > 0)
+		g_string_append_len (streamed, chunk, n);
+	g_assert_cmpint (n, ==, 0);
+	egg_assert_cmpmem (streamed->str, streamed->len, ==, secret, length);
+	g_string_free (streamed, TRUE);
+	_secret_session_decoder_free (decoder);
+	g_object_unref (fds);
+
+	/* A memfd that could still be changed by the sender is refused */
+	fds = g_unix_fd_list_new ();
+	fd = memfd_create ("test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	g_assert_cmpint (fd, >=, 0);
+	g_assert_cmpint (write (fd, secret, length), ==, length);
+	g_assert_cmpint (g_unix_fd_list_append (fds, fd, &error), ==, 0);
+	g_assert_no_error (error);
+	close (fd);
+
+	params = g_variant_get_child_value (encoded, 1);
+	unsealed = g_variant_ref_sink (g_variant_new ("(o@ayhs)", _secret_session_get_path (session),
+	                                              params, 0, "text/plain"));
+	g_assert (_secret_session_decoder_new_fd (session, unsealed, fds) == NULL);
+	g_variant_unref (unsealed);
+	g_variant_unref (params);
+	g_object_unref (fds);
+
+	g_variant_unref (encoded);
+	secret_value_unref (value);
+	g_free (secret);
+}
+
+#endif /* HAVE_MEMFD_CREATE */
+
+#ifdef EXPECT_GCM
+
+static GVariant *
+tamper_encoded (GVariant *encoded,
+                guint child,
+                const gchar *content_type)
+{
+	GVariant *children[4];
+	GVariant *result;
+	guchar *data;
+	gsize n_data;
+	guint i;
+
+	for (i = 0; i < 4; i++)
+		children[i] = g_variant_get_child_value (encoded, i);
+
+	if (content_type != NULL) {
+		g_variant_unref (children[3]);
+		children[3] = g_variant_new_string (content_type);
+	} else {
+		data = g_memdup (g_variant_get_data (children[child]), g_variant_get_size (children[child]));
+		n_data = g_variant_get_size (children[child]);
+		data[n_data - 1] ^= 0x01;
+		g_variant_unref (children[child]);
+		children[child] = g_variant_new_from_data (G_VARIANT_TYPE ("ay"), data, n_data,
+		                                           TRUE, g_free, data);
+	}
+
+	result = g_variant_ref_sink (g_variant_new_tuple (children, 4));
+	for (i = 0; i < 4; i++)
+		g_variant_unref (children[i]);
+
+	return result;
+}
+
+static void
+test_decode_tampered (Test *test,
+                      gconstpointer unused)
+{
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded;
+	GVariant *encoded;
+	GVariant *tampered;
+	GError *error = NULL;
+	guint before, after;
+	gsize n_before, n_after;
+	gboolean ret;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, EXPECT_GCM);
+
+	session = _secret_service_get_session (test->service);
+	value = secret_value_new ("authenticated", -1, "text/plain");
+	encoded = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+	secret_value_unref (value);
+
+	count_secure_records (&before, &n_before);
+
+	/* A changed IV, ciphertext or tag, or content type, is rejected */
+	tampered = tamper_encoded (encoded, 1, NULL);
+	g_assert (_secret_session_decode_secret (session, tampered) == NULL);
+	g_variant_unref (tampered);
+
+	tampered = tamper_encoded (encoded, 2, NULL);
+	g_assert (_secret_session_decode_secret (session, tampered) == NULL);
+	g_variant_unref (tampered);
+
+	tampered = tamper_encoded (encoded, 0, "text/html");
+	g_assert (_secret_session_decode_secret (session, tampered) == NULL);
+	g_variant_unref (tampered);
+
+	/* Without leaking the secure memory allocated for them */
+	count_secure_records (&after, &n_after);
+	g_assert_cmpuint (after, ==, before);
+
+	decoded = _secret_session_decode_secret (session, encoded);
+	g_assert (decoded != NULL);
+	g_assert_cmpstr (secret_value_get (decoded, NULL), ==, "authenticated");
+	secret_value_unref (decoded);
+
+	g_variant_unref (encoded);
+}
+
+static void
+test_stream_tampered (Test *test,
+                      gconstpointer unused)
+{
+	SecretSession *session;
+	GVariant *encoded;
+	GVariant *tampered;
+	GError *error = NULL;
+	GString *streamed;
+	gchar *secret;
+	gboolean ret;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+	g_assert_cmpstr (secret_service_get_session_algorithms (test->service), ==, EXPECT_GCM);
+
+	session = _secret_service_get_session (test->service);
+	secret = g_strnfill (SECRET_SESSION_STREAM_CHUNK * 2, 'x');
+	encoded = encode_stream (session, secret, SECRET_SESSION_STREAM_CHUNK * 2,
+	                         SECRET_SESSION_STREAM_CHUNK);
+
+	/* Nothing at all is handed out when the tag doesn't match */
+	tampered = tamper_encoded (encoded, 2, NULL);
+	g_assert (decode_stream (session, tampered) == NULL);
+	g_variant_unref (tampered);
+
+	tampered = tamper_encoded (encoded, 0, "text/html");
+	g_assert (_secret_session_decoder_new (session, tampered) == NULL);
+	g_variant_unref (tampered);
+
+	streamed = decode_stream (session, encoded);
+	g_assert (streamed != NULL);
+	egg_assert_cmpmem (streamed->str, streamed->len, ==, secret, SECRET_SESSION_STREAM_CHUNK * 2);
+	g_string_free (streamed, TRUE);
+
+	g_variant_unref (encoded);
+	g_free (secret);
+}
+
+#endif /* EXPECT_GCM */
+
+static void
+test_transfer_perf (Test *test,
+                    gconstpointer unused)
+{
+	SecretSession *session;
+	SecretValue *value;
+	SecretValue *decoded;
+	GVariant *encoded;
+	GError *error = NULL;
+	gdouble elapsed;
+	gboolean ret;
+	gint i, count;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+	g_assert (session != NULL);
+
+	value = secret_value_new ("the secret password", -1, "text/plain");
+	count = 10000;
+
+	g_test_timer_start ();
+
+	for (i = 0; i < count; i++) {
+		encoded = g_variant_ref_sink (_secret_session_encode_secret (session, value));
+		decoded = _secret_session_decode_secret (session, encoded);
+		g_assert (decoded != NULL);
+		secret_value_unref (decoded);
+		g_variant_unref (encoded);
+	}
+
+	elapsed = g_test_timer_elapsed ();
+	g_test_minimized_result (elapsed * G_USEC_PER_SEC / count,
+	                         "%s: %.2f usec per encoded and decoded secret",
+	                         secret_service_get_session_algorithms (test->service),
+	                         elapsed * G_USEC_PER_SEC / count);
+
+	secret_value_unref (value);
+}
+
+static void
+test_open_session_perf (Test *test,
+                        gconstpointer unused)
+{
+	SecretService *service;
+	GError *error = NULL;
+	gdouble elapsed;
+	gchar *algorithms = NULL;
+	gint i, count;
+
+	count = 50;
+	elapsed = 0;
+
+	for (i = 0; i < count; i++) {
+		g_test_timer_start ();
+		service = secret_service_new_sync (SECRET_TYPE_SERVICE, NULL,
+		                                   SECRET_SERVICE_OPEN_SESSION, NULL, &error);
+		elapsed += g_test_timer_elapsed ();
+		g_assert_no_error (error);
+
+		g_free (algorithms);
+		algorithms = g_strdup (secret_service_get_session_algorithms (service));
+		g_object_unref (service);
+	}
+
+	g_test_minimized_result (elapsed * 1000 / count, "%s: %.3f msec per OpenSession",
+	                         algorithms, elapsed * 1000 / count);
+	g_free (algorithms);
+}
+
+static GVariant *
+build_get_secrets_reply (SecretSession *session,
+                         guint count)
+{
+	GVariantBuilder builder;
+	SecretValue *value;
+	gchar *path;
+	gchar *secret;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{o(oayays)}"));
+
+	for (i = 0; i < count; i++) {
+		path = g_strdup_printf ("/org/freedesktop/secrets/collection/bench/%u", i);
+		secret = g_strdup_printf ("password number %u", i);
+		value = secret_value_new (secret, -1, "text/plain");
+		g_variant_builder_add (&builder, "{o@(oayays)}", path,
+		                       _secret_session_encode_secret (session, value));
+		secret_value_unref (value);
+		g_free (secret);
+		g_free (path);
+	}
+
+	return g_variant_ref_sink (g_variant_new ("(@a{o(oayays)})",
+	                                          g_variant_builder_end (&builder)));
+}
+
+static gdouble
+time_decode_get_secrets (SecretService *service,
+                         GVariant *reply,
+                         guint count)
+{
+	GHashTable *values;
+	gdouble elapsed;
+
+	g_test_timer_start ();
+	values = _secret_service_decode_get_secrets_all (service, reply);
+	elapsed = g_test_timer_elapsed ();
+
+	g_assert_cmpuint (g_hash_table_size (values), ==, count);
+	g_hash_table_unref (values);
+
+	return elapsed;
+}
+
+static void
+test_decode_all_perf (Test *test,
+                      gconstpointer unused)
+{
+	SecretSession *session;
+	GError *error = NULL;
+	GVariant *reply;
+	gdouble serial;
+	gdouble threaded;
+	gboolean ret;
+	guint count;
+
+	ret = secret_service_ensure_session_sync (test->service, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret == TRUE);
+
+	session = _secret_service_get_session (test->service);
+	g_assert (session != NULL);
+
+	for (count = 10; count <= 100000; count *= 10) {
+		reply = build_get_secrets_reply (session, count);
+
+		_secret_session_set_decode_threads (0, 256);
+		serial = time_decode_get_secrets (test->service, reply, count);
+
+		_secret_session_set_decode_threads (4, 0);
+		threaded = time_decode_get_secrets (test->service, reply, count);
+
+		g_test_minimized_result (threaded, "%s: %u secrets decoded in %.4f sec serially, "
+		                         "%.4f sec on 4 threads",
+		                         secret_service_get_session_algorithms (test->service),
+		                         count, serial, threaded);
+
+		g_variant_unref (reply);
+	}
+
+	_secret_session_set_decode_threads (0, 256);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -225,9 +1048,43 @@ main (int argc, char **argv)
 	g_test_add ("/session/ensure-aes", Test, "mock-service-normal.py", setup, test_ensure, teardown);
 	g_test_add ("/session/ensure-twice", Test, "mock-service-normal.py", setup, test_ensure_twice, teardown);
 	g_test_add ("/session/ensure-plain", Test, "mock-service-only-plain.py", setup, test_ensure_plain, teardown);
+	g_test_add ("/session/ensure-reconnect-aes", Test, "dh-ietf1024-sha256-aes128-cbc-pkcs7", setup_reconnect, test_ensure_reconnect, teardown);
+	g_test_add ("/session/ensure-reconnect-plain", Test, "plain", setup_reconnect, test_ensure_reconnect, teardown);
 	g_test_add ("/session/ensure-async-aes", Test, "mock-service-normal.py", setup, test_ensure_async_aes, teardown);
 	g_test_add ("/session/ensure-async-plain", Test, "mock-service-only-plain.py", setup, test_ensure_async_plain, teardown);
+	g_test_add ("/session/ensure-prewarm", Test, "mock-service-normal.py", setup, test_ensure_prewarm, teardown);
+	g_test_add ("/session/decode-allocations-aes", Test, "mock-service-normal.py", setup, test_decode_allocations, teardown);
+	g_test_add ("/session/decode-allocations-plain", Test, "mock-service-only-plain.py", setup, test_decode_allocations, teardown);
+	g_test_add ("/session/decode-arena-aes", Test, "mock-service-normal.py", setup, test_decode_arena, teardown);
+	g_test_add ("/session/decode-arena-plain", Test, "mock-service-only-plain.py", setup, test_decode_arena, teardown);
+	g_test_add ("/session/decode-arena-bounded", Test, "mock-service-normal.py", setup, test_decode_arena_bounded, teardown);
 	g_test_add ("/session/ensure-async-twice", Test, "mock-service-only-plain.py", setup, test_ensure_async_twice, teardown);
+#ifdef EGG_DH_WITH_X25519
+	g_test_add ("/session/ensure-x25519", Test, "mock-service-x25519.py", setup, test_ensure_x25519, teardown);
+#endif
+	g_test_add ("/session/ensure-gcm", Test, "mock-service-gcm.py", setup, test_ensure_gcm, teardown);
+	g_test_add ("/session/decode-allocations-gcm", Test, "mock-service-gcm.py", setup, test_decode_allocations, teardown);
+	g_test_add ("/session/decode-arena-gcm", Test, "mock-service-gcm.py", setup, test_decode_arena, teardown);
+	g_test_add ("/session/stream-aes", Test, "mock-service-normal.py", setup, test_stream_codec, teardown);
+	g_test_add ("/session/stream-plain", Test, "mock-service-only-plain.py", setup, test_stream_codec, teardown);
+	g_test_add ("/session/stream-gcm", Test, "mock-service-gcm.py", setup, test_stream_codec, teardown);
+#ifdef HAVE_MEMFD_CREATE
+	g_test_add ("/session/fd-aes", Test, "mock-service-normal.py", setup, test_fd_codec, teardown);
+	g_test_add ("/session/fd-plain", Test, "mock-service-only-plain.py", setup, test_fd_codec, teardown);
+	g_test_add ("/session/fd-gcm", Test, "mock-service-gcm.py", setup, test_fd_codec, teardown);
+#endif
+#ifdef EXPECT_GCM
+	g_test_add ("/session/decode-tampered", Test, "mock-service-gcm.py", setup, test_decode_tampered, teardown);
+	g_test_add ("/session/stream-tampered", Test, "mock-service-gcm.py", setup, test_stream_tampered, teardown);
+#endif
+
+	if (g_test_perf ()) {
+		g_test_add ("/session/transfer-perf-aes", Test, "mock-service-normal.py", setup, test_transfer_perf, teardown);
+		g_test_add ("/session/transfer-perf-plain", Test, "mock-service-only-plain.py", setup, test_transfer_perf, teardown);
+		g_test_add ("/session/open-perf-dh", Test, "mock-service-normal.py", setup, test_open_session_perf, teardown);
+		g_test_add ("/session/open-perf-x25519", Test, "mock-service-x25519.py", setup, test_open_session_perf, teardown);
+		g_test_add ("/session/decode-all-perf-aes", Test, "mock-service-normal.py", setup, test_decode_all_perf, teardown);
+	}
 
 	return egg_tests_run_with_loop ();
 }
@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 EGG_SECURE_DECLARE (test_value);
 
@@ -58,6 +59,103 @@ test_new_terminated (void)
 	secret_value_unref (value);
 }
 
+static guint
+count_value_records (void)
+{
+	egg_secure_rec *records;
+	guint count, i, n_values = 0;
+
+	records = egg_secure_records (&count);
+	for (i = 0; i < count; i++) {
+		if (g_strcmp0 (records[i].tag, "secret_value") == 0)
+			n_values++;
+	}
+	free (records);
+
+	return n_values;
+}
+
+static void
+test_new_inline (void)
+{
+	SecretValue *value;
+	guint before;
+
+	before = count_value_records ();
+
+	/* The value and the secret are one allocation */
+	value = secret_value_new ("blah", -1, "text/plain");
+	g_assert_cmpuint (count_value_records (), ==, before + 1);
+
+	secret_value_unref (value);
+	g_assert_cmpuint (count_value_records (), ==, before);
+}
+
+static gboolean
+has_value_record (gsize request_length)
+{
+	egg_secure_rec *records;
+	gboolean found = FALSE;
+	guint count, i;
+
+	records = egg_secure_records (&count);
+	for (i = 0; i < count; i++) {
+		if (g_strcmp0 (records[i].tag, "secret_value") == 0 &&
+		    records[i].request_length == request_length)
+			found = TRUE;
+	}
+	free (records);
+
+	return found;
+}
+
+static void
+test_new_large (void)
+{
+	SecretValue *value;
+	gchar *secret;
+	gsize length;
+
+	secret = g_strnfill (4096, 'x');
+
+	/* Only the secret itself is in secure memory */
+	value = secret_value_new (secret, -1, "text/plain");
+	g_assert (has_value_record (4097));
+	g_assert_cmpstr (secret_value_get (value, &length), ==, secret);
+	g_assert_cmpuint (length, ==, 4096);
+
+	secret_value_unref (value);
+	g_assert (!has_value_record (4097));
+	g_free (secret);
+}
+
+static void
+test_content_type_copied (void)
+{
+	SecretValue *value1;
+	SecretValue *value2;
+	gchar *content_type;
+
+	content_type = g_strdup ("application/x-test-value");
+	value1 = secret_value_new ("blah", -1, content_type);
+	value2 = secret_value_new_full (g_strdup ("blah"), -1, content_type, g_free);
+	g_free (content_type);
+
+	g_assert_cmpstr (secret_value_get_content_type (value1), ==, "application/x-test-value");
+	g_assert_cmpstr (secret_value_get_content_type (value2), ==, "application/x-test-value");
+
+	secret_value_unref (value1);
+	secret_value_unref (value2);
+
+	/* The well known types aren't copied */
+	value1 = secret_value_new ("blah", -1, "application/octet-stream");
+	value2 = secret_value_new_full (g_strdup ("blah"), -1, "application/octet-stream", g_free);
+	g_assert (secret_value_get_content_type (value1) == secret_value_get_content_type (value2));
+
+	secret_value_unref (value1);
+	secret_value_unref (value2);
+}
+
 static void
 test_new_full (void)
 {
@@ -94,6 +192,55 @@ test_new_full_terminated (void)
 	secret_value_unref (value);
 }
 
+static void
+test_new_from_bytes (void)
+{
+	SecretValue *value;
+	GBytes *bytes;
+	GBytes *shared;
+	gsize length;
+
+	bytes = g_bytes_new ("blahblah", 4);
+	value = secret_value_new_from_bytes (bytes, "text/plain");
+
+	/* No copy done here */
+	g_assert (secret_value_get (value, &length) == g_bytes_get_data (bytes, NULL));
+	g_assert_cmpuint (length, ==, 4);
+	g_assert_cmpstr (secret_value_get_content_type (value), ==, "text/plain");
+
+	/* Same bytes handed back */
+	shared = secret_value_get_bytes (value);
+	g_assert (shared == bytes);
+	g_bytes_unref (shared);
+
+	/* The value keeps the bytes alive */
+	g_bytes_unref (bytes);
+	g_assert (memcmp (secret_value_get (value, NULL), "blah", 4) == 0);
+
+	secret_value_unref (value);
+}
+
+static void
+test_get_bytes (void)
+{
+	SecretValue *value;
+	GBytes *bytes;
+	gsize length;
+
+	value = secret_value_new ("blah", -1, "text/plain");
+	bytes = secret_value_get_bytes (value);
+
+	/* No copy done here */
+	g_assert (g_bytes_get_data (bytes, &length) == secret_value_get (value, NULL));
+	g_assert_cmpuint (length, ==, 4);
+
+	/* The bytes keep the value alive */
+	secret_value_unref (value);
+	g_assert (memcmp (g_bytes_get_data (bytes, NULL), "blah", 4) == 0);
+
+	g_bytes_unref (bytes);
+}
+
 static void
 test_new_empty (void)
 {
@@ -165,6 +312,64 @@ test_to_password (void)
 	egg_secure_free (password);
 }
 
+static void
+test_to_password_inline (void)
+{
+	SecretValue *value;
+	gchar *password;
+	guint before;
+
+	before = count_value_records ();
+	value = secret_value_new ("blah", -1, "text/plain");
+
+	/* Reuses the allocation of the value */
+	password = _secret_value_unref_to_password (value);
+	g_assert_cmpstr (password, ==, "blah");
+	g_assert_cmpuint (count_value_records (), ==, before + 1);
+
+	egg_secure_free (password);
+	g_assert_cmpuint (count_value_records (), ==, before);
+}
+
+static void
+test_to_password_inline_long (void)
+{
+	SecretValue *value;
+	gchar *expected;
+	gchar *password;
+	gchar *after;
+	gsize i;
+
+	/* Long enough that moving it overwrites the whole structure */
+	expected = g_strnfill (100, 'p');
+	value = secret_value_new (expected, -1, "text/plain");
+
+	password = _secret_value_unref_to_password (value);
+	g_assert_cmpstr (password, ==, expected);
+
+	/* And the tail of the allocation has been cleared */
+	after = password + 101;
+	for (i = 0; i < _secret_value_shared_size (); i++)
+		g_assert_cmpint (after[i], ==, 0);
+
+	egg_secure_free (password);
+	g_free (expected);
+}
+
+static void
+test_to_string_inline (void)
+{
+	SecretValue *value;
+	gchar *string;
+
+	value = secret_value_new ("blah", -1, "text/plain");
+
+	string = _secret_value_unref_to_string (value);
+	g_assert_cmpstr (string, ==, "blah");
+
+	g_free (string);
+}
+
 static void
 test_to_password_bad_destroy (void)
 {
@@ -222,12 +427,20 @@ main (int argc, char **argv)
 
 	g_test_add_func ("/value/new", test_new);
 	g_test_add_func ("/value/new-terminated", test_new_terminated);
+	g_test_add_func ("/value/new-inline", test_new_inline);
+	g_test_add_func ("/value/new-large", test_new_large);
+	g_test_add_func ("/value/content-type-copied", test_content_type_copied);
 	g_test_add_func ("/value/new-full", test_new_full);
 	g_test_add_func ("/value/new-full-terminated", test_new_full_terminated);
+	g_test_add_func ("/value/new-from-bytes", test_new_from_bytes);
+	g_test_add_func ("/value/get-bytes", test_get_bytes);
 	g_test_add_func ("/value/new-empty", test_new_empty);
 	g_test_add_func ("/value/ref-unref", test_ref_unref);
 	g_test_add_func ("/value/boxed", test_boxed);
 	g_test_add_func ("/value/to-password", test_to_password);
+	g_test_add_func ("/value/to-password-inline", test_to_password_inline);
+	g_test_add_func ("/value/to-password-inline-long", test_to_password_inline_long);
+	g_test_add_func ("/value/to-string-inline", test_to_string_inline);
 	g_test_add_func ("/value/to-password-bad-destroy", test_to_password_bad_destroy);
 	g_test_add_func ("/value/to-password-bad-content", test_to_password_bad_content);
 	g_test_add_func ("/value/to-password-extra-ref", test_to_password_extra_ref);
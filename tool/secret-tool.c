@@ -237,15 +237,24 @@ static SecretValue *
 read_password_stdin (void)
 {
 	gchar *password;
-	gchar *at;
+	gchar *bigger;
 	gsize length = 0;
-	gsize remaining = 8192;
+	gsize allocated = 8192;
 	int r;
 
-	at = password = g_malloc0 (remaining + 1);
+	password = g_malloc0 (allocated + 1);
 
 	for (;;) {
-		r = read (0, at, remaining);
+		/* Grow without leaving copies of the password lying around */
+		if (length == allocated) {
+			allocated *= 2;
+			bigger = g_malloc0 (allocated + 1);
+			memcpy (bigger, password, length);
+			secret_password_free (password);
+			password = bigger;
+		}
+
+		r = read (0, password + length, allocated - length);
 		if (r == 0) {
 			break;
 		} else if (r < 0) {
@@ -255,11 +264,6 @@ read_password_stdin (void)
 				exit (1);
 			}
 		} else {
-			/* TODO: This restriction is due purely to laziness. */
-			if (r == remaining)
-				g_printerr ("%s: password is too long\n", g_get_prgname ());
-			at += r;
-			remaining -= r;
 			length += r;
 		}
 	}